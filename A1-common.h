@@ -5,6 +5,8 @@
 #include <stdbool.h>
 #include <stdint.h>
 
+#include "spi-context.h"
+
 /********** work queue */
 struct work_ent {
 	struct work *work;
@@ -44,6 +46,8 @@ struct A1_chip {
 	int fail_count;
 	/* mark chip disabled, do not try to re-enable it */
 	bool disabled;
+	/* a job for this chip is queued in the chain's batch */
+	bool job_queued;
 };
 
 struct A1_chain {
@@ -57,6 +61,10 @@ struct A1_chain {
 	uint8_t spi_tx[MAX_CMD_LENGTH];
 	uint8_t spi_rx[MAX_CMD_LENGTH];
 	struct spi_ctx *spi_ctx;
+	/* per chip command buffers for batched register reads and jobs */
+	struct spi_batch batch;
+	uint8_t (*batch_tx)[MAX_CMD_LENGTH];
+	uint8_t (*batch_rx)[MAX_CMD_LENGTH];
 	struct A1_chip *chips;
 	pthread_mutex_t lock;
 
@@ -32,7 +32,7 @@
 	defined(USE_MINION) || defined(USE_COINTERRA) || defined(USE_BITMINE_A1) || \
 	defined(USE_ANT_S1) || defined(USE_ANT_S2) || defined(USE_ANT_S3) || defined(USE_SP10) || \
 	defined(USE_SP30) || defined(USE_ICARUS) || defined(USE_HASHRATIO) || defined(USE_AVALON_MINER) || \
-	defined(USE_AVALON7) || defined(USE_AVALON8) || defined(USE_BITMAIN_SOC)
+	defined(USE_AVALON7) || defined(USE_AVALON8) || defined(USE_BITMAIN_SOC) || defined(USE_BM1370)
 #define HAVE_AN_ASIC 1
 #endif
 
@@ -47,6 +47,16 @@
 // However lots of PGA's may mean more
 #define QUEUE	100
 
+// Worker threads executing requests - read-only commands run concurrently
+#define API_WORKERS	4
+
+// Seconds an idle keep-alive connection is held open waiting for a request
+#define API_KEEPALIVE_IDLE	30
+
+/* Accept only half the TMPBUFSIZ per request to account for space
+ * potentially used by escaping chars. */
+#define API_LINESIZ	(TMPBUFSIZ / 2 - 1)
+
 #if defined WIN32
 static char WSAbuf[1024];
 
@@ -205,6 +215,9 @@ static const char *DEVICECODE = ""
 #ifdef USE_BITMINE_A1
 			"BA1 "
 #endif
+#ifdef USE_BM1370
+			"BM1370 "
+#endif
 #ifdef USE_ICARUS
 			"ICA "
 #endif
@@ -328,6 +341,7 @@ static const char ISJSON = '{';
 
 static const char *JSON_COMMAND = "command";
 static const char *JSON_PARAMETER = "parameter";
+static const char *JSON_KEEPALIVE = "keepalive";
 
 #define MSG_POOL 7
 #define MSG_NOPOOL 8
@@ -637,7 +651,47 @@ static pthread_mutex_t quit_restart_lock;
 static bool do_a_quit;
 static bool do_a_restart;
 
-static time_t when = 0;	// when the request occurred
+// Writemode commands hold this exclusively, all others share it
+static pthread_rwlock_t api_cmd_lock;
+
+// Replies that only report state and so can be reused for --api-cache ms
+static const char *API_CACHE_CMDS = "|version|config|devs|edevs|pools|summary|pga|pgacount|notify|devdetails|stats|estats|coin|usbstats|asc|asccount|lcd|";
+
+#define API_CACHE_SIZE	16
+
+struct api_cache {
+	char *key;
+	char *reply;
+	struct timeval built;
+	bool building;
+};
+
+// Requests for a reply that is being built wait on api_cache_cond
+static pthread_mutex_t api_cache_lock;
+static pthread_cond_t api_cache_cond;
+static struct api_cache api_cache[API_CACHE_SIZE];
+
+struct api_conn {
+	SOCKETTYPE c;
+	char *connectaddr;
+	char group;
+	bool served;
+	time_t idle;
+	int len;
+	char buf[API_LINESIZ + 1];
+	struct api_conn *next;
+};
+
+// Connections ready to be read, handed from the listener to the workers
+static struct thread_q *api_q;
+
+// Connections waiting on the listener for their next request
+static pthread_mutex_t api_idle_lock;
+static struct api_conn *api_idle;
+
+#ifndef WIN32
+static int api_wake[2] = { -1, -1 };
+#endif
 
 struct IPACCESS {
 	struct in6_addr ip;
@@ -668,6 +722,7 @@ struct io_data {
 	char *cur;
 	bool sock;
 	bool close;
+	time_t when;	// when the request occurred
 };
 
 struct io_list {
@@ -683,21 +738,28 @@ static struct io_list *io_head = NULL;
 #define io_new(init) _io_new(init, false)
 #define sock_io_new() _io_new(SOCKBUFALLOCSIZ, true)
 
-#define ALLOC_SBITEMS 2
-#define LIMIT_SBITEMS 0
+#define ALLOC_APIDATAS 8
+#define LIMIT_APIDATAS 0
 
-typedef struct sbitem {
+/*
+ * A reply section is built by packing each field into one buffer as
+ * a type byte, the name and the formatted value (both '\0' terminated)
+ * The buffers are reused from apidatas so building a reply, no matter
+ * how many fields, normally allocates nothing
+ */
+struct api_data {
+	K_ITEM *item;
 	char *buf;
 	size_t siz;
 	size_t tot;
-} SBITEM;
+};
 
 // Size to grow tot if exceeded
-#define SBEXTEND 4096
+#define ADEXTEND 4096
 
-#define DATASB(_item) ((SBITEM *)(_item->data))
+#define DATAAD(_item) ((struct api_data *)(_item->data))
 
-static K_LIST *strbufs;
+static K_LIST *apidatas;
 
 static void io_reinit(struct io_data *io_data)
 {
@@ -735,11 +797,10 @@ static struct io_data *_io_new(size_t initial, bool socket_buf)
 	return io_data;
 }
 
-static bool io_add(struct io_data *io_data, char *buf)
+static bool io_add_len(struct io_data *io_data, const char *buf, size_t len)
 {
-	size_t len, dif, tot;
+	size_t dif, tot;
 
-	len = strlen(buf);
 	dif = io_data->cur - io_data->ptr;
 	// send will always have enough space to add the JSON
 	tot = len + 1 + dif + sizeof(JSON_CLOSE) + sizeof(JSON_END);
@@ -755,12 +816,18 @@ static bool io_add(struct io_data *io_data, char *buf)
 		io_data->siz = new;
 	}
 
-	memcpy(io_data->cur, buf, len + 1);
+	memcpy(io_data->cur, buf, len);
 	io_data->cur += len;
+	*(io_data->cur) = '\0';
 
 	return true;
 }
 
+static bool io_add(struct io_data *io_data, const char *buf)
+{
+	return io_add_len(io_data, buf, strlen(buf));
+}
+
 static bool io_put(struct io_data *io_data, char *buf)
 {
 	io_reinit(io_data);
@@ -852,26 +919,48 @@ static char *escape_string(char *str, bool isjson)
 	return buf;
 }
 
-static struct api_data *api_add_extra(struct api_data *root, struct api_data *extra)
+static struct api_data *api_data_new(void)
 {
-	struct api_data *tmp;
+	struct api_data *root;
+	K_ITEM *item;
 
-	if (root) {
-		if (extra) {
-			// extra tail
-			tmp = extra->prev;
+	K_WLOCK(apidatas);
+	item = k_unlink_head(apidatas);
+	K_WUNLOCK(apidatas);
+
+	root = DATAAD(item);
+	root->item = item;
+	root->siz = 0;
+
+	return root;
+}
 
-			// extra prev = root tail
-			extra->prev = root->prev;
+static void api_data_free(struct api_data *root)
+{
+	K_WLOCK(apidatas);
+	k_add_head(apidatas, root->item);
+	K_WUNLOCK(apidatas);
+}
 
-			// root tail next = extra
-			root->prev->next = extra;
+static void api_data_add(struct api_data *root, const char *buf, size_t len)
+{
+	size_t ext;
 
-			// extra tail next = root
-			tmp->next = root;
+	if (root->tot < root->siz + len) {
+		ext = len + ADEXTEND - (len % ADEXTEND);
+		root->buf = cgrealloc(root->buf, root->tot + ext);
+		root->tot += ext;
+	}
+	memcpy(root->buf + root->siz, buf, len);
+	root->siz += len;
+}
 
-			// root prev = extra tail
-			root->prev = tmp;
+static struct api_data *api_add_extra(struct api_data *root, struct api_data *extra)
+{
+	if (root) {
+		if (extra) {
+			api_data_add(root, extra->buf, extra->siz);
+			api_data_free(extra);
 		}
 	} else
 		root = extra;
@@ -879,121 +968,111 @@ static struct api_data *api_add_extra(struct api_data *root, struct api_data *ex
 	return root;
 }
 
-static struct api_data *api_add_data_full(struct api_data *root, char *name, enum api_data_type type, void *data, bool copy_data)
+/*
+ * The value is formatted now, so unlike when the list held pointers,
+ * copy_data makes no difference - the field is a copy either way
+ */
+static struct api_data *api_add_data_full(struct api_data *root, char *name, enum api_data_type type, void *data, __maybe_unused bool copy_data)
 {
-	struct api_data *api_data;
-
-	api_data = cgmalloc(sizeof(struct api_data));
-
-	api_data->name = strdup(name);
-	api_data->type = type;
-
-	if (root == NULL) {
-		root = api_data;
-		root->prev = root;
-		root->next = root;
-	} else {
-		api_data->prev = root->prev;
-		root->prev = api_data;
-		api_data->next = root;
-		api_data->prev->next = api_data;
-	}
-
-	api_data->data_was_malloc = copy_data;
+	// N.B. strings don't use this buffer so 64 is enough (for now)
+	char buf[64];
+	const char *value = buf;
+	char typ;
 
 	// Avoid crashing on bad data
 	if (data == NULL) {
-		api_data->type = type = API_CONST;
+		type = API_CONST;
 		data = (void *)NULLSTR;
-		api_data->data_was_malloc = copy_data = false;
 	}
 
-	if (!copy_data)
-		api_data->data = data;
-	else
-		switch(type) {
-			case API_ESCAPE:
-			case API_STRING:
-			case API_CONST:
-				api_data->data = cgmalloc(strlen((char *)data) + 1);
-				strcpy((char*)(api_data->data), (char *)data);
-				break;
-			case API_UINT8:
-				/* Most OSs won't really alloc less than 4 */
-				api_data->data = cgmalloc(4);
-				*(uint8_t *)api_data->data = *(uint8_t *)data;
-				break;
-			case API_INT16:
-				/* Most OSs won't really alloc less than 4 */
-				api_data->data = cgmalloc(4);
-				*(int16_t *)api_data->data = *(int16_t *)data;
-				break;
-			case API_UINT16:
-				/* Most OSs won't really alloc less than 4 */
-				api_data->data = cgmalloc(4);
-				*(uint16_t *)api_data->data = *(uint16_t *)data;
-				break;
-			case API_INT:
-				api_data->data = cgmalloc(sizeof(int));
-				*((int *)(api_data->data)) = *((int *)data);
-				break;
-			case API_UINT:
-				api_data->data = cgmalloc(sizeof(unsigned int));
-				*((unsigned int *)(api_data->data)) = *((unsigned int *)data);
-				break;
-			case API_UINT32:
-				api_data->data = cgmalloc(sizeof(uint32_t));
-				*((uint32_t *)(api_data->data)) = *((uint32_t *)data);
-				break;
-			case API_HEX32:
-				api_data->data = cgmalloc(sizeof(uint32_t));
-				*((uint32_t *)(api_data->data)) = *((uint32_t *)data);
-				break;
-			case API_UINT64:
-				api_data->data = cgmalloc(sizeof(uint64_t));
-				*((uint64_t *)(api_data->data)) = *((uint64_t *)data);
-				break;
-			case API_INT64:
-				api_data->data = cgmalloc(sizeof(int64_t));
-				*((int64_t *)(api_data->data)) = *((int64_t *)data);
-				break;
-			case API_DOUBLE:
-			case API_ELAPSED:
-			case API_MHS:
-			case API_MHTOTAL:
-			case API_UTILITY:
-			case API_FREQ:
-			case API_HS:
-			case API_DIFF:
-			case API_PERCENT:
-				api_data->data = cgmalloc(sizeof(double));
-				*((double *)(api_data->data)) = *((double *)data);
-				break;
-			case API_BOOL:
-				api_data->data = cgmalloc(sizeof(bool));
-				*((bool *)(api_data->data)) = *((bool *)data);
-				break;
-			case API_TIMEVAL:
-				api_data->data = cgmalloc(sizeof(struct timeval));
-				memcpy(api_data->data, data, sizeof(struct timeval));
-				break;
-			case API_TIME:
-				api_data->data = cgmalloc(sizeof(time_t));
-				*(time_t *)(api_data->data) = *((time_t *)data);
-				break;
-			case API_VOLTS:
-			case API_TEMP:
-			case API_AVG:
-				api_data->data = cgmalloc(sizeof(float));
-				*((float *)(api_data->data)) = *((float *)data);
-				break;
-			default:
-				applog(LOG_ERR, "API: unknown1 data type %d ignored", type);
-				api_data->type = API_STRING;
-				api_data->data_was_malloc = false;
-				api_data->data = (void *)UNKNOWN;
-				break;
-		}
+	switch(type) {
+		case API_ESCAPE:
+		case API_STRING:
+		case API_CONST:
+			value = (char *)data;
+			break;
+		case API_UINT8:
+			snprintf(buf, sizeof(buf), "%u", *(uint8_t *)data);
+			break;
+		case API_INT16:
+			snprintf(buf, sizeof(buf), "%d", *(int16_t *)data);
+			break;
+		case API_UINT16:
+			snprintf(buf, sizeof(buf), "%u", *(uint16_t *)data);
+			break;
+		case API_INT:
+			snprintf(buf, sizeof(buf), "%d", *((int *)data));
+			break;
+		case API_UINT:
+			snprintf(buf, sizeof(buf), "%u", *((unsigned int *)data));
+			break;
+		case API_UINT32:
+			snprintf(buf, sizeof(buf), "%"PRIu32, *((uint32_t *)data));
+			break;
+		case API_HEX32:
+			snprintf(buf, sizeof(buf), "0x%08x", *((uint32_t *)data));
+			break;
+		case API_UINT64:
+			snprintf(buf, sizeof(buf), "%"PRIu64, *((uint64_t *)data));
+			break;
+		case API_INT64:
+			snprintf(buf, sizeof(buf), "%"PRId64, *((int64_t *)data));
+			break;
+		case API_TIME:
+			snprintf(buf, sizeof(buf), "%lu", *((unsigned long *)data));
+			break;
+		case API_DOUBLE:
+			snprintf(buf, sizeof(buf), "%f", *((double *)data));
+			break;
+		case API_ELAPSED:
+			snprintf(buf, sizeof(buf), "%.0f", *((double *)data));
+			break;
+		case API_UTILITY:
+		case API_FREQ:
+		case API_MHS:
+			snprintf(buf, sizeof(buf), "%.2f", *((double *)data));
+			break;
+		case API_VOLTS:
+		case API_AVG:
+			snprintf(buf, sizeof(buf), "%.3f", *((float *)data));
+			break;
+		case API_MHTOTAL:
+			snprintf(buf, sizeof(buf), "%.4f", *((double *)data));
+			break;
+		case API_HS:
+			snprintf(buf, sizeof(buf), "%.15f", *((double *)data));
+			break;
+		case API_DIFF:
+			snprintf(buf, sizeof(buf), "%.8f", *((double *)data));
+			break;
+		case API_BOOL:
+			value = *((bool *)data) ? TRUESTR : FALSESTR;
+			break;
+		case API_TIMEVAL:
+			snprintf(buf, sizeof(buf), "%ld.%06ld",
+				(long)((struct timeval *)data)->tv_sec,
+				(long)((struct timeval *)data)->tv_usec);
+			break;
+		case API_TEMP:
+			snprintf(buf, sizeof(buf), "%.2f", *((float *)data));
+			break;
+		case API_PERCENT:
+			snprintf(buf, sizeof(buf), "%.4f", *((double *)data) * 100.0);
+			break;
+		default:
+			applog(LOG_ERR, "API: unknown1 data type %d ignored", type);
+			type = API_STRING;
+			value = UNKNOWN;
+			break;
+	}
+
+	if (root == NULL)
+		root = api_data_new();
+
+	typ = (char)type;
+	api_data_add(root, &typ, 1);
+	api_data_add(root, name, strlen(name) + 1);
+	api_data_add(root, value, strlen(value) + 1);
 
 	return root;
 }
@@ -1133,206 +1212,105 @@ struct api_data *api_add_avg(struct api_data *root, char *name, float *data, boo
 	return api_add_data_full(root, name, API_AVG, (void *)data, copy_data);
 }
 
-static void add_item_buf(K_ITEM *item, const char *str)
+// Add str to io_data with the same escaping as escape_string()
+static void io_add_escape(struct io_data *io_data, const char *str, bool isjson)
 {
-	size_t old_siz, new_siz, siz, ext;
-	char *buf;
-
-	buf = DATASB(item)->buf;
-	siz = (size_t)strlen(str);
+	const char *ptr;
 
-	old_siz = DATASB(item)->siz;
-	new_siz = old_siz + siz + 1; // include '\0'
-	if (DATASB(item)->tot < new_siz) {
-		ext = (siz + 1) + SBEXTEND - ((siz + 1) % SBEXTEND);
-		DATASB(item)->buf = buf = cgrealloc(DATASB(item)->buf, DATASB(item)->tot + ext);
-		DATASB(item)->tot += ext;
+	for (ptr = str; *ptr; ptr++) {
+		switch (*ptr) {
+			case ',':
+			case '|':
+			case '=':
+				if (isjson)
+					continue;
+				break;
+			case '"':
+				if (!isjson)
+					continue;
+				break;
+			case '\\':
+				break;
+			default:
+				continue;
+		}
+		io_add_len(io_data, str, ptr - str);
+		io_add_len(io_data, "\\", 1);
+		str = ptr;
 	}
-	memcpy(buf + old_siz, str, siz + 1);
-	DATASB(item)->siz += siz;
+	io_add_len(io_data, str, ptr - str);
 }
 
 static struct api_data *print_data(struct io_data *io_data, struct api_data *root, bool isjson, bool precom)
 {
-	// N.B. strings don't use this buffer so 64 is enough (for now)
-	char buf[64];
-	struct api_data *tmp;
-	bool done, first = true;
-	char *original, *escape;
-	K_ITEM *item;
-
-	K_WLOCK(strbufs);
-	item = k_unlink_head(strbufs);
-	K_WUNLOCK(strbufs);
-
-	DATASB(item)->siz = 0;
+	enum api_data_type type;
+	bool quote, first = true;
+	char *ptr, *end, *name, *value;
 
 	if (precom)
-		add_item_buf(item, COMMA);
+		io_add(io_data, COMMA);
 
 	if (isjson)
-		add_item_buf(item, JSON0);
-
-	while (root) {
-		if (!first)
-			add_item_buf(item, COMMA);
-		else
-			first = false;
+		io_add(io_data, JSON0);
 
-		if (isjson)
-			add_item_buf(item, JSON1);
+	ptr = end = NULL;
+	if (root) {
+		ptr = root->buf;
+		end = root->buf + root->siz;
+	}
 
-		add_item_buf(item, root->name);
+	while (ptr < end) {
+		type = (enum api_data_type)(unsigned char)*(ptr++);
+		name = ptr;
+		ptr += strlen(name) + 1;
+		value = ptr;
+		ptr += strlen(value) + 1;
 
-		if (isjson)
-			add_item_buf(item, JSON1);
-
-		if (isjson)
-			add_item_buf(item, ":");
+		if (!first)
+			io_add(io_data, COMMA);
 		else
-			add_item_buf(item, "=");
+			first = false;
 
-		first = false;
+		if (isjson) {
+			io_add(io_data, JSON1);
+			io_add(io_data, name);
+			io_add(io_data, JSON1 ":");
+		} else {
+			io_add(io_data, name);
+			io_add(io_data, "=");
+		}
 
-		done = false;
-		switch(root->type) {
+		switch(type) {
+			case API_ESCAPE:
 			case API_STRING:
 			case API_CONST:
-				if (isjson)
-					add_item_buf(item, JSON1);
-				add_item_buf(item, (char *)(root->data));
-				if (isjson)
-					add_item_buf(item, JSON1);
-				done = true;
-				break;
-			case API_ESCAPE:
-				original = (char *)(root->data);
-				escape = escape_string((char *)(root->data), isjson);
-				if (isjson)
-					add_item_buf(item, JSON1);
-				add_item_buf(item, escape);
-				if (isjson)
-					add_item_buf(item, JSON1);
-				if (escape != original)
-					free(escape);
-				done = true;
-				break;
-			case API_UINT8:
-				snprintf(buf, sizeof(buf), "%u", *(uint8_t *)root->data);
-				break;
-			case API_INT16:
-				snprintf(buf, sizeof(buf), "%d", *(int16_t *)root->data);
-				break;
-			case API_UINT16:
-				snprintf(buf, sizeof(buf), "%u", *(uint16_t *)root->data);
-				break;
-			case API_INT:
-				snprintf(buf, sizeof(buf), "%d", *((int *)(root->data)));
-				break;
-			case API_UINT:
-				snprintf(buf, sizeof(buf), "%u", *((unsigned int *)(root->data)));
-				break;
-			case API_UINT32:
-				snprintf(buf, sizeof(buf), "%"PRIu32, *((uint32_t *)(root->data)));
-				break;
 			case API_HEX32:
-				if (isjson)
-					add_item_buf(item, JSON1);
-				snprintf(buf, sizeof(buf), "0x%08x", *((uint32_t *)(root->data)));
-				add_item_buf(item, buf);
-				if (isjson)
-					add_item_buf(item, JSON1);
-				done = true;
-				break;
-			case API_UINT64:
-				snprintf(buf, sizeof(buf), "%"PRIu64, *((uint64_t *)(root->data)));
-				break;
-			case API_INT64:
-				snprintf(buf, sizeof(buf), "%"PRId64, *((int64_t *)(root->data)));
-				break;
-			case API_TIME:
-				snprintf(buf, sizeof(buf), "%lu", *((unsigned long *)(root->data)));
-				break;
-			case API_DOUBLE:
-				snprintf(buf, sizeof(buf), "%f", *((double *)(root->data)));
-				break;
-			case API_ELAPSED:
-				snprintf(buf, sizeof(buf), "%.0f", *((double *)(root->data)));
-				break;
-			case API_UTILITY:
-			case API_FREQ:
-			case API_MHS:
-				snprintf(buf, sizeof(buf), "%.2f", *((double *)(root->data)));
-				break;
-			case API_VOLTS:
-			case API_AVG:
-				snprintf(buf, sizeof(buf), "%.3f", *((float *)(root->data)));
-				break;
-			case API_MHTOTAL:
-				snprintf(buf, sizeof(buf), "%.4f", *((double *)(root->data)));
-				break;
-			case API_HS:
-				snprintf(buf, sizeof(buf), "%.15f", *((double *)(root->data)));
-				break;
-			case API_DIFF:
-				snprintf(buf, sizeof(buf), "%.8f", *((double *)(root->data)));
-				break;
-			case API_BOOL:
-				snprintf(buf, sizeof(buf), "%s", *((bool *)(root->data)) ? TRUESTR : FALSESTR);
-				break;
-			case API_TIMEVAL:
-				snprintf(buf, sizeof(buf), "%ld.%06ld",
-					(long)((struct timeval *)(root->data))->tv_sec,
-					(long)((struct timeval *)(root->data))->tv_usec);
-				break;
-			case API_TEMP:
-				snprintf(buf, sizeof(buf), "%.2f", *((float *)(root->data)));
-				break;
-			case API_PERCENT:
-				snprintf(buf, sizeof(buf), "%.4f", *((double *)(root->data)) * 100.0);
+				quote = isjson;
 				break;
 			default:
-				applog(LOG_ERR, "API: unknown2 data type %d ignored", root->type);
-				if (isjson)
-					add_item_buf(item, JSON1);
-				add_item_buf(item, UNKNOWN);
-				if (isjson)
-					add_item_buf(item, JSON1);
-				done = true;
+				quote = false;
 				break;
 		}
 
-		if (!done)
-			add_item_buf(item, buf);
-
-		free(root->name);
-		if (root->data_was_malloc)
-			free(root->data);
-
-		if (root->next == root) {
-			free(root);
-			root = NULL;
-		} else {
-			tmp = root;
-			root = tmp->next;
-			root->prev = tmp->prev;
-			root->prev->next = root;
-			free(tmp);
-		}
+		if (quote)
+			io_add(io_data, JSON1);
+		if (type == API_ESCAPE)
+			io_add_escape(io_data, value, isjson);
+		else
+			io_add(io_data, value);
+		if (quote)
+			io_add(io_data, JSON1);
 	}
 
 	if (isjson)
-		add_item_buf(item, JSON5);
+		io_add(io_data, JSON5);
 	else
-		add_item_buf(item, SEPSTR);
-
-	io_add(io_data, DATASB(item)->buf);
+		io_add(io_data, SEPSTR);
 
-	K_WLOCK(strbufs);
-	k_add_head(strbufs, item);
-	K_WUNLOCK(strbufs);
+	if (root)
+		api_data_free(root);
 
-	return root;
+	return NULL;
 }
 
 #define DRIVER_COUNT_DRV(X) if (devices[i]->drv->drv_id == DRIVER_##X) \
@@ -1516,7 +1494,7 @@ static void message(struct io_data *io_data, int messageid, int paramid, char *p
 			}
 
 			root = api_add_string(root, _STATUS, severity, false);
-			root = api_add_time(root, "When", &when, false);
+			root = api_add_time(root, "When", &io_data->when, false);
 			root = api_add_int(root, "Code", &messageid, false);
 			root = api_add_escape(root, "Msg", buf, false);
 			/* Do not give out description for random probes to
@@ -1532,7 +1510,7 @@ static void message(struct io_data *io_data, int messageid, int paramid, char *p
 	}
 
 	root = api_add_string(root, _STATUS, "F", false);
-	root = api_add_time(root, "When", &when, false);
+	root = api_add_time(root, "When", &io_data->when, false);
 	int id = -1;
 	root = api_add_int(root, "Code", &id, false);
 	sprintf(buf, "%d", messageid);
@@ -2271,7 +2249,7 @@ static void edevstatus(struct io_data *io_data, __maybe_unused SOCKETTYPE c, __m
 			if (cgpu->usbinfo.nodev) {
 				if (howoldsec <= 0)
 					continue;
-				if ((when - cgpu->usbinfo.last_nodev.tv_sec) >= howoldsec)
+				if ((io_data->when - cgpu->usbinfo.last_nodev.tv_sec) >= howoldsec)
 					continue;
 			}
 #endif
@@ -2299,7 +2277,7 @@ static void edevstatus(struct io_data *io_data, __maybe_unused SOCKETTYPE c, __m
 			if (cgpu->usbinfo.nodev) {
 				if (howoldsec <= 0)
 					continue;
-				if ((when - cgpu->usbinfo.last_nodev.tv_sec) >= howoldsec)
+				if ((io_data->when - cgpu->usbinfo.last_nodev.tv_sec) >= howoldsec)
 					continue;
 			}
 #endif
@@ -3427,7 +3405,7 @@ static void minerestats(struct io_data *io_data, __maybe_unused SOCKETTYPE c, __
 		if (cgpu->usbinfo.nodev) {
 			if (howoldsec <= 0)
 				continue;
-			if ((when - cgpu->usbinfo.last_nodev.tv_sec) >= howoldsec)
+			if ((io_data->when - cgpu->usbinfo.last_nodev.tv_sec) >= howoldsec)
 				continue;
 		}
 #endif
@@ -4213,19 +4191,12 @@ static void tail_join(struct io_data *io_data, bool isjson)
 	}
 }
 
-static void send_result(struct io_data *io_data, SOCKETTYPE c, bool isjson)
+// Send the finished reply in io_data
+static void send_reply(struct io_data *io_data, SOCKETTYPE c)
 {
 	int count, sendc, res, tosend, len, n;
 	char *buf = io_data->ptr;
 
-	strcpy(buf, io_data->ptr);
-
-	if (io_data->close)
-		strcat(buf, JSON_CLOSE);
-
-	if (isjson)
-		strcat(buf, JSON_END);
-
 	len = strlen(buf);
 	tosend = len+1;
 
@@ -4277,12 +4248,28 @@ static void send_result(struct io_data *io_data, SOCKETTYPE c, bool isjson)
 	}
 }
 
+static void send_result(struct io_data *io_data, SOCKETTYPE c, bool isjson)
+{
+	char *buf = io_data->ptr;
+
+	if (io_data->close)
+		strcat(buf, JSON_CLOSE);
+
+	if (isjson)
+		strcat(buf, JSON_END);
+
+	send_reply(io_data, c);
+}
+
 static void tidyup(__maybe_unused void *arg)
 {
 	mutex_lock(&quit_restart_lock);
 
 	SOCKETTYPE *apisock = (SOCKETTYPE *)arg;
 
+	// wait for any command still running in a worker
+	wr_lock(&api_cmd_lock);
+
 	bye = true;
 
 	if (*apisock != INVSOCK) {
@@ -4298,6 +4285,8 @@ static void tidyup(__maybe_unused void *arg)
 
 	io_free();
 
+	wr_unlock(&api_cmd_lock);
+
 	mutex_unlock(&quit_restart_lock);
 }
 
@@ -4887,14 +4876,463 @@ void reCalculateAVG()
 }
 #endif
 
+// Does the (possibly joined) command list contain a writemode command
+static bool api_writemode(const char *cmd)
+{
+	const char *ptr, *end;
+	size_t len;
+	int i;
+
+	for (ptr = cmd; ptr; ptr = end ? end + 1 : NULL) {
+		end = strchr(ptr, CMDJOIN);
+		len = end ? (size_t)(end - ptr) : strlen(ptr);
+		for (i = 0; cmds[i].name != NULL; i++) {
+			if (cmds[i].iswritemode && strlen(cmds[i].name) == len &&
+			    strncmp(ptr, cmds[i].name, len) == 0)
+				return true;
+		}
+	}
+
+	return false;
+}
+
+// Can the reply to the (possibly joined) command list be cached
+static bool api_cacheable(const char *cmd)
+{
+	char cmdbuf[100];
+	const char *ptr, *end;
+	size_t len;
+
+	for (ptr = cmd; ptr; ptr = end ? end + 1 : NULL) {
+		end = strchr(ptr, CMDJOIN);
+		len = end ? (size_t)(end - ptr) : strlen(ptr);
+		if (len > sizeof(cmdbuf) - 3)
+			return false;
+		snprintf(cmdbuf, sizeof(cmdbuf), "|%.*s|", (int)len, ptr);
+		if (!strstr(API_CACHE_CMDS, cmdbuf))
+			return false;
+	}
+
+	return true;
+}
+
+/*
+ * Load a recent enough copy of the reply for key into io_data, waiting for
+ * it if another request is already building it
+ * Returns true if it's there to be sent as is, otherwise the caller is
+ * the one to build it and must api_cache_put() it
+ */
+static bool api_cache_get(struct io_data *io_data, const char *key)
+{
+	struct api_cache *ent;
+	struct timeval now;
+	int i;
+
+	mutex_lock(&api_cache_lock);
+	while (42) {
+		ent = NULL;
+		for (i = 0; i < API_CACHE_SIZE; i++) {
+			if (api_cache[i].key && strcmp(api_cache[i].key, key) == 0) {
+				ent = &api_cache[i];
+				break;
+			}
+		}
+		if (!ent || !ent->building)
+			break;
+		pthread_cond_wait(&api_cache_cond, &api_cache_lock);
+	}
+
+	if (ent && ent->reply) {
+		cgtime(&now);
+		if (ms_tdiff(&now, &ent->built) < opt_api_cache) {
+			io_put(io_data, ent->reply);
+			mutex_unlock(&api_cache_lock);
+			return true;
+		}
+	}
+
+	// Claim the entry, replacing the oldest one not being built if it's new
+	if (!ent) {
+		for (i = 0; i < API_CACHE_SIZE; i++) {
+			if (api_cache[i].building)
+				continue;
+			if (!api_cache[i].key) {
+				ent = &api_cache[i];
+				break;
+			}
+			if (!ent || tdiff(&ent->built, &api_cache[i].built) > 0)
+				ent = &api_cache[i];
+		}
+		// Every entry is being built, so just build it uncached
+		if (!ent) {
+			mutex_unlock(&api_cache_lock);
+			return false;
+		}
+		free(ent->key);
+		free(ent->reply);
+		ent->key = strdup(key);
+		ent->reply = NULL;
+	}
+	ent->building = true;
+	mutex_unlock(&api_cache_lock);
+
+	return false;
+}
+
+// Keep the reply for key and wake any requests waiting for it
+static void api_cache_put(const char *key, const char *reply)
+{
+	int i;
+
+	mutex_lock(&api_cache_lock);
+	for (i = 0; i < API_CACHE_SIZE; i++) {
+		if (api_cache[i].building && strcmp(api_cache[i].key, key) == 0) {
+			free(api_cache[i].reply);
+			api_cache[i].reply = strdup(reply);
+			cgtime(&api_cache[i].built);
+			api_cache[i].building = false;
+			pthread_cond_broadcast(&api_cache_cond);
+			break;
+		}
+	}
+	mutex_unlock(&api_cache_lock);
+}
+
+// Any change by a writemode command makes every cached reply stale
+static void api_cache_flush()
+{
+	int i;
+
+	mutex_lock(&api_cache_lock);
+	for (i = 0; i < API_CACHE_SIZE; i++) {
+		free(api_cache[i].key);
+		free(api_cache[i].reply);
+		api_cache[i].key = api_cache[i].reply = NULL;
+	}
+	mutex_unlock(&api_cache_lock);
+}
+
+/*
+ * Process one request on conn and send its reply
+ * Returns true if the client asked for the connection to be kept open
+ */
+static bool api_request(struct io_data *io_data, struct api_conn *conn, char *buf, int n)
+{
+	SOCKETTYPE c = conn->c;
+	char group = conn->group;
+	char param_buf[TMPBUFSIZ];
+	char key[TMPBUFSIZ];
+	char cmdbuf[100];
+	char *cmd = NULL;
+	char *param;
+	json_error_t json_err;
+	json_t *json_config = NULL;
+	json_t *json_val;
+	bool isjson, keepalive = false, writemode = false, cache = false;
+	bool did, isjoin = false, firstjoin;
+	char *cmdptr, *cmdsbuf = NULL;
+	int i, err = 0;
+
+	if (*buf != ISJSON) {
+		isjson = false;
+
+		param = strchr(buf, SEPARATOR);
+		if (param != NULL)
+			*(param++) = '\0';
+
+		cmd = buf;
+	}
+	else {
+		isjson = true;
+
+		param = NULL;
+
+		json_config = json_loadb(buf, n, 0, &json_err);
+
+		if (!json_is_object(json_config))
+			err = MSG_INVJSON;
+		else {
+			json_val = json_object_get(json_config, JSON_COMMAND);
+			if (json_val == NULL)
+				err = MSG_MISCMD;
+			else {
+				if (!json_is_string(json_val))
+					err = MSG_INVCMD;
+				else {
+					cmd = (char *)json_string_value(json_val);
+					json_val = json_object_get(json_config, JSON_PARAMETER);
+					if (json_is_string(json_val))
+						param = (char *)json_string_value(json_val);
+					else if (json_is_integer(json_val)) {
+						sprintf(param_buf, "%d", (int)json_integer_value(json_val));
+						param = param_buf;
+					} else if (json_is_real(json_val)) {
+						sprintf(param_buf, "%f", (double)json_real_value(json_val));
+						param = param_buf;
+					}
+				}
+			}
+			keepalive = json_is_true(json_object_get(json_config, JSON_KEEPALIVE));
+		}
+	}
+
+	if (!err)
+		writemode = api_writemode(cmd);
+
+	if (!err && !writemode && opt_api_cache > 0 && api_cacheable(cmd)) {
+		// group is in the key since it decides what the reply is allowed to show
+		i = snprintf(key, sizeof(key), "%c%c%s%c%s", isjson ? ISJSON : ' ', group,
+			     cmd, SEPARATOR, param ? param : BLANK);
+		cache = (i < (int)sizeof(key));
+	}
+
+	if (writemode)
+		wr_lock(&api_cmd_lock);
+	else
+		rd_lock(&api_cmd_lock);
+
+	// io_data is gone if the API shut down while we waited
+	if (bye) {
+		keepalive = false;
+		goto out;
+	}
+
+	// the time of the request in now
+	io_data->when = time(NULL);
+	io_reinit(io_data);
+
+	if (err) {
+		message(io_data, err, 0, NULL, isjson);
+		send_result(io_data, c, isjson);
+		goto out;
+	}
+
+	if (cache && api_cache_get(io_data, key)) {
+		send_reply(io_data, c);
+		goto out;
+	}
+
+	// bring the share totals up to date with the devices
+	fold_share_stats();
+
+	if (strchr(cmd, CMDJOIN)) {
+		firstjoin = isjoin = true;
+		// cmd + leading+tailing '|' + '\0'
+		cmdsbuf = cgmalloc(strlen(cmd) + 3);
+		strcpy(cmdsbuf, "|");
+		param = NULL;
+	} else
+		firstjoin = isjoin = false;
+
+	cmdptr = cmd;
+	do {
+		did = false;
+		if (isjoin) {
+			cmd = strchr(cmdptr, CMDJOIN);
+			if (cmd)
+				*(cmd++) = '\0';
+			if (!*cmdptr)
+				goto inochi;
+		}
+
+		for (i = 0; cmds[i].name != NULL; i++) {
+			if (strcmp(cmdptr, cmds[i].name) == 0) {
+				sprintf(cmdbuf, "|%s|", cmdptr);
+				if (isjoin) {
+					if (strstr(cmdsbuf, cmdbuf)) {
+						did = true;
+						break;
+					}
+					strcat(cmdsbuf, cmdptr);
+					strcat(cmdsbuf, "|");
+					head_join(io_data, cmdptr, isjson, &firstjoin);
+					if (!cmds[i].joinable) {
+						message(io_data, MSG_ACCDENY, 0, cmds[i].name, isjson);
+						did = true;
+						tail_join(io_data, isjson);
+						break;
+					}
+				}
+				if (ISPRIVGROUP(group) || strstr(COMMANDS(group), cmdbuf))
+					(cmds[i].func)(io_data, c, param, isjson, group);
+				else {
+					message(io_data, MSG_ACCDENY, 0, cmds[i].name, isjson);
+					applog(LOG_DEBUG, "API: access denied to '%s' for '%s' command", conn->connectaddr, cmds[i].name);
+				}
+
+				did = true;
+				if (!isjoin)
+					send_result(io_data, c, isjson);
+				else
+					tail_join(io_data, isjson);
+				break;
+			}
+		}
+
+		if (!did) {
+			if (isjoin)
+				head_join(io_data, cmdptr, isjson, &firstjoin);
+			message(io_data, MSG_INVCMD, 0, NULL, isjson);
+			if (isjoin)
+				tail_join(io_data, isjson);
+			else
+				send_result(io_data, c, isjson);
+		}
+inochi:
+		if (isjoin)
+			cmdptr = cmd;
+	} while (isjoin && cmdptr);
+
+	if (isjoin)
+		send_result(io_data, c, isjson);
+
+	if (cache)
+		api_cache_put(key, io_data->ptr);
+
+	free(cmdsbuf);
+out:
+	if (writemode) {
+		api_cache_flush();
+		wr_unlock(&api_cmd_lock);
+	} else
+		rd_unlock(&api_cmd_lock);
+
+	if (json_config)
+		json_decref(json_config);
+
+	return keepalive && !bye;
+}
+
+static void api_wakeup()
+{
+#ifndef WIN32
+	char ch = 0;
+
+	if (write(api_wake[1], &ch, 1) < 0)
+		applog(LOG_DEBUG, "API: wakeup write failed: %s", strerror(errno));
+#endif
+}
+
+static void api_conn_free(struct api_conn *conn)
+{
+	applog(LOG_DEBUG, "API: closing connection from %s", conn->connectaddr);
+	CLOSESOCKET(conn->c);
+	free(conn->connectaddr);
+	free(conn);
+}
+
+/*
+ * Requests are one per line, so a keep-alive client can pipeline several
+ * on one connection. A connection's first read without a newline is the
+ * whole request, as it has always been
+ */
+static void api_serve(struct io_data *io_data, struct api_conn *conn)
+{
+	char *buf, *nl;
+	bool keep = true;
+	int n;
+
+	n = recv(conn->c, conn->buf + conn->len, API_LINESIZ - conn->len, 0);
+	if (SOCKETFAIL(n) || n == 0) {
+		if (opt_debug && SOCKETFAIL(n))
+			applog(LOG_DEBUG, "API: recv failed: %s", SOCKERRMSG);
+		goto close;
+	}
+	conn->len += n;
+	conn->buf[conn->len] = '\0';
+
+	if (opt_debug)
+		applog(LOG_DEBUG, "API: recv command: (%d) '%s'", n, conn->buf + conn->len - n);
+
+	if (!conn->served && !memchr(conn->buf, '\n', conn->len)) {
+		conn->served = true;
+		keep = api_request(io_data, conn, conn->buf, conn->len);
+		conn->len = 0;
+	}
+
+	buf = conn->buf;
+	while (keep && (nl = memchr(buf, '\n', conn->len - (buf - conn->buf)))) {
+		*nl = '\0';
+		n = nl - buf;
+		if (n && buf[n - 1] == '\r')
+			buf[--n] = '\0';
+		if (n) {
+			conn->served = true;
+			keep = api_request(io_data, conn, buf, n);
+		}
+		buf = nl + 1;
+	}
+
+	if (!keep)
+		goto close;
+
+	conn->len -= buf - conn->buf;
+	memmove(conn->buf, buf, conn->len + 1);
+	if (conn->len >= API_LINESIZ) {
+		applog(LOG_DEBUG, "API: request too long from %s", conn->connectaddr);
+		goto close;
+	}
+
+	conn->idle = time(NULL);
+	mutex_lock(&api_idle_lock);
+	conn->next = api_idle;
+	api_idle = conn;
+	mutex_unlock(&api_idle_lock);
+	api_wakeup();
+	return;
+close:
+	api_conn_free(conn);
+	api_wakeup();
+}
+
+static void *api_worker(void *userdata)
+{
+	struct io_data *io_data = (struct io_data *)userdata;
+	struct api_conn *conn;
+
+	pthread_detach(pthread_self());
+
+	RenameThread("APIWorker");
+
+	while (!bye) {
+		conn = tq_pop(api_q);
+		if (conn)
+			api_serve(io_data, conn);
+	}
+
+	return NULL;
+}
+
+/*
+ * Hand readable idle connections to the workers and drop
+ * those that have waited too long
+ */
+static void api_idle_check(fd_set *rfds, time_t now)
+{
+	struct api_conn *conn, **prev;
+
+	mutex_lock(&api_idle_lock);
+	prev = &api_idle;
+	while ((conn = *prev)) {
+		if (FD_ISSET(conn->c, rfds)) {
+			*prev = conn->next;
+			tq_push(api_q, conn);
+		} else if (now - conn->idle > API_KEEPALIVE_IDLE || bye) {
+			*prev = conn->next;
+			api_conn_free(conn);
+		} else
+			prev = &conn->next;
+	}
+	mutex_unlock(&api_idle_lock);
+}
+
 void api(int api_thr_id)
 {
-	struct io_data *io_data;
+	struct io_data *io_data[API_WORKERS];
 	struct thr_info bye_thr;
-	char buf[TMPBUFSIZ];
-	char param_buf[TMPBUFSIZ];
-	SOCKETTYPE c;
-	int n, bound;
+	struct api_conn *conn;
+	SOCKETTYPE c, maxfd;
+	int bound, ret;
 	char *connectaddr;
 	char *binderror;
 	time_t bindstart;
@@ -4902,24 +5340,17 @@ void api(int api_thr_id)
 	char port_s[10];
 	struct sockaddr_storage cli;
 	socklen_t clisiz;
-	char cmdbuf[100];
-	char *cmd = NULL;
-	char *param;
+	struct timeval timeout;
+	fd_set rfds;
 	bool addrok;
 	char group;
-	json_error_t json_err;
-	json_t *json_config;
-	json_t *json_val;
-	bool isjson;
-	bool did, isjoin, firstjoin;
 	int i;
 	struct addrinfo hints, *res, *host;
 	SOCKETTYPE *apisock;
+	pthread_t pth;
 
 	apisock = cgmalloc(sizeof(*apisock));
 	*apisock = INVSOCK;
-	json_config = NULL;
-	isjoin = false;
 
 	if (!opt_api_listen) {
 		applog(LOG_DEBUG, "API not running%s", UNAVAILABLE);
@@ -4927,9 +5358,15 @@ void api(int api_thr_id)
 		return;
 	}
 
-	io_data = sock_io_new();
+	for (i = 0; i < API_WORKERS; i++)
+		io_data[i] = sock_io_new();
 
 	mutex_init(&quit_restart_lock);
+	rwlock_init(&api_cmd_lock);
+	mutex_init(&api_idle_lock);
+	mutex_init(&api_cache_lock);
+	if (unlikely(pthread_cond_init(&api_cache_cond, NULL)))
+		quit(1, "Failed to pthread_cond_init api_cache_cond");
 
 	pthread_cleanup_push(tidyup, (void *)apisock);
 	my_thr_id = api_thr_id;
@@ -5029,170 +5466,101 @@ void api(int api_thr_id)
 	if (opt_api_mcast)
 		mcast_init();
 
-	strbufs = k_new_list("StrBufs", sizeof(SBITEM), ALLOC_SBITEMS, LIMIT_SBITEMS, false);
+	apidatas = k_new_list("ApiDatas", sizeof(struct api_data), ALLOC_APIDATAS, LIMIT_APIDATAS, false);
+
+	api_q = tq_new();
+#ifndef WIN32
+	if (pipe(api_wake))
+		quit(1, "API failed to create wakeup pipe");
+#endif
+
+	for (i = 0; i < API_WORKERS; i++) {
+		if (unlikely(pthread_create(&pth, NULL, api_worker, io_data[i])))
+			quit(1, "API worker thread create failed");
+	}
 
 	while (!bye) {
-		clisiz = sizeof(cli);
-		if (SOCKETFAIL(c = accept(*apisock, (struct sockaddr *)(&cli), &clisiz))) {
+		FD_ZERO(&rfds);
+		FD_SET(*apisock, &rfds);
+		maxfd = *apisock;
+#ifndef WIN32
+		FD_SET(api_wake[0], &rfds);
+		if (api_wake[0] > maxfd)
+			maxfd = api_wake[0];
+		timeout.tv_sec = 1;
+		timeout.tv_usec = 0;
+#else
+		// No wakeup pipe on windows so poll for parked connections
+		timeout.tv_sec = 0;
+		timeout.tv_usec = 100000;
+#endif
+		mutex_lock(&api_idle_lock);
+		for (conn = api_idle; conn; conn = conn->next) {
+			FD_SET(conn->c, &rfds);
+			if (conn->c > maxfd)
+				maxfd = conn->c;
+		}
+		mutex_unlock(&api_idle_lock);
+
+		ret = select(maxfd + 1, &rfds, NULL, NULL, &timeout);
+		if (SOCKETFAIL(ret)) {
+			if (interrupted())
+				continue;
 			applog(LOG_ERR, "API failed (%s)%s (%d)", SOCKERRMSG, UNAVAILABLE, (int)*apisock);
 			goto die;
 		}
+		if (ret == 0)
+			FD_ZERO(&rfds);
 
-		addrok = check_connect((struct sockaddr_storage *)&cli, &connectaddr, &group);
-		applog(LOG_DEBUG, "API: connection from %s - %s",
-					connectaddr, addrok ? "Accepted" : "Ignored");
-
-		if (addrok) {
-			/* Accept only half the TMPBUFSIZ to account for space
-			 * potentially used by escaping chars. */
-			n = recv(c, &buf[0], TMPBUFSIZ / 2 - 1, 0);
-			if (SOCKETFAIL(n))
-				buf[0] = '\0';
-			else
-				buf[n] = '\0';
-
-			if (opt_debug) {
-				if (SOCKETFAIL(n))
-					applog(LOG_DEBUG, "API: recv failed: %s", SOCKERRMSG);
-				else
-					applog(LOG_DEBUG, "API: recv command: (%d) '%s'", n, buf);
-			}
-
-			if (!SOCKETFAIL(n)) {
-				// the time of the request in now
-				when = time(NULL);
-				io_reinit(io_data);
-
-				did = false;
-
-				if (*buf != ISJSON) {
-					isjson = false;
-
-					param = strchr(buf, SEPARATOR);
-					if (param != NULL)
-						*(param++) = '\0';
-
-					cmd = buf;
-				}
-				else {
-					isjson = true;
-
-					param = NULL;
+#ifndef WIN32
+		if (FD_ISSET(api_wake[0], &rfds)) {
+			char drain[64];
 
-					json_config = json_loadb(buf, n, 0, &json_err);
+			if (read(api_wake[0], drain, sizeof(drain)) < 0)
+				applog(LOG_DEBUG, "API: wakeup read failed: %s", strerror(errno));
+		}
+#endif
 
-					if (!json_is_object(json_config)) {
-						message(io_data, MSG_INVJSON, 0, NULL, isjson);
-						send_result(io_data, c, isjson);
-						did = true;
-					} else {
-						json_val = json_object_get(json_config, JSON_COMMAND);
-						if (json_val == NULL) {
-							message(io_data, MSG_MISCMD, 0, NULL, isjson);
-							send_result(io_data, c, isjson);
-							did = true;
-						} else {
-							if (!json_is_string(json_val)) {
-								message(io_data, MSG_INVCMD, 0, NULL, isjson);
-								send_result(io_data, c, isjson);
-								did = true;
-							} else {
-								cmd = (char *)json_string_value(json_val);
-								json_val = json_object_get(json_config, JSON_PARAMETER);
-								if (json_is_string(json_val))
-									param = (char *)json_string_value(json_val);
-								else if (json_is_integer(json_val)) {
-									sprintf(param_buf, "%d", (int)json_integer_value(json_val));
-									param = param_buf;
-								} else if (json_is_real(json_val)) {
-									sprintf(param_buf, "%f", (double)json_real_value(json_val));
-									param = param_buf;
-								}
-							}
-						}
-					}
-				}
+		api_idle_check(&rfds, time(NULL));
 
-				if (!did) {
-					char *cmdptr, *cmdsbuf = NULL;
-
-					if (strchr(cmd, CMDJOIN)) {
-						firstjoin = isjoin = true;
-						// cmd + leading+tailing '|' + '\0'
-						cmdsbuf = cgmalloc(strlen(cmd) + 3);
-						strcpy(cmdsbuf, "|");
-						param = NULL;
-					} else
-						firstjoin = isjoin = false;
-
-					cmdptr = cmd;
-					do {
-						did = false;
-						if (isjoin) {
-							cmd = strchr(cmdptr, CMDJOIN);
-							if (cmd)
-								*(cmd++) = '\0';
-							if (!*cmdptr)
-								goto inochi;
-						}
+		if (!FD_ISSET(*apisock, &rfds))
+			continue;
 
-						for (i = 0; cmds[i].name != NULL; i++) {
-							if (strcmp(cmdptr, cmds[i].name) == 0) {
-								sprintf(cmdbuf, "|%s|", cmdptr);
-								if (isjoin) {
-									if (strstr(cmdsbuf, cmdbuf)) {
-										did = true;
-										break;
-									}
-									strcat(cmdsbuf, cmdptr);
-									strcat(cmdsbuf, "|");
-									head_join(io_data, cmdptr, isjson, &firstjoin);
-									if (!cmds[i].joinable) {
-										message(io_data, MSG_ACCDENY, 0, cmds[i].name, isjson);
-										did = true;
-										tail_join(io_data, isjson);
-										break;
-									}
-								}
-								if (ISPRIVGROUP(group) || strstr(COMMANDS(group), cmdbuf))
-									(cmds[i].func)(io_data, c, param, isjson, group);
-								else {
-									message(io_data, MSG_ACCDENY, 0, cmds[i].name, isjson);
-									applog(LOG_DEBUG, "API: access denied to '%s' for '%s' command", connectaddr, cmds[i].name);
-								}
-
-								did = true;
-								if (!isjoin)
-									send_result(io_data, c, isjson);
-								else
-									tail_join(io_data, isjson);
-								break;
-							}
-						}
+		clisiz = sizeof(cli);
+		if (SOCKETFAIL(c = accept(*apisock, (struct sockaddr *)(&cli), &clisiz))) {
+			applog(LOG_ERR, "API failed (%s)%s (%d)", SOCKERRMSG, UNAVAILABLE, (int)*apisock);
+			goto die;
+		}
 
-						if (!did) {
-							if (isjoin)
-								head_join(io_data, cmdptr, isjson, &firstjoin);
-							message(io_data, MSG_INVCMD, 0, NULL, isjson);
-							if (isjoin)
-								tail_join(io_data, isjson);
-							else
-								send_result(io_data, c, isjson);
-						}
-inochi:
-						if (isjoin)
-							cmdptr = cmd;
-					} while (isjoin && cmdptr);
-				}
+		addrok = check_connect((struct sockaddr_storage *)&cli, &connectaddr, &group);
+		applog(LOG_DEBUG, "API: connection from %s - %s",
+					connectaddr, addrok ? "Accepted" : "Ignored");
 
-				if (isjoin)
-					send_result(io_data, c, isjson);
+#ifndef WIN32
+		// select() can't watch it
+		if (addrok && c >= FD_SETSIZE) {
+			applog(LOG_WARNING, "API: connection from %s dropped - fd %d too high",
+						connectaddr, (int)c);
+			addrok = false;
+		}
+#endif
 
-				if (isjson && json_is_object(json_config))
-					json_decref(json_config);
-			}
+		if (!addrok) {
+			CLOSESOCKET(c);
+			free(connectaddr);
+			continue;
 		}
-		CLOSESOCKET(c);
+
+		// parked until the request arrives so no worker blocks on it
+		conn = cgcalloc(1, sizeof(*conn));
+		conn->c = c;
+		conn->connectaddr = connectaddr;
+		conn->group = group;
+		conn->idle = time(NULL);
+		mutex_lock(&api_idle_lock);
+		conn->next = api_idle;
+		api_idle = conn;
+		mutex_unlock(&api_idle_lock);
 	}
 die:
 	/* Blank line fix for older compilers since pthread_cleanup_pop is a
@@ -5201,6 +5569,14 @@ die:
 	;
 	pthread_cleanup_pop(true);
 
+	// bye is now set so this drops every parked connection
+	FD_ZERO(&rfds);
+	api_idle_check(&rfds, time(NULL));
+
+	// an empty entry each wakes every worker to see bye and exit
+	for (i = 0; i < API_WORKERS; i++)
+		tq_push(api_q, NULL);
+
 	free(apisock);
 
 	if (opt_debug)
@@ -0,0 +1,701 @@
+/*
+ * Emulate a chain of Bitmain BM1366/BM1368/BM1370/BM1397 chips behind a
+ * UART on a pty, so drivers can be run and load tested without hardware.
+ *
+ * Jobs are hashed for real with the same SHA256 code cgminer uses, at up to
+ * the simulated hashrate, and every nonce meeting the chip's ticket mask is
+ * returned the way the chip would. Reply latency, CRC errors and dropped
+ * frames can be injected.
+ *
+ * Usage: asic-emulator [options]
+ *	--chip bm1366|bm1368|bm1370|bm1397	chip type (default: bm1370)
+ *	--chips N		chips on the chain (default: 1)
+ *	--hashrate GHS		simulated chain hashrate cap (default: 1000)
+ *	--latency MS		delay before each reply is sent (default: 0)
+ *	--crc-errors P		fraction of replies sent with a bad CRC
+ *	--drop P		fraction of frames dropped in each direction
+ *	--link PATH		symlink PATH to the pty for the miner to open
+ *	--nonce-log FILE	log the time each nonce is sent, with the job,
+ *				nonce and version bits
+ *	--seed N		seed for the error injection
+ *	--stats S		seconds between stats lines on stderr (default: 10)
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 3 of the License, or (at your option)
+ * any later version.  See COPYING for more details.
+ */
+
+#include "config.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <inttypes.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <termios.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "crc.h"
+#include "sha2.h"
+
+#define EMU_JOBS	128
+#define EMU_MIDSTATES	4
+#define EMU_CORES	128
+#define EMU_INBUF	4096
+/* Nonces scanned per big core per pass: the nonce is core << 25 | count */
+#define EMU_CORE_BITS	25
+#define EMU_BATCH	EMU_CORES
+
+struct chip_type {
+	const char *name;
+	uint16_t id;
+	int reply_len;
+	/* Versions each core rolls through in parallel */
+	int small_cores;
+	/* The reply job byte is job_id << job_shift | small core */
+	int job_shift;
+	/* BM1397 jobs carry midstates rather than the header */
+	bool midstates;
+};
+
+static const struct chip_type chip_types[] = {
+	{ "bm1366", 0x1366, 11, 8, 0, false },
+	{ "bm1368", 0x1368, 11, 16, 1, false },
+	{ "bm1370", 0x1370, 11, 16, 1, false },
+	{ "bm1397", 0x1397, 9, EMU_MIDSTATES, 0, true },
+	{ NULL, 0, 0, 0, 0, false }
+};
+
+struct emu_job {
+	bool valid;
+	uint8_t id;
+	int midstates;
+	uint32_t version;
+	/* The first 64 header bytes, or the chip supplied midstates */
+	unsigned char head[64];
+	uint32_t midstate[EMU_MIDSTATES][8];
+	/* Header bytes 64-75: end of merkle root, ntime and nbits */
+	unsigned char tail[12];
+};
+
+struct reply {
+	struct reply *next;
+	struct timespec due;
+	int len;
+	uint8_t buf[11];
+};
+
+static const struct chip_type *chip;
+static int chips = 1;
+static double hashrate = 1000e9;
+static int latency_ms;
+static double crc_rate, drop_rate;
+static int stats_secs = 10;
+static FILE *nonce_log;
+
+static int master_fd;
+
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t job_cond = PTHREAD_COND_INITIALIZER;
+static struct emu_job jobs[EMU_JOBS];
+static struct emu_job *current;
+static uint64_t job_seq;
+static uint32_t vmask;
+static uint32_t ticket_bits;
+static struct reply *reply_head, *reply_tail;
+static unsigned int seed = 1;
+
+static uint64_t stat_frames, stat_jobs, stat_bad_frames, stat_dropped_in;
+static uint64_t stat_nonces, stat_dropped_out, stat_corrupted;
+static uint64_t stat_hashes;
+
+static double now_secs(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* Only called with lock held */
+static bool chance(double p)
+{
+	return p > 0 && rand_r(&seed) < p * ((double)RAND_MAX + 1);
+}
+
+/* Queue a reply to go out after the latency, finishing its flags and CRC5
+ * and applying any injected errors. Called with lock held. */
+static void queue_reply(uint8_t *buf, int len, uint8_t flags)
+{
+	struct reply *r;
+
+	buf[0] = 0xAA;
+	buf[1] = 0x55;
+	buf[len - 1] = flags & 0xe0;
+	buf[len - 1] |= crc5_bits(buf + 2, (len - 3) * 8 + 3);
+
+	if (chance(drop_rate)) {
+		stat_dropped_out++;
+		return;
+	}
+	if (chance(crc_rate)) {
+		buf[2 + rand_r(&seed) % (len - 2)] ^= 1 << (rand_r(&seed) % 8);
+		stat_corrupted++;
+	}
+
+	r = calloc(1, sizeof(*r));
+	if (!r)
+		abort();
+	clock_gettime(CLOCK_MONOTONIC, &r->due);
+	r->due.tv_nsec += (long)latency_ms * 1000000;
+	r->due.tv_sec += r->due.tv_nsec / 1000000000;
+	r->due.tv_nsec %= 1000000000;
+	r->len = len;
+	memcpy(r->buf, buf, len);
+	if (reply_tail)
+		reply_tail->next = r;
+	else
+		reply_head = r;
+	reply_tail = r;
+}
+
+/* Send every reply that is due and return the ms until the next, or -1 */
+static int send_replies(void)
+{
+	struct timespec now;
+	struct reply *r;
+	long ms;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	pthread_mutex_lock(&lock);
+	while ((r = reply_head)) {
+		ms = (r->due.tv_sec - now.tv_sec) * 1000 +
+		     (r->due.tv_nsec - now.tv_nsec) / 1000000;
+		if (ms > 0) {
+			pthread_mutex_unlock(&lock);
+			return ms;
+		}
+		reply_head = r->next;
+		if (!reply_head)
+			reply_tail = NULL;
+		pthread_mutex_unlock(&lock);
+		if (write(master_fd, r->buf, r->len) != r->len)
+			fprintf(stderr, "asic-emulator: short write: %s\n", strerror(errno));
+		free(r);
+		pthread_mutex_lock(&lock);
+	}
+	pthread_mutex_unlock(&lock);
+	return -1;
+}
+
+static void reg_reply(uint8_t addr, uint8_t reg, uint32_t val)
+{
+	uint8_t buf[11];
+	int len = chip->reply_len;
+
+	memset(buf, 0, sizeof(buf));
+	buf[2] = val >> 24;
+	buf[3] = val >> 16;
+	buf[4] = val >> 8;
+	buf[5] = val;
+	buf[6] = addr;
+	buf[7] = reg;
+	queue_reply(buf, len, 0);
+}
+
+/* Called with lock held */
+static void do_command(uint8_t header, const uint8_t *data, int datalen)
+{
+	uint32_t val;
+	int i;
+
+	if ((header & 0x0f) == 0x02) {
+		/* Read: every chip answers a broadcast, chip id for register 0 */
+		for (i = 0; i < chips; i++) {
+			if (data[1] == 0)
+				reg_reply(i * (256 / chips), 0, (uint32_t)chip->id << 16);
+			else
+				reg_reply(i * (256 / chips), data[1], 0);
+			if (!(header & 0x10))
+				break;
+		}
+		return;
+	}
+	if ((header & 0x0f) != 0x01 || datalen < 6)
+		return;
+
+	val = (uint32_t)data[2] << 24 | data[3] << 16 | data[4] << 8 | data[5];
+	switch (data[1]) {
+		case 0x14:
+			/* Ticket mask: diff - 1 with each byte bit reversed */
+			ticket_bits = 0;
+			for (i = 0; i < 32; i++) {
+				if (val & (1U << ((i & ~7) + 7 - (i & 7))))
+					ticket_bits = i + 1;
+			}
+			break;
+		case 0xA4:
+			vmask = (val & 0xffff) << 13;
+			break;
+		default:
+			break;
+	}
+}
+
+static void sha256_mid(uint32_t *state, const unsigned char *head)
+{
+	uint32_t *s[1] = { state };
+	const unsigned char *b[1] = { head };
+
+	sha256_midstate_mb(s, b, 1);
+}
+
+/* Called with lock held */
+static void do_job(const uint8_t *data, int datalen)
+{
+	struct emu_job *job;
+	int i, j;
+
+	if (datalen < 14)
+		return;
+	job = &jobs[data[0] % EMU_JOBS];
+	memset(job, 0, sizeof(*job));
+	job->id = data[0];
+
+	if (chip->midstates) {
+		/* job_id, num_midstates, starting_nonce, nbits, ntime,
+		 * merkle4, then the midstates byte reversed */
+		job->midstates = data[1];
+		if (job->midstates < 1 || job->midstates > EMU_MIDSTATES ||
+		    datalen < 18 + 32 * job->midstates)
+			return;
+		memcpy(job->tail, data + 14, 4);
+		memcpy(job->tail + 4, data + 10, 4);
+		memcpy(job->tail + 8, data + 6, 4);
+		for (i = 0; i < job->midstates; i++) {
+			const uint8_t *ms = data + 18 + 32 * i;
+
+			for (j = 0; j < 8; j++)
+				job->midstate[i][j] = (uint32_t)ms[31 - j * 4] << 24 |
+						      ms[30 - j * 4] << 16 |
+						      ms[29 - j * 4] << 8 | ms[28 - j * 4];
+		}
+	} else {
+		/* job_id, num_midstates, starting_nonce, nbits, ntime,
+		 * merkle root and prev hash in reversed word order, version */
+		if (datalen < 82)
+			return;
+		job->midstates = 1;
+		job->version = (uint32_t)data[81] << 24 | data[80] << 16 | data[79] << 8 | data[78];
+		memcpy(job->head, data + 78, 4);
+		for (i = 0; i < 8; i++) {
+			memcpy(job->head + 4 + i * 4, data + 46 + (7 - i) * 4, 4);
+			if (i < 7)
+				memcpy(job->head + 36 + i * 4, data + 14 + (7 - i) * 4, 4);
+		}
+		memcpy(job->tail, data + 14, 4);
+		memcpy(job->tail + 4, data + 10, 4);
+		memcpy(job->tail + 8, data + 6, 4);
+	}
+	job->valid = true;
+	current = job;
+	job_seq++;
+	stat_jobs++;
+	pthread_cond_signal(&job_cond);
+}
+
+/* Take complete frames off the front of buf, returning the bytes used */
+static int parse_frames(uint8_t *buf, int len)
+{
+	int off = 0, flen;
+
+	while (len - off >= 5) {
+		uint8_t *f = buf + off;
+
+		if (f[0] != 0x55 || f[1] != 0xAA) {
+			off++;
+			continue;
+		}
+		flen = f[3] + 2;
+		if (flen < 5) {
+			off++;
+			continue;
+		}
+		if (len - off < flen)
+			break;
+
+		pthread_mutex_lock(&lock);
+		stat_frames++;
+		if (chance(drop_rate)) {
+			stat_dropped_in++;
+		} else if (f[2] & 0x20) {
+			unsigned short crc = crc16_false(f + 2, flen - 4);
+
+			if (crc != (f[flen - 2] << 8 | f[flen - 1]))
+				stat_bad_frames++;
+			else
+				do_job(f + 4, flen - 6);
+		} else {
+			if (crc5_bits(f + 2, (flen - 3) * 8) != f[flen - 1])
+				stat_bad_frames++;
+			else
+				do_command(f[2], f + 4, flen - 5);
+		}
+		pthread_mutex_unlock(&lock);
+		off += flen;
+	}
+	return off;
+}
+
+/* Spread the bits of n over the set bits of mask */
+static uint32_t deposit_bits(uint32_t n, uint32_t mask)
+{
+	uint32_t ret = 0, bit;
+
+	for (bit = 1; mask && bit; bit <<= 1) {
+		if (mask & bit) {
+			if (n & 1)
+				ret |= bit;
+			n >>= 1;
+		}
+	}
+	return ret;
+}
+
+/* Queue the reply for one nonce. Called with lock held. */
+static void nonce_reply(const struct emu_job *job, uint32_t nonce, int small, uint32_t vbits)
+{
+	uint8_t buf[11];
+	int len = chip->reply_len;
+
+	memset(buf, 0, sizeof(buf));
+	buf[2] = nonce >> 24;
+	buf[3] = nonce >> 16;
+	buf[4] = nonce >> 8;
+	buf[5] = nonce;
+	buf[6] = chip->midstates ? small : 0;
+	buf[7] = (job->id << chip->job_shift) | small;
+	if (len == 11) {
+		buf[8] = vbits >> 21;
+		buf[9] = vbits >> 13;
+	}
+	queue_reply(buf, len, 0x80);
+	stat_nonces++;
+	if (nonce_log) {
+		struct timespec ts;
+
+		/* The clock cgminer's log timestamps use */
+		clock_gettime(CLOCK_MONOTONIC, &ts);
+		fprintf(nonce_log, "%ld.%06ld %02x %08x %08x\n", (long)ts.tv_sec,
+			ts.tv_nsec / 1000, job->id, nonce, vbits);
+		fflush(nonce_log);
+	}
+}
+
+/* Work through the current job like the chain would: each pass every big
+ * core of every small core of every chip takes the next nonce in its
+ * range, with each small core and chip on its own rolled version */
+static void *hasher(void *arg)
+{
+	unsigned char tails[EMU_BATCH][16], digests[EMU_BATCH][32];
+	const unsigned char *tailp[EMU_BATCH];
+	unsigned char *digestp[EMU_BATCH];
+	uint32_t (*mid)[8] = NULL;
+	uint32_t *rolls = NULL;
+	uint64_t seq = 0, count = 0, epoch = 0, hashes = 0;
+	struct emu_job job;
+	uint32_t jvmask = 0;
+	double start = 0;
+	int lanes = 0, i, k, c;
+
+	(void)arg;
+	for (i = 0; i < EMU_BATCH; i++) {
+		tailp[i] = tails[i];
+		digestp[i] = digests[i];
+	}
+
+	while (42) {
+		uint32_t per_core, low, bits;
+
+		pthread_mutex_lock(&lock);
+		while (!current)
+			pthread_cond_wait(&job_cond, &lock);
+		if (seq != job_seq || count == 0) {
+			/* New job, or the nonce range ran out: start a new
+			 * set of versions */
+			if (seq != job_seq) {
+				epoch = 0;
+				seq = job_seq;
+			} else
+				epoch++;
+			job = *current;
+			jvmask = chip->midstates ? 0 : vmask;
+			lanes = chip->midstates ? job.midstates : chip->small_cores;
+			if (!chip->midstates && !jvmask)
+				lanes = 1;
+			pthread_mutex_unlock(&lock);
+
+			free(mid);
+			free(rolls);
+			mid = calloc(chips * lanes, sizeof(*mid));
+			rolls = calloc(chips * lanes, sizeof(*rolls));
+			if (!mid || !rolls)
+				abort();
+			for (c = 0; c < chips * lanes; c++) {
+				if (chip->midstates) {
+					memcpy(mid[c], job.midstate[c % lanes], 32);
+					continue;
+				}
+				uint64_t n = epoch * chips * lanes + c;
+				unsigned char head[64];
+				uint32_t version;
+
+				rolls[c] = jvmask ? deposit_bits(n, jvmask) : 0;
+				version = (job.version & ~jvmask) | rolls[c];
+				memcpy(head, job.head, 64);
+				head[0] = version;
+				head[1] = version >> 8;
+				head[2] = version >> 16;
+				head[3] = version >> 24;
+				sha256_mid(mid[c], head);
+			}
+			count = 0;
+			pthread_mutex_lock(&lock);
+		}
+		bits = ticket_bits;
+		pthread_mutex_unlock(&lock);
+
+		/* Each chip takes every chips'th count within a core's range */
+		per_core = (1U << EMU_CORE_BITS) / chips;
+		low = count * chips;
+		for (c = 0; c < chips; c++) {
+			for (i = 0; i < lanes; i++) {
+				for (k = 0; k < EMU_CORES; k++) {
+					uint32_t nonce = (uint32_t)k << EMU_CORE_BITS | (low + c);
+
+					memcpy(tails[k], job.tail, 12);
+					tails[k][12] = nonce >> 24;
+					tails[k][13] = nonce >> 16;
+					tails[k][14] = nonce >> 8;
+					tails[k][15] = nonce;
+				}
+				sha256d_midstate_tail_mb(mid[c * lanes + i], tailp, digestp, EMU_CORES);
+				for (k = 0; k < EMU_CORES; k++) {
+					unsigned char *d = digests[k];
+					uint64_t top;
+
+					if (d[31] | d[30] | d[29] | d[28])
+						continue;
+					top = (uint64_t)d[27] << 24 | d[26] << 16 | d[25] << 8 | d[24];
+					if (bits && (top >> (32 - bits)))
+						continue;
+					pthread_mutex_lock(&lock);
+					if (seq == job_seq)
+						nonce_reply(&job, (uint32_t)k << EMU_CORE_BITS | (low + c),
+							    i, rolls[c * lanes + i]);
+					pthread_mutex_unlock(&lock);
+				}
+			}
+		}
+		hashes += (uint64_t)chips * lanes * EMU_CORES;
+		if (++count >= per_core)
+			count = 0;
+
+		/* Hold the rate down to the simulated hashrate */
+		if (!start)
+			start = now_secs();
+		if (hashes >= 1000000) {
+			double ahead;
+
+			pthread_mutex_lock(&lock);
+			stat_hashes += hashes;
+			ahead = stat_hashes / hashrate - (now_secs() - start);
+			pthread_mutex_unlock(&lock);
+			hashes = 0;
+			if (ahead > 0.001)
+				usleep(ahead * 1e6);
+		}
+	}
+	return NULL;
+}
+
+static void print_stats(double elapsed)
+{
+	pthread_mutex_lock(&lock);
+	fprintf(stderr, "asic-emulator: %.0fs %"PRIu64" frames %"PRIu64" jobs %"PRIu64" bad "
+		"%"PRIu64" dropped in, %"PRIu64" nonces %"PRIu64" dropped out %"PRIu64" corrupted, "
+		"%.2fMH/s\n", elapsed, stat_frames, stat_jobs, stat_bad_frames, stat_dropped_in,
+		stat_nonces, stat_dropped_out, stat_corrupted, stat_hashes / elapsed / 1e6);
+	pthread_mutex_unlock(&lock);
+}
+
+static int open_pty(const char *link)
+{
+	struct termios tio;
+	char *name;
+	int fd, slave;
+
+	fd = posix_openpt(O_RDWR | O_NOCTTY);
+	if (fd < 0 || grantpt(fd) || unlockpt(fd) || !(name = ptsname(fd))) {
+		fprintf(stderr, "asic-emulator: pty: %s\n", strerror(errno));
+		exit(1);
+	}
+	/* Hold the slave open so the master never sees EIO between opens */
+	slave = open(name, O_RDWR | O_NOCTTY);
+	if (slave < 0 || tcgetattr(slave, &tio)) {
+		fprintf(stderr, "asic-emulator: %s: %s\n", name, strerror(errno));
+		exit(1);
+	}
+	cfmakeraw(&tio);
+	tcsetattr(slave, TCSANOW, &tio);
+
+	if (link) {
+		unlink(link);
+		if (symlink(name, link)) {
+			fprintf(stderr, "asic-emulator: symlink %s: %s\n", link, strerror(errno));
+			exit(1);
+		}
+	}
+	printf("%s\n", link ? link : name);
+	fflush(stdout);
+	return fd;
+}
+
+static void usage(void)
+{
+	fprintf(stderr, "Usage: asic-emulator [--chip bm1366|bm1368|bm1370|bm1397] [--chips N]\n"
+		"\t[--hashrate GHS] [--latency MS] [--crc-errors P] [--drop P]\n"
+		"\t[--link PATH] [--nonce-log FILE] [--seed N] [--stats S]\n");
+	exit(1);
+}
+
+int main(int argc, char **argv)
+{
+	static const struct option longopts[] = {
+		{ "chip", required_argument, NULL, 'c' },
+		{ "chips", required_argument, NULL, 'n' },
+		{ "hashrate", required_argument, NULL, 'h' },
+		{ "latency", required_argument, NULL, 'l' },
+		{ "crc-errors", required_argument, NULL, 'e' },
+		{ "drop", required_argument, NULL, 'd' },
+		{ "link", required_argument, NULL, 'L' },
+		{ "nonce-log", required_argument, NULL, 'N' },
+		{ "seed", required_argument, NULL, 's' },
+		{ "stats", required_argument, NULL, 'S' },
+		{ NULL, 0, NULL, 0 }
+	};
+	uint8_t inbuf[EMU_INBUF];
+	const char *link = NULL;
+	double start, next_stats;
+	pthread_t pth;
+	int opt, inlen = 0, used, ret, timeout;
+
+	chip = &chip_types[2];
+	while ((opt = getopt_long(argc, argv, "", longopts, NULL)) != -1) {
+		switch (opt) {
+			case 'c':
+				for (chip = chip_types; chip->name; chip++)
+					if (!strcasecmp(chip->name, optarg))
+						break;
+				if (!chip->name)
+					usage();
+				break;
+			case 'n':
+				chips = atoi(optarg);
+				if (chips < 1 || chips > 128)
+					usage();
+				break;
+			case 'h':
+				hashrate = atof(optarg) * 1e9;
+				if (hashrate <= 0)
+					usage();
+				break;
+			case 'l':
+				latency_ms = atoi(optarg);
+				break;
+			case 'e':
+				crc_rate = atof(optarg);
+				break;
+			case 'd':
+				drop_rate = atof(optarg);
+				break;
+			case 'L':
+				link = optarg;
+				break;
+			case 'N':
+				nonce_log = fopen(optarg, "w");
+				if (!nonce_log) {
+					fprintf(stderr, "asic-emulator: %s: %s\n", optarg, strerror(errno));
+					exit(1);
+				}
+				break;
+			case 's':
+				seed = strtoul(optarg, NULL, 0);
+				break;
+			case 'S':
+				stats_secs = atoi(optarg);
+				break;
+			default:
+				usage();
+		}
+	}
+
+	signal(SIGPIPE, SIG_IGN);
+	master_fd = open_pty(link);
+	fprintf(stderr, "asic-emulator: %d %s chip%s, %s SHA256, %.0fGH/s cap\n",
+		chips, chip->name, chips == 1 ? "" : "s", sha256_impl_name(), hashrate / 1e9);
+
+	if (pthread_create(&pth, NULL, hasher, NULL)) {
+		fprintf(stderr, "asic-emulator: thread create failed\n");
+		exit(1);
+	}
+
+	start = now_secs();
+	next_stats = start + stats_secs;
+	while (42) {
+		struct pollfd pfd = { master_fd, POLLIN, 0 };
+		double now;
+
+		timeout = send_replies();
+		now = now_secs();
+		if (stats_secs > 0) {
+			if (now >= next_stats) {
+				print_stats(now - start);
+				next_stats += stats_secs;
+			}
+			if (timeout < 0 || timeout > (next_stats - now) * 1000)
+				timeout = (next_stats - now) * 1000 + 1;
+		}
+		/* Replies from the hasher arrive without waking poll */
+		if (timeout < 0 || timeout > 10)
+			timeout = 10;
+
+		ret = poll(&pfd, 1, timeout);
+		if (ret <= 0)
+			continue;
+		ret = read(master_fd, inbuf + inlen, sizeof(inbuf) - inlen);
+		if (ret <= 0) {
+			if (ret < 0 && errno != EINTR && errno != EAGAIN && errno != EIO) {
+				fprintf(stderr, "asic-emulator: read: %s\n", strerror(errno));
+				exit(1);
+			}
+			continue;
+		}
+		inlen += ret;
+		used = parse_frames(inbuf, inlen);
+		inlen -= used;
+		memmove(inbuf, inbuf + used, inlen);
+		if (inlen == sizeof(inbuf))
+			inlen = 0;
+	}
+	return 0;
+}
@@ -46,6 +46,7 @@
 #else
 #include <winsock2.h>
 #include <windows.h>
+#include <fcntl.h>
 #endif
 #include <ccan/opt/opt.h>
 #include <jansson.h>
@@ -60,6 +61,7 @@ char *curly = ":D";
 #include "compat.h"
 #include "miner.h"
 #include "bench_block.h"
+#include "sharelog.h"
 #ifdef USE_USBUTILS
 #include "usbutils.h"
 #endif
@@ -70,6 +72,11 @@ char *curly = ":D";
 	#include <sys/wait.h>
 #endif
 
+#ifdef STRATUM_REACTOR
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#endif
+
 #ifdef USE_AVALON
 #include "driver-avalon.h"
 #endif
@@ -233,6 +240,7 @@ char *opt_api_allow = NULL;
 char *opt_api_groups;
 char *opt_api_description = PACKAGE_STRING;
 int opt_api_port = 4028;
+int opt_api_cache;
 char *opt_api_host = API_LISTEN_ADDR;
 bool opt_api_listen;
 bool opt_api_mcast;
@@ -305,6 +313,12 @@ char *opt_bab_options = NULL;
 #ifdef USE_BITMINE_A1
 char *opt_bitmine_a1_options = NULL;
 #endif
+#ifdef USE_BM1370
+#include "driver-bm1370.h"
+char *opt_bm1370_dev;
+int opt_bm1370_diff = BM1370_DIFF_DEF;
+int opt_bm1370_freq = BM1370_FREQ_DEF;
+#endif
 #ifdef USE_DRAGONMINT_T1
 #include "dragonmint_t1.h"
 char *opt_dragonmint_t1_options = NULL;
@@ -364,6 +378,7 @@ char *opt_minion_temp;
 char *opt_usb_select = NULL;
 int opt_usbdump = -1;
 bool opt_usb_list_all;
+bool opt_usb_stream;
 cgsem_t usb_resource_sem;
 static pthread_t usb_poll_thread;
 static bool usb_polling;
@@ -409,7 +424,6 @@ static pthread_mutex_t *stgd_lock;
 pthread_mutex_t console_lock;
 cglock_t ch_lock;
 static pthread_rwlock_t blk_lock;
-static pthread_mutex_t sshare_lock;
 
 pthread_rwlock_t netacc_lock;
 pthread_rwlock_t mining_thr_lock;
@@ -417,6 +431,7 @@ pthread_rwlock_t devices_lock;
 
 static pthread_mutex_t lp_lock;
 static pthread_cond_t lp_cond;
+static pthread_mutex_t stale_lock;
 
 pthread_mutex_t restart_lock;
 pthread_cond_t restart_cond;
@@ -454,7 +469,6 @@ int hw_errors;
 int64_t total_accepted, total_rejected, total_diff1;
 int64_t total_getworks, total_stale, total_discarded;
 double total_diff_accepted, total_diff_rejected, total_diff_stale;
-static int staged_rollable;
 unsigned int new_blocks;
 static unsigned int work_block;
 unsigned int found_blocks;
@@ -500,19 +514,22 @@ static struct block *blocks = NULL;
 
 int swork_id;
 
-/* For creating a hash database of stratum shares submitted that have not had
- * a response yet */
+/* Give up on a stratum share response after this many seconds */
+#define SSHARE_EXPIRE 120
+
+/* For creating a per pool hash database of stratum shares submitted that have
+ * not had a response yet */
 struct stratum_share {
 	UT_hash_handle hh;
+	struct list_head wheel;
 	bool block;
 	struct work *work;
 	int id;
 	time_t sshare_time;
 	time_t sshare_sent;
+	time_t sshare_expire;
 };
 
-static struct stratum_share *stratum_shares = NULL;
-
 char *opt_socks_proxy = NULL;
 int opt_suggest_diff;
 static const char def_conf[] = "cgminer.conf";
@@ -536,7 +553,22 @@ struct sigaction termhandler, inthandler, abrthandler;
 struct thread_q *getq;
 
 static uint32_t total_work;
-struct work *staged_work = NULL;
+
+/* Staged work is held in two lock free rings, one for rollable work and one
+ * for everything else, so consumers never serialise on stgd_lock. That lock
+ * and its conditions are only taken when a hash_pop caller or the getwork
+ * scheduler has to sleep. Producers take stage_lock, which keeps them out
+ * while filter_staged puts work back. Should a ring ever fill, work goes to
+ * the staged_spill hash under stage_lock instead, as does all work staged
+ * after it until the spill has been consumed, so staged order is kept. */
+#define STAGED_RING_SIZE 1024
+static struct cgring staged_works, staged_rolls;
+static pthread_mutex_t stage_lock;
+static struct work *staged_spill;
+static int staged_spilled;
+static int staged_count;
+static int staged_waiters;
+static bool gws_waiting;
 
 struct schedtime {
 	bool enable;
@@ -638,6 +670,19 @@ static void applog_and_exit(const char *fmt, ...)
 
 static pthread_mutex_t sharelog_lock;
 static FILE *sharelog_file = NULL;
+static bool opt_sharelog_binary;
+
+/* Shares are formatted into sharelog_buf under sharelog_lock and the
+ * sharelog thread writes the buffer out in bulk, so finding a share never
+ * waits on the file. The file is fsync'd every SHARELOG_SYNC seconds. */
+#define SHARELOG_WAKE (64 * 1024)
+#define SHARELOG_FLUSH_MS 1000
+#define SHARELOG_SYNC 10
+
+static char *sharelog_buf;
+static size_t sharelog_len, sharelog_siz;
+static cgsem_t sharelog_sem;
+static bool sharelog_running;
 
 static struct thr_info *__get_thread(int thr_id)
 {
@@ -673,48 +718,179 @@ struct cgpu_info *get_devices(int id)
 	return cgpu;
 }
 
+static void sharelog_put(const void *buf, size_t len)
+{
+	bool wake;
+
+	mutex_lock(&sharelog_lock);
+	if (sharelog_len + len > sharelog_siz) {
+		sharelog_siz = (sharelog_len + len) * 2;
+		sharelog_buf = cgrealloc(sharelog_buf, sharelog_siz);
+	}
+	memcpy(sharelog_buf + sharelog_len, buf, len);
+	wake = (sharelog_len < SHARELOG_WAKE && sharelog_len + len >= SHARELOG_WAKE);
+	sharelog_len += len;
+	mutex_unlock(&sharelog_lock);
+
+	if (wake)
+		cgsem_post(&sharelog_sem);
+}
+
+static unsigned char *sharelog_le(unsigned char *ptr, uint64_t val, int bytes)
+{
+	while (bytes--) {
+		*(ptr++) = (unsigned char)val;
+		val >>= 8;
+	}
+	return ptr;
+}
+
+/* See sharelog.h for the layout */
+static void sharelog_binary(const char *disposition, const struct work *work,
+			    struct cgpu_info *cgpu, int thr_id)
+{
+	// the url is cut short, like the CSV line, to keep this on the stack small
+	unsigned char rec[SHARELOG_HEAD + SHARELOG_FIXED + 1 + 255 + 1 + 255 + 2 + 1024], *ptr;
+	size_t displen, drvlen, urllen;
+
+	displen = MIN(strlen(disposition), 255);
+	drvlen = MIN(strlen(cgpu->drv->name), 255);
+	urllen = MIN(strlen(work->pool->rpc_url), 1024);
+
+	ptr = rec;
+	*(ptr++) = SHARELOG_MAGIC;
+	*(ptr++) = SHARELOG_VERSION;
+	ptr = sharelog_le(ptr, SHARELOG_FIXED + 1 + displen + 1 + drvlen + 2 + urllen, 2);
+	ptr = sharelog_le(ptr, (uint64_t)work->tv_work_found.tv_sec, 8);
+	ptr = sharelog_le(ptr, (uint32_t)cgpu->device_id, 4);
+	ptr = sharelog_le(ptr, (uint32_t)thr_id, 4);
+	memcpy(ptr, work->target, SHARELOG_TARGET);
+	ptr += SHARELOG_TARGET;
+	memcpy(ptr, work->hash, SHARELOG_HASH);
+	ptr += SHARELOG_HASH;
+	memcpy(ptr, work->data, SHARELOG_DATA);
+	ptr += SHARELOG_DATA;
+	*(ptr++) = (unsigned char)displen;
+	memcpy(ptr, disposition, displen);
+	ptr += displen;
+	*(ptr++) = (unsigned char)drvlen;
+	memcpy(ptr, cgpu->drv->name, drvlen);
+	ptr += drvlen;
+	ptr = sharelog_le(ptr, urllen, 2);
+	memcpy(ptr, work->pool->rpc_url, urllen);
+	ptr += urllen;
+
+	sharelog_put(rec, ptr - rec);
+}
+
 static void sharelog(const char*disposition, const struct work*work)
 {
-	char *target, *hash, *data;
+	char target[SHARELOG_TARGET * 2 + 1], hash[SHARELOG_HASH * 2 + 1], data[SHARELOG_DATA * 2 + 1];
 	struct cgpu_info *cgpu;
 	unsigned long int t;
 	struct pool *pool;
 	int thr_id, rv;
 	char s[1024];
-	size_t ret;
 
 	if (!sharelog_file)
 		return;
 
 	thr_id = work->thr_id;
 	cgpu = get_thr_cgpu(thr_id);
+
+	if (opt_sharelog_binary) {
+		sharelog_binary(disposition, work, cgpu, thr_id);
+		return;
+	}
+
 	pool = work->pool;
 	t = (unsigned long int)(work->tv_work_found.tv_sec);
-	target = bin2hex(work->target, sizeof(work->target));
-	hash = bin2hex(work->hash, sizeof(work->hash));
-	data = bin2hex(work->data, sizeof(work->data));
+	__bin2hex(target, work->target, sizeof(work->target));
+	__bin2hex(hash, work->hash, sizeof(work->hash));
+	__bin2hex(data, work->data, sizeof(work->data));
 
 	// timestamp,disposition,target,pool,dev,thr,sharehash,sharedata
 	rv = snprintf(s, sizeof(s), "%lu,%s,%s,%s,%s%u,%u,%s,%s\n", t, disposition, target, pool->rpc_url, cgpu->drv->name, cgpu->device_id, thr_id, hash, data);
-	free(target);
-	free(hash);
-	free(data);
-	if (rv >= (int)(sizeof(s)))
+	if (rv >= (int)(sizeof(s))) {
 		s[sizeof(s) - 1] = '\0';
-	else if (rv < 0) {
+		rv = sizeof(s) - 1;
+	} else if (rv < 0) {
 		applog(LOG_ERR, "sharelog printf error");
 		return;
 	}
 
+	sharelog_put(s, rv);
+}
+
+/* Write out everything buffered so far */
+static void sharelog_flush(bool sync)
+{
+	static char *buf;
+	static size_t siz;
+	static pthread_mutex_t flush_lock = PTHREAD_MUTEX_INITIALIZER;
+	size_t len, tmpsiz, ret = 1;
+	char *tmp;
+
+	mutex_lock(&flush_lock);
 	mutex_lock(&sharelog_lock);
-	ret = fwrite(s, rv, 1, sharelog_file);
-	fflush(sharelog_file);
+	// swap buffers so shares can keep being added while this one is written
+	tmp = sharelog_buf;
+	sharelog_buf = buf;
+	buf = tmp;
+	len = sharelog_len;
+	sharelog_len = 0;
+	tmpsiz = siz;
+	siz = sharelog_siz;
+	sharelog_siz = tmpsiz;
 	mutex_unlock(&sharelog_lock);
 
+	if (len) {
+		ret = fwrite(buf, len, 1, sharelog_file);
+		fflush(sharelog_file);
+	}
+#ifndef WIN32
+	if (sync)
+		fsync(fileno(sharelog_file));
+#endif
+	mutex_unlock(&flush_lock);
+
 	if (ret != 1)
 		applog(LOG_ERR, "sharelog fwrite error");
 }
 
+static void *sharelog_thread(void __maybe_unused *userdata)
+{
+	time_t synced = time(NULL);
+	bool sync;
+
+	pthread_detach(pthread_self());
+
+	RenameThread("ShareLog");
+
+	while (42) {
+		cgsem_mswait(&sharelog_sem, SHARELOG_FLUSH_MS);
+		sync = (time(NULL) - synced >= SHARELOG_SYNC);
+		sharelog_flush(sync);
+		if (sync)
+			synced = time(NULL);
+	}
+
+	return NULL;
+}
+
+static void sharelog_init(void)
+{
+	pthread_t pth;
+
+	if (!sharelog_file)
+		return;
+
+	cgsem_init(&sharelog_sem);
+	if (unlikely(pthread_create(&pth, NULL, sharelog_thread, NULL)))
+		early_quit(1, "sharelog thread create failed");
+	sharelog_running = true;
+}
+
 static char *gbt_req = "{\"id\": 0, \"method\": \"getblocktemplate\", \"params\": [{\"capabilities\": [\"coinbasetxn\", \"workid\", \"coinbase/append\"]}]}\n";
 
 static char *gbt_solo_req = "{\"id\": 0, \"method\": \"getblocktemplate\", \"params\": [{\"rules\" : [\"segwit\"]}]}\n";
@@ -796,18 +972,20 @@ void adjust_quota_gcd(void)
 struct pool *add_pool(void)
 {
 	struct pool *pool;
+	int i;
 
 	pool = cgcalloc(sizeof(struct pool), 1);
 	pool->pool_no = pool->prio = total_pools;
 	pools = cgrealloc(pools, sizeof(struct pool *) * (total_pools + 2));
 	pools[total_pools++] = pool;
 	mutex_init(&pool->pool_lock);
-	if (unlikely(pthread_cond_init(&pool->cr_cond, NULL)))
-		quit(1, "Failed to pthread_cond_init in add_pool");
 	cglock_init(&pool->data_lock);
 	mutex_init(&pool->stratum_lock);
 	cglock_init(&pool->gbt_lock);
 	INIT_LIST_HEAD(&pool->curlring);
+	mutex_init(&pool->sshare_lock);
+	for (i = 0; i < SSHARE_WHEEL; i++)
+		INIT_LIST_HEAD(&pool->sshare_wheel[i]);
 
 	/* Make sure the pool doesn't think we've been idle since time 0 */
 	pool->tv_idle.tv_sec = ~0UL;
@@ -975,6 +1153,13 @@ static char *set_int_24_to_32(const char *arg, int *i)
 	return set_int_range(arg, i, 24, 32);
 }
 
+#ifdef USE_BM1370
+static char *set_bm1370_freq(const char *arg, int *i)
+{
+	return set_int_range(arg, i, BM1370_FREQ_MIN, BM1370_FREQ_MAX);
+}
+#endif
+
 static char __maybe_unused *set_int_0_to_2(const char *arg, int *i)
 {
 	return set_int_range(arg, i, 0, 2);
@@ -1205,14 +1390,25 @@ static char *set_sched_stop(const char *arg)
 	return set_schedtime(arg, &schedstop);
 }
 
+/* The binary share log must not have its bytes translated where text
+ * streams are, whether --sharelog-binary came before or after --sharelog */
+static void sharelog_set_mode(void)
+{
+#ifdef WIN32
+	if (sharelog_file && opt_sharelog_binary)
+		_setmode(_fileno(sharelog_file), _O_BINARY);
+#endif
+}
+
 static char *opt_set_sharelog;
 static char* set_sharelog(char *arg)
 {
+	const char *mode = opt_sharelog_binary ? "ab" : "a";
 	char *r = "";
 	long int i = strtol(arg, &r, 10);
 
 	if ((!*r) && i >= 0 && i <= INT_MAX) {
-		sharelog_file = fdopen((int)i, "a");
+		sharelog_file = fdopen((int)i, mode);
 		if (!sharelog_file)
 			applog(LOG_ERR, "Failed to open fd %u for share log", (unsigned int)i);
 	} else if (!strcmp(arg, "-")) {
@@ -1220,7 +1416,7 @@ static char* set_sharelog(char *arg)
 		if (!sharelog_file)
 			applog(LOG_ERR, "Standard output missing for share log");
 	} else {
-		sharelog_file = fopen(arg, "a");
+		sharelog_file = fopen(arg, mode);
 		if (!sharelog_file)
 			applog(LOG_ERR, "Failed to open %s for share log", arg);
 	}
@@ -1343,6 +1539,9 @@ static struct opt_table opt_config_table[] = {
 	OPT_WITH_ARG("--api-allow",
 		     opt_set_charp, NULL, &opt_api_allow,
 		     "Allow API access only to the given list of [G:]IP[/Prefix] addresses[/subnets]"),
+	OPT_WITH_ARG("--api-cache",
+		     set_int_0_to_9999, opt_show_intval, &opt_api_cache,
+		     "Milliseconds to reuse an identical read only API reply, 0 to disable"),
 	OPT_WITH_ARG("--api-description",
 		     opt_set_charp, NULL, &opt_api_description,
 		     "Description placed in the API status header, default: cgminer version"),
@@ -1775,6 +1974,17 @@ static struct opt_table opt_config_table[] = {
 		     opt_set_charp, NULL, &opt_bitmine_a1_options,
 		     "Bitmine A1 options ref_clk_khz:sys_clk_khz:spi_clk_khz:override_chip_num"),
 #endif
+#ifdef USE_BM1370
+	OPT_WITH_ARG("--bm1370-dev",
+		     opt_set_charp, NULL, &opt_bm1370_dev,
+		     "Serial devices of BM1370 chains, comma separated (default: " BM1370_DEV_DEF ")"),
+	OPT_WITH_ARG("--bm1370-diff",
+		     set_int_1_to_65535, opt_show_intval, &opt_bm1370_diff,
+		     "Highest on-chip ticket difficulty, rounded down to a power of 2"),
+	OPT_WITH_ARG("--bm1370-freq",
+		     set_bm1370_freq, opt_show_intval, &opt_bm1370_freq,
+		     "Set BM1370 chip frequency in MHz, range 50-1000"),
+#endif
 #ifdef USE_BITFURY
 	OPT_WITH_ARG("--bxf-bits",
 		     set_int_32_to_63, opt_show_intval, &opt_bxf_bits,
@@ -2090,6 +2300,9 @@ static struct opt_table opt_config_table[] = {
 	OPT_WITH_ARG("--log|-l",
 		     set_int_0_to_9999, opt_show_intval, &opt_log_interval,
 		     "Interval in seconds between log output"),
+	OPT_WITHOUT_ARG("--log-async",
+			opt_set_bool, &opt_log_async,
+			"Write log output from a separate thread, dropping messages rather than waiting if it falls behind"),
 	OPT_WITHOUT_ARG("--lowmem",
 			opt_set_bool, &opt_lowmem,
 			"Minimise caching of shares for low memory applications"),
@@ -2224,6 +2437,9 @@ static struct opt_table opt_config_table[] = {
 	OPT_WITH_CBARG("--sharelog",
 		     set_sharelog, NULL, &opt_set_sharelog,
 		     "Append share log to file"),
+	OPT_WITHOUT_ARG("--sharelog-binary",
+			opt_set_bool, &opt_sharelog_binary,
+			"Write the share log in binary, see sharelog2csv.c to convert it"),
 	OPT_WITH_ARG("--shares",
 		     opt_set_intval, NULL, &opt_shares,
 		     "Quit after mining N shares (default: unlimited)"),
@@ -2264,6 +2480,9 @@ static struct opt_table opt_config_table[] = {
 	OPT_WITHOUT_ARG("--usb-list-all",
 			opt_set_bool, &opt_usb_list_all,
 			opt_hidden),
+	OPT_WITHOUT_ARG("--usb-stream",
+			opt_set_bool, &opt_usb_stream,
+			"Keep several USB reads in flight per device endpoint"),
 #endif
 	OPT_WITH_ARG("--user|-u",
 		     set_user, NULL, &opt_set_null,
@@ -2572,43 +2791,97 @@ static struct opt_table opt_cmdline_table[] = {
 	OPT_ENDTABLE
 };
 
+/* The most version rolled midstates any driver wants with each work */
+static int max_midstates = 1;
+
+/* Spread the low bits of n over the set bits of mask */
+static uint32_t deposit_bits(uint32_t n, uint32_t mask)
+{
+	uint32_t ret = 0, bit;
+
+	for (bit = 1; mask && bit; bit <<= 1) {
+		if (mask & bit) {
+			if (n & 1)
+				ret |= bit;
+			n >>= 1;
+		}
+	}
+	return ret;
+}
+
+static struct vmidstates *vmidstates_get(struct vmidstates *vms)
+{
+	if (vms)
+		__atomic_add_fetch(&vms->refs, 1, __ATOMIC_RELAXED);
+	return vms;
+}
+
+static void vmidstates_put(struct vmidstates *vms)
+{
+	if (vms && !__atomic_sub_fetch(&vms->refs, 1, __ATOMIC_ACQ_REL))
+		free(vms);
+}
+
+/* Generate the midstate for the version in work->data or, if a driver wants
+ * more than one and the pool allows version rolling, one midstate for each
+ * of the first max_midstates values of the pool's version bits. The rolled
+ * midstates are hashed SHA256_MAX_LANES at a time in multi-buffer passes and
+ * kept out of line in work->vmidstates, with the first also in
+ * work->midstate and work->data. */
 static void calc_midstate(struct pool *pool, struct work *work)
 {
-	unsigned char data[64];
-	uint32_t *data32 = (uint32_t *)data;
-	sha256_ctx ctx;
+	unsigned char data[SHA256_MAX_LANES][64];
+	const unsigned char *block[SHA256_MAX_LANES];
+	uint32_t *state[SHA256_MAX_LANES];
+	struct vmidstates *vms;
+	uint32_t base, mask;
+	int i, j, n, bits;
+
+	vmidstates_put(work->vmidstates);
+	work->vmidstates = NULL;
+
+	mask = pool->vmask ? pool->vmask_bits : 0;
+	bits = __builtin_popcount(mask);
+	n = max_midstates;
+	if (bits < 31 && n > 1 << bits)
+		n = 1 << bits;
+
+	if (n < 2) {
+		flip64(data[0], work->data);
+		block[0] = data[0];
+		state[0] = (uint32_t *)work->midstate;
+		sha256_midstate_mb(state, block, 1);
+		endian_flip32(work->midstate, work->midstate);
+		memcpy(&work->midstate_ver, work->data, 4);
+		work->midstates = 1;
+		return;
+	}
 
-	if (pool->vmask) {
-		/* This would only be set if the driver requested a vmask and
-		 * the pool has a valid version mask. */
-		memcpy(work->data, &(pool->vmask_001[2]), 4);
-		flip64(data32, work->data);
-		sha256_init(&ctx);
-		sha256_update(&ctx, data, 64);
-		cg_memcpy(work->midstate1, ctx.h, 32);
-		endian_flip32(work->midstate1, work->midstate1);
-
-		memcpy(work->data, &(pool->vmask_001[4]), 4);
-		flip64(data32, work->data);
-		sha256_init(&ctx);
-		sha256_update(&ctx, data, 64);
-		cg_memcpy(work->midstate2, ctx.h, 32);
-		endian_flip32(work->midstate2, work->midstate2);
-
-		memcpy(work->data, &(pool->vmask_001[8]), 4);
-		flip64(data32, work->data);
-		sha256_init(&ctx);
-		sha256_update(&ctx, data, 64);
-		cg_memcpy(work->midstate3, ctx.h, 32);
-		endian_flip32(work->midstate3, work->midstate3);
-
-		memcpy(work->data, &(pool->vmask_001[0]), 4);
-	}
-	flip64(data32, work->data);
-	sha256_init(&ctx);
-	sha256_update(&ctx, data, 64);
-	cg_memcpy(work->midstate, ctx.h, 32);
-	endian_flip32(work->midstate, work->midstate);
+	vms = cgmalloc(sizeof(struct vmidstates) + n * sizeof(struct vmidstate));
+	vms->refs = 1;
+	vms->count = n;
+	base = be32toh(*(uint32_t *)work->data) & ~mask;
+	for (i = 0; i < n; i += SHA256_MAX_LANES) {
+		int lanes = MIN(n - i, SHA256_MAX_LANES);
+
+		for (j = 0; j < lanes; j++) {
+			struct vmidstate *ms = &vms->ms[i + j];
+
+			*(uint32_t *)work->data = htobe32(base | deposit_bits(i + j, mask));
+			memcpy(&ms->version, work->data, 4);
+			flip64(data[j], work->data);
+			block[j] = data[j];
+			state[j] = (uint32_t *)ms->midstate;
+		}
+		sha256_midstate_mb(state, block, lanes);
+		for (j = 0; j < lanes; j++)
+			endian_flip32(vms->ms[i + j].midstate, vms->ms[i + j].midstate);
+	}
+	memcpy(work->data, &vms->ms[0].version, 4);
+	memcpy(work->midstate, vms->ms[0].midstate, 32);
+	work->midstate_ver = vms->ms[0].version;
+	work->midstates = n;
+	work->vmidstates = vms;
 }
 
 /* Returns the current value of total_work and increments it */
@@ -2623,9 +2896,84 @@ static int total_work_inc(void)
 	return ret;
 }
 
+/* Work structs are carved out of slabs that are never returned to the
+ * system and recycled through a small per-thread cache, spilling to and
+ * refilling from a shared depot a batch at a time. Free works are always
+ * zeroed apart from the list pointer. */
+#define WORK_SLAB_SIZE 64
+#define WORK_CACHE_BATCH 32
+
+struct work_free {
+	struct work_free *next;
+};
+
+static pthread_mutex_t work_depot_lock;
+static struct work_free *work_depot;
+static __thread struct work_free *work_cache;
+static __thread int work_cached;
+
+static struct work *alloc_work(void)
+{
+	struct work_free *wf;
+
+	if (unlikely(!work_cache)) {
+		int i;
+
+		mutex_lock(&work_depot_lock);
+		for (i = 0; i < WORK_CACHE_BATCH && work_depot; i++) {
+			wf = work_depot;
+			work_depot = wf->next;
+			wf->next = work_cache;
+			work_cache = wf;
+		}
+		mutex_unlock(&work_depot_lock);
+
+		if (!i) {
+			struct work *slab = cgcalloc(WORK_SLAB_SIZE, sizeof(struct work));
+
+			for (i = 0; i < WORK_SLAB_SIZE; i++) {
+				wf = (struct work_free *)&slab[i];
+				wf->next = work_cache;
+				work_cache = wf;
+			}
+		}
+		work_cached = i;
+	}
+	wf = work_cache;
+	work_cache = wf->next;
+	work_cached--;
+	wf->next = NULL;
+
+	return (struct work *)wf;
+}
+
+static void recycle_work(struct work *work)
+{
+	struct work_free *wf = (struct work_free *)work;
+
+	wf->next = work_cache;
+	work_cache = wf;
+	/* Threads that mostly retire work hand it back for the ones that
+	 * mostly create it */
+	if (++work_cached > WORK_CACHE_BATCH * 2) {
+		struct work_free *head = work_cache, *tail = head;
+		int i;
+
+		for (i = 1; i < WORK_CACHE_BATCH; i++)
+			tail = tail->next;
+		work_cache = tail->next;
+		work_cached -= WORK_CACHE_BATCH;
+
+		mutex_lock(&work_depot_lock);
+		tail->next = work_depot;
+		work_depot = head;
+		mutex_unlock(&work_depot_lock);
+	}
+}
+
 static struct work *make_work(void)
 {
-	struct work *work = cgcalloc(1, sizeof(struct work));
+	struct work *work = alloc_work();
 
 	work->id = total_work_inc();
 	return work;
@@ -2635,10 +2983,11 @@ static struct work *make_work(void)
  * cleaned to remove any dynamically allocated arrays within the struct */
 void clean_work(struct work *work)
 {
-	free(work->job_id);
-	free(work->ntime);
+	cgstr_put(work->job_id);
+	cgstr_put(work->ntime);
 	free(work->coinbase);
-	free(work->nonce1);
+	cgstr_put(work->nonce1);
+	vmidstates_put(work->vmidstates);
 	memset(work, 0, sizeof(struct work));
 }
 
@@ -2656,7 +3005,7 @@ void _free_work(struct work **workptr, const char *file, const char *func, const
 	}
 
 	clean_work(work);
-	free(work);
+	recycle_work(work);
 	*workptr = NULL;
 }
 
@@ -2665,6 +3014,8 @@ static void calc_diff(struct work *work, double known);
 char *workpadding = "000000800000000000000000000000000000000000000000000000000000000000000000000000000000000080020000";
 
 #ifdef HAVE_LIBCURL
+static void gen_hash_pairs(const unsigned char *in, unsigned char *out, int pairs);
+
 /* Process transactions with GBT by storing the binary value of the first
  * transaction, and the hashes of the remaining transactions since these
  * remain constant with an altered coinbase when generating work. Must be
@@ -2762,7 +3113,7 @@ static void gen_gbt_work(struct pool *pool, struct work *work)
 	work->gbt_txns = pool->gbt_txns + 1;
 
 	if (pool->gbt_workid)
-		work->job_id = strdup(pool->gbt_workid);
+		work->job_id = cgstr_new(pool->gbt_workid);
 	cg_runlock(&pool->gbt_lock);
 
 	flip32(work->data + 4 + 32, merkleroot);
@@ -2889,7 +3240,7 @@ static void gbt_merkle_bins(struct pool *pool, json_t *transaction_arr)
 {
 	unsigned char *hashbin;
 	json_t *arr_val;
-	int i, j, binleft, binlen;
+	int i, binleft, binlen;
 
 	free(pool->txn_data);
 	pool->txn_data = NULL;
@@ -2971,9 +3322,7 @@ static void gbt_merkle_bins(struct pool *pool, json_t *transaction_arr)
 				binlen += 32;
 				binleft++;
 			}
-			for (i = 32, j = 64; j < binlen; i += 32, j += 64) {
-				gen_hash(hashbin + j, hashbin + i, 64);
-			}
+			gen_hash_pairs(hashbin + 64, hashbin + 32, (binlen - 64) / 64);
 			binleft /= 2;
 			binlen = binleft * 32;
 		}
@@ -3032,10 +3381,8 @@ static bool gbt_witness_data(json_t *transaction_arr, unsigned char* witnessdata
 			memcpy(hashbin + 32 * txncount, hashbin + 32 * (txncount - 1), 32);
 			txncount++;
 		}
-		for (i = 0; i < txncount; i += 2) {
-			// We overlap input and output here, on the first pair
-			gen_hash(hashbin + 32 * i, hashbin + 32 * (i / 2), 64);
-		}
+		// We overlap input and output here, on the first pair
+		gen_hash_pairs(hashbin, hashbin, txncount / 2);
 	}
 
 	memcpy(witnessdata, witness_header, witness_header_size);
@@ -3307,18 +3654,12 @@ void decay_time(double *f, double fadd, double fsecs, double interval)
 
 static int __total_staged(void)
 {
-	return HASH_COUNT(staged_work);
+	return __atomic_load_n(&staged_count, __ATOMIC_SEQ_CST);
 }
 #if defined(HAVE_LIBCURL) || defined(HAVE_CURSES)
 static int total_staged(void)
 {
-	int ret;
-
-	mutex_lock(stgd_lock);
-	ret = __total_staged();
-	mutex_unlock(stgd_lock);
-
-	return ret;
+	return __total_staged();
 }
 #endif
 
@@ -4000,22 +4341,13 @@ static void print_status(int thr_id)
 		text_print_status(thr_id);
 }
 
-static bool submit_upstream_work(struct work *work, CURL *curl, bool resubmit)
+/* Build the JSON-RPC submitblock request for work */
+static char *submit_upstream_req(struct work *work)
 {
-	json_t *val, *res, *err;
-	char *s;
-	bool rc = false;
-	int thr_id = work->thr_id;
-	struct cgpu_info *cgpu = get_thr_cgpu(thr_id);
 	struct pool *pool = work->pool;
-	int rolltime;
-	struct timeval tv_submit, tv_submit_reply;
-	char hashshow[64 + 4] = "";
-	char worktime[200] = "";
-	struct timeval now;
-	double dev_runtime;
 	char gbt_block[1024], varint[12];
 	unsigned char data[80];
+	char *s;
 
 	/* build JSON-RPC request */
 	flip80(data, work->data);
@@ -4057,11 +4389,23 @@ static bool submit_upstream_work(struct work *work, CURL *curl, bool resubmit)
 	applog(LOG_DEBUG, "DBG: sending %s submit RPC call: %s", pool->rpc_url, s);
 	s = realloc_strcat(s, "\n");
 
-	cgtime(&tv_submit);
-	/* issue JSON-RPC request */
-	val = json_rpc_call(curl, pool->rpc_url, pool->rpc_userpass, s, false, false, &rolltime, pool, true);
-	cgtime(&tv_submit_reply);
-	free(s);
+	return s;
+}
+
+/* Account for the reply val to a submitted work, which is NULL if the
+ * submission failed. Returns false if the work should be submitted again. */
+static bool submit_upstream_reply(struct work *work, json_t *val, struct timeval *tv_submit,
+				  struct timeval *tv_submit_reply, bool resubmit)
+{
+	json_t *res, *err;
+	bool rc = false;
+	int thr_id = work->thr_id;
+	struct cgpu_info *cgpu = get_thr_cgpu(thr_id);
+	struct pool *pool = work->pool;
+	char hashshow[64 + 4] = "";
+	char worktime[200] = "";
+	struct timeval now;
+	double dev_runtime;
 
 	if (unlikely(!val)) {
 		applog(LOG_INFO, "submit_upstream_work json_rpc_call failed");
@@ -4074,7 +4418,6 @@ static bool submit_upstream_work(struct work *work, CURL *curl, bool resubmit)
 			}
 			applog(LOG_WARNING, "Pool %d communication failure, caching submissions", pool->pool_no);
 		}
-		cgsleep_ms(5000);
 		goto out;
 	} else if (pool_tclear(pool, &pool->submit_fail))
 		applog(LOG_WARNING, "Pool %d communication resumed, submitting work", pool->pool_no);
@@ -4094,15 +4437,15 @@ static bool submit_upstream_work(struct work *work, CURL *curl, bool resubmit)
 							(struct timeval *)&(work->tv_getwork_reply));
 			double work_time = tdiff((struct timeval *)&(work->tv_work_found),
 							(struct timeval *)&(work->tv_work_start));
-			double work_to_submit = tdiff(&tv_submit,
+			double work_to_submit = tdiff(tv_submit,
 							(struct timeval *)&(work->tv_work_found));
-			double submit_time = tdiff(&tv_submit_reply, &tv_submit);
+			double submit_time = tdiff(tv_submit_reply, tv_submit);
 			int diffplaces = 3;
 
 			time_t tmp_time = work->tv_getwork.tv_sec;
 			tm = localtime(&tmp_time);
 			cg_memcpy(&tm_getwork, tm, sizeof(struct tm));
-			tmp_time = tv_submit_reply.tv_sec;
+			tmp_time = tv_submit_reply->tv_sec;
 			tm = localtime(&tmp_time);
 			cg_memcpy(&tm_submit_reply, tm, sizeof(struct tm));
 
@@ -4741,16 +5084,29 @@ static void _stage_work(struct work *work);
 	WORK = NULL; \
 } while (0)
 
-/* Adjust an existing char ntime field with a relative noffset */
-static void modify_ntime(char *ntime, int noffset)
+/* Return an adjusted ntime if we're submitting work that a device has
+ * internally offset the ntime, as a new reference counted string. */
+static char *offset_ntime(const char *ntime, int noffset)
 {
 	unsigned char bin[4];
 	uint32_t h32, *be32 = (uint32_t *)bin;
+	char hex[12];
 
 	hex2bin(bin, ntime, 4);
 	h32 = be32toh(*be32) + noffset;
 	*be32 = htobe32(h32);
-	__bin2hex(ntime, bin, 4);
+	__bin2hex(hex, bin, 4);
+	return cgstr_new(hex);
+}
+
+/* Adjust a work's ntime string with a relative noffset. The string may be
+ * shared with other work so it is replaced rather than modified. */
+static void modify_ntime(struct work *work, int noffset)
+{
+	char *ntime = offset_ntime(work->ntime, noffset);
+
+	cgstr_put(work->ntime);
+	work->ntime = ntime;
 }
 
 void roll_work(struct work *work)
@@ -4768,7 +5124,7 @@ void roll_work(struct work *work)
 	applog(LOG_DEBUG, "Successfully rolled work");
 	/* Change the ntime field if this is stratum work */
 	if (work->ntime)
-		modify_ntime(work->ntime, 1);
+		modify_ntime(work, 1);
 
 	/* This is now a different work item so it needs a different ID for the
 	 * hashtable */
@@ -4791,7 +5147,7 @@ void roll_work_ntime(struct work *work, int noffset)
 
 	/* Change the ntime field if this is stratum work */
 	if (work->ntime)
-		modify_ntime(work->ntime, noffset);
+		modify_ntime(work, noffset);
 
 	/* This is now a different work item so it needs a different ID for the
 	 * hashtable */
@@ -4829,10 +5185,10 @@ static void recruit_curl(struct pool *pool)
 }
 
 /* Grab an available curl if there is one. If not, then recruit extra curls
- * unless we are in a submit_fail situation, or we have opt_delaynet enabled
- * and there are already 5 curls in circulation. Limit total number to the
- * number of mining threads per pool as well to prevent blasting a pool during
- * network delays/outages. */
+ * unless we have opt_delaynet enabled and there are already 5 curls in
+ * circulation. Limit total number to the number of mining threads per pool as
+ * well to prevent blasting a pool during network delays/outages, returning
+ * NULL when the pool is at its limit so the share waits its turn. */
 static struct curl_ent *pop_curl_entry(struct pool *pool)
 {
 	int curl_limit = opt_delaynet ? 5 : (mining_threads + max_queue) * 2;
@@ -4840,18 +5196,13 @@ static struct curl_ent *pop_curl_entry(struct pool *pool)
 	struct curl_ent *ce;
 
 	mutex_lock(&pool->pool_lock);
-retry:
-	if (!pool->curls) {
-		recruit_curl(pool);
-		recruited = true;
-	} else if (list_empty(&pool->curlring)) {
+	if (list_empty(&pool->curlring)) {
 		if (pool->curls >= curl_limit) {
-			pthread_cond_wait(&pool->cr_cond, &pool->pool_lock);
-			goto retry;
-		} else {
-			recruit_curl(pool);
-			recruited = true;
+			mutex_unlock(&pool->pool_lock);
+			return NULL;
 		}
+		recruit_curl(pool);
+		recruited = true;
 	}
 	ce = list_entry(pool->curlring.next, struct curl_ent, node);
 	list_del(&ce->node);
@@ -4867,7 +5218,6 @@ static void push_curl_entry(struct curl_ent *ce, struct pool *pool)
 	mutex_lock(&pool->pool_lock);
 	list_add_tail(&ce->node, &pool->curlring);
 	cgtime(&ce->tv);
-	pthread_cond_broadcast(&pool->cr_cond);
 	mutex_unlock(&pool->pool_lock);
 }
 
@@ -4904,28 +5254,102 @@ static inline bool can_roll(struct work *work)
 		work->rolls < 7000 && !stale_work(work, false));
 }
 
-static void *submit_work_thread(void *userdata)
-{
-	struct work *work = (struct work *)userdata;
-	struct pool *pool = work->pool;
-	bool resubmit = false;
+/* Getwork and GBT shares are all submitted by one thread driving a curl multi
+ * handle, so any number of them can be in flight at once over the pools' kept
+ * alive connections without a thread each. Mining threads queueing shares are
+ * held back once the backlog is full. */
+#define SUBMIT_RETRY_SECS 5
+
+#if LIBCURL_VERSION_NUM >= 0x074400
+#define SUBMIT_POLL_MS 1000
+#else
+/* Without curl_multi_wakeup newly queued shares are only noticed by polling */
+#define SUBMIT_POLL_MS 50
+#endif
+
+struct submit_ent {
+	struct list_head list;
+	struct work *work;
 	struct curl_ent *ce;
+	struct json_rpc_req *req;
+	char *s;
+	struct timeval tv_submit;
+	struct timeval tv_retry;
+	bool resubmit;
+};
 
-	pthread_detach(pthread_self());
+static pthread_mutex_t submit_lock;
+/* Shares waiting for a curl or a retry, protected by submit_lock. Like the
+ * share cache of old, a share stays queued through a pool outage until it is
+ * submitted or goes stale, so the list is not capped and queueing a share
+ * never waits. */
+static struct list_head submit_list;
+static CURLM *submit_multi;
 
-	RenameThread("SubmitWork");
+static void submit_wakeup(void)
+{
+#if LIBCURL_VERSION_NUM >= 0x074400
+	curl_multi_wakeup(submit_multi);
+#endif
+}
+
+static void submit_work_queue(struct work *work)
+{
+	struct submit_ent *sub = cgcalloc(sizeof(struct submit_ent), 1);
+
+	sub->work = work;
+	mutex_lock(&submit_lock);
+	list_add_tail(&sub->list, &submit_list);
+	mutex_unlock(&submit_lock);
+	submit_wakeup();
+}
+
+/* Start the transfer of a share that has been given a curl */
+static void submit_start(struct submit_ent *sub)
+{
+	struct pool *pool = sub->work->pool;
+	CURL *curl = sub->ce->curl;
+
+	if (!sub->s)
+		sub->s = submit_upstream_req(sub->work);
+	sub->req = json_rpc_setup(curl, pool->rpc_url, pool->rpc_userpass, sub->s,
+				  false, false, pool, true);
+	curl_easy_setopt(curl, CURLOPT_PRIVATE, (void *)sub);
+	cgtime(&sub->tv_submit);
+	curl_multi_add_handle(submit_multi, curl);
+}
+
+static void submit_free(struct submit_ent *sub)
+{
+	free_work(sub->work);
+	free(sub->s);
+	free(sub);
+}
 
-	applog(LOG_DEBUG, "Creating extra submit work thread");
+/* A share's transfer has finished with curl result rc, account for it and
+ * either free it or queue it to be retried */
+static void submit_done(struct submit_ent *sub, int rc)
+{
+	struct work *work = sub->work;
+	struct pool *pool = work->pool;
+	struct timeval tv_submit_reply;
+	int rolltime;
+	json_t *val;
+	bool done;
 
-	ce = pop_curl_entry(pool);
-	/* submit solution to bitcoin via JSON-RPC */
-	while (!submit_upstream_work(work, ce->curl, resubmit)) {
+	cgtime(&tv_submit_reply);
+	curl_multi_remove_handle(submit_multi, sub->ce->curl);
+	val = json_rpc_result(sub->req, rc, &rolltime);
+	sub->req = NULL;
+	push_curl_entry(sub->ce, pool);
+	sub->ce = NULL;
+
+	done = submit_upstream_reply(work, val, &sub->tv_submit, &tv_submit_reply, sub->resubmit);
+	if (!done) {
 		if (opt_lowmem) {
 			applog(LOG_NOTICE, "Pool %d share being discarded to minimise memory cache", pool->pool_no);
-			break;
-		}
-		resubmit = true;
-		if (stale_work(work, true)) {
+			done = true;
+		} else if (stale_work(work, true)) {
 			applog(LOG_NOTICE, "Pool %d share became stale while retrying submit, discarding", pool->pool_no);
 
 			mutex_lock(&stats_lock);
@@ -4934,19 +5358,99 @@ static void *submit_work_thread(void *userdata)
 			total_diff_stale += work->work_difficulty;
 			pool->diff_stale += work->work_difficulty;
 			mutex_unlock(&stats_lock);
+			done = true;
+		}
+	}
+	if (done) {
+		submit_free(sub);
+		return;
+	}
 
-			free_work(work);
-			break;
+	/* pause, then restart work-request loop */
+	applog(LOG_INFO, "json_rpc_call failed on submit_work, retrying");
+	sub->resubmit = true;
+	cgtime(&sub->tv_retry);
+	sub->tv_retry.tv_sec += SUBMIT_RETRY_SECS;
+	mutex_lock(&submit_lock);
+	list_add_tail(&sub->list, &submit_list);
+	mutex_unlock(&submit_lock);
+}
+
+static void *submit_work_thread(void __maybe_unused *userdata)
+{
+	struct submit_ent *sub, *tmp;
+	struct list_head start;
+
+	pthread_detach(pthread_self());
+
+	RenameThread("SubmitWork");
+
+	INIT_LIST_HEAD(&start);
+	while (42) {
+		int running, msgs, timeout = SUBMIT_POLL_MS;
+		struct timeval now;
+		CURLMsg *msg;
+
+		/* Take every share that is due and whose pool has a curl to
+		 * spare, the rest stay queued in order */
+		cgtime(&now);
+		mutex_lock(&submit_lock);
+		list_for_each_entry_safe(sub, tmp, &submit_list, list) {
+			if (sub->resubmit) {
+				int wait = ms_tdiff(&sub->tv_retry, &now);
+
+				if (wait > 0) {
+					timeout = MIN(timeout, wait);
+					continue;
+				}
+			}
+			sub->ce = pop_curl_entry(sub->work->pool);
+			if (sub->ce)
+				list_move_tail(&sub->list, &start);
 		}
+		mutex_unlock(&submit_lock);
 
-		/* pause, then restart work-request loop */
-		applog(LOG_INFO, "json_rpc_call failed on submit_work, retrying");
+		list_for_each_entry_safe(sub, tmp, &start, list) {
+			list_del(&sub->list);
+			applog(LOG_DEBUG, "Submitting pool %d work", sub->work->pool->pool_no);
+			submit_start(sub);
+		}
+
+		curl_multi_perform(submit_multi, &running);
+		while ((msg = curl_multi_info_read(submit_multi, &msgs))) {
+			char *priv;
+
+			if (msg->msg != CURLMSG_DONE)
+				continue;
+			curl_easy_getinfo(msg->easy_handle, CURLINFO_PRIVATE, &priv);
+			submit_done((struct submit_ent *)priv, msg->data.result);
+			/* Its curl can go straight to the next share waiting */
+			timeout = 0;
+		}
+
+#if LIBCURL_VERSION_NUM >= 0x074400
+		curl_multi_poll(submit_multi, NULL, 0, timeout, NULL);
+#else
+		curl_multi_wait(submit_multi, NULL, 0, timeout, NULL);
+#endif
 	}
-	push_curl_entry(ce, pool);
 
 	return NULL;
 }
 
+static void submit_init(void)
+{
+	pthread_t pth;
+
+	mutex_init(&submit_lock);
+	INIT_LIST_HEAD(&submit_list);
+	submit_multi = curl_multi_init();
+	if (unlikely(!submit_multi))
+		early_quit(1, "Failed to curl_multi_init");
+	if (unlikely(pthread_create(&pth, NULL, submit_work_thread, NULL)))
+		early_quit(1, "submit work thread create failed");
+}
+
 /* Clones work by rolling it if possible, and returning a clone instead of the
  * original work item which gets staged again to possibly be rolled again in
  * the future */
@@ -4983,26 +5487,15 @@ static struct work *clone_work(struct work *work)
 }
 
 #else /* HAVE_LIBCURL */
-static void *submit_work_thread(void __maybe_unused *userdata)
+static void submit_work_queue(struct work *work)
 {
-	pthread_detach(pthread_self());
-	return NULL;
+	free_work(work);
 }
-#endif /* HAVE_LIBCURL */
 
-/* Return an adjusted ntime if we're submitting work that a device has
- * internally offset the ntime. */
-static char *offset_ntime(const char *ntime, int noffset)
+static void submit_init(void)
 {
-	unsigned char bin[4];
-	uint32_t h32, *be32 = (uint32_t *)bin;
-
-	hex2bin(bin, ntime, 4);
-	h32 = be32toh(*be32) + noffset;
-	*be32 = htobe32(h32);
-
-	return bin2hex(bin, 4);
 }
+#endif /* HAVE_LIBCURL */
 
 /* Duplicates any dynamically allocated arrays within the work struct to
  * prevent a copied work struct from freeing ram belonging to another struct */
@@ -5015,10 +5508,9 @@ static void _copy_work(struct work *work, const struct work *base_work, int noff
 	/* Keep the unique new id assigned during make_work to prevent copied
 	 * work from having the same id. */
 	work->id = id;
-	if (base_work->job_id)
-		work->job_id = strdup(base_work->job_id);
-	if (base_work->nonce1)
-		work->nonce1 = strdup(base_work->nonce1);
+	work->job_id = cgstr_get(base_work->job_id);
+	work->nonce1 = cgstr_get(base_work->nonce1);
+	work->vmidstates = vmidstates_get(base_work->vmidstates);
 	if (base_work->ntime) {
 		/* If we are passed an noffset the binary work->data ntime and
 		 * the work->ntime hex string need to be adjusted. */
@@ -5030,7 +5522,7 @@ static void _copy_work(struct work *work, const struct work *base_work, int noff
 			*work_ntime = htobe32(ntime);
 			work->ntime = offset_ntime(base_work->ntime, noffset);
 		} else
-			work->ntime = strdup(base_work->ntime);
+			work->ntime = cgstr_get(base_work->ntime);
 	} else if (noffset) {
 		uint32_t *work_ntime = (uint32_t *)(work->data + 68);
 		uint32_t ntime = be32toh(*work_ntime);
@@ -5051,8 +5543,11 @@ void set_work_ntime(struct work *work, int ntime)
 
 	*work_ntime = htobe32(ntime);
 	if (work->ntime) {
-		free(work->ntime);
-		work->ntime = bin2hex((unsigned char *)work_ntime, 4);
+		char hex[12];
+
+		__bin2hex(hex, (unsigned char *)work_ntime, 4);
+		cgstr_put(work->ntime);
+		work->ntime = cgstr_new(hex);
 	}
 }
 
@@ -5106,21 +5601,12 @@ static bool stale_work(struct work *work, bool share)
 	pool = work->pool;
 
 	if (!share && pool->has_stratum) {
-		bool same_job;
-
 		if (!pool->stratum_active || !pool->stratum_notify) {
 			applog(LOG_DEBUG, "Work stale due to stratum inactive");
 			return true;
 		}
 
-		same_job = true;
-
-		cg_rlock(&pool->data_lock);
-		if (strcmp(work->job_id, pool->swork.job_id))
-			same_job = false;
-		cg_runlock(&pool->data_lock);
-
-		if (!same_job) {
+		if (work->job_gen != __atomic_load_n(&pool->job_gen, __ATOMIC_ACQUIRE)) {
 			applog(LOG_DEBUG, "Work stale due to stratum job_id mismatch");
 			return true;
 		}
@@ -5138,31 +5624,45 @@ static bool stale_work(struct work *work, bool share)
 	return false;
 }
 
-uint64_t share_diff(const struct work *work)
+/* Raises *ptr to val if it's larger, returning true if it did */
+static bool atomic_max(uint64_t *ptr, uint64_t val)
 {
-	bool new_best = false;
-	double d64, s64;
-	uint64_t ret;
+	uint64_t old = __atomic_load_n(ptr, __ATOMIC_RELAXED);
 
-	d64 = truediffone;
-	s64 = le256todouble(work->hash);
-	if (unlikely(!s64))
+	while (val > old) {
+		if (__atomic_compare_exchange_n(ptr, &old, val, true, __ATOMIC_RELAXED,
+						__ATOMIC_RELAXED))
+			return true;
+	}
+	return false;
+}
+
+uint64_t share_diff(const struct work *work)
+{
+	double d64, s64;
+	uint64_t ret;
+
+	d64 = truediffone;
+	s64 = le256todouble(work->hash);
+	if (unlikely(!s64))
 		s64 = 0;
 
 	ret = round(d64 / s64);
 
-	cg_wlock(&control_lock);
-	if (unlikely(ret > best_diff)) {
-		new_best = true;
-		best_diff = ret;
-		suffix_string(best_diff, best_share, sizeof(best_share), 0);
-	}
-	if (unlikely(ret > work->pool->best_diff))
-		work->pool->best_diff = ret;
-	cg_wunlock(&control_lock);
+	atomic_max(&work->pool->best_diff, ret);
+	if (unlikely(atomic_max(&best_diff, ret))) {
+		char best[8];
 
-	if (unlikely(new_best))
-		applog(LOG_INFO, "New best share: %s", best_share);
+		/* A better share may have come in since, so use best_diff
+		 * rather than ret */
+		cg_wlock(&control_lock);
+		suffix_string(__atomic_load_n(&best_diff, __ATOMIC_RELAXED), best_share,
+			      sizeof(best_share), 0);
+		cg_memcpy(best, best_share, sizeof(best));
+		cg_wunlock(&control_lock);
+
+		applog(LOG_INFO, "New best share: %s", best);
+	}
 
 	return ret;
 }
@@ -5172,11 +5672,53 @@ static void regen_hash(struct work *work)
 	uint32_t *data32 = (uint32_t *)(work->data);
 	unsigned char swap[80];
 	uint32_t *swap32 = (uint32_t *)swap;
-	unsigned char hash1[32];
 
 	flip80(swap32, data32);
-	sha256(swap, 80, hash1);
-	sha256(hash1, 32, (unsigned char *)(work->hash));
+	sha256d(swap, 80, work->hash);
+}
+
+/* Returns the cached midstate matching the version currently in the work
+ * header, or NULL if there is none, eg. the driver has rolled the version
+ * to one calc_midstate did not generate. */
+static unsigned char *work_midstate(struct work *work)
+{
+	struct vmidstates *vms = work->vmidstates;
+	uint32_t version;
+	int i;
+
+	if (!work->midstates)
+		return NULL;
+	memcpy(&version, work->data, 4);
+	if (work->midstate_ver == version)
+		return work->midstate;
+	for (i = 0; vms && i < vms->count; i++) {
+		if (vms->ms[i].version == version)
+			return vms->ms[i].midstate;
+	}
+	return NULL;
+}
+
+/* As regen_hash but starting from the cached midstate where possible so only
+ * the last 16 bytes of the header need hashing. Returns whether the top 32
+ * bits of the hash are zero; when they are not the rest of work->hash may be
+ * left stale. */
+static bool regen_hash_diff1(struct work *work)
+{
+	uint32_t *hash_32 = (uint32_t *)(work->hash + 28);
+	uint32_t *data32 = (uint32_t *)(work->data + 64);
+	unsigned char *midstate = work_midstate(work);
+	uint32_t state[8], tail[4];
+	int i;
+
+	if (unlikely(!midstate)) {
+		regen_hash(work);
+		return (*hash_32 == 0);
+	}
+	cg_memcpy(state, midstate, 32);
+	endian_flip32(state, state);
+	for (i = 0; i < 4; i++)
+		tail[i] = swab32(data32[i]);
+	return sha256d_midstate_tail(state, (unsigned char *)tail, work->hash);
 }
 
 static bool cnx_needed(struct pool *pool);
@@ -5203,6 +5745,10 @@ static struct pool *priority_pool(int choice)
 	return ret;
 }
 
+#ifdef STRATUM_REACTOR
+static void stratum_reactor_kick(void);
+#endif
+
 void switch_pools(struct pool *selected)
 {
 	struct pool *pool, *last_pool;
@@ -5273,6 +5819,9 @@ void switch_pools(struct pool *selected)
 	mutex_lock(&lp_lock);
 	pthread_cond_broadcast(&lp_cond);
 	mutex_unlock(&lp_lock);
+#ifdef STRATUM_REACTOR
+	stratum_reactor_kick();
+#endif
 }
 
 void _discard_work(struct work **workptr, const char *file, const char *func, const int line)
@@ -5304,21 +5853,121 @@ static void wake_gws(void)
 	mutex_unlock(stgd_lock);
 }
 
-static void discard_stale(void)
+/* Only take stgd_lock to wake hash_pop callers if any might be asleep. The
+ * full barrier pairs with the one in hash_pop so either the sleeper sees the
+ * new work or we see the sleeper. */
+static void wake_staged_waiters(void)
 {
-	struct work *work, *tmp;
-	int stale = 0;
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	if (__atomic_load_n(&staged_waiters, __ATOMIC_SEQ_CST)) {
+		mutex_lock(stgd_lock);
+		pthread_cond_broadcast(&getq->cond);
+		mutex_unlock(stgd_lock);
+	}
+}
 
-	mutex_lock(stgd_lock);
-	HASH_ITER(hh, staged_work, work, tmp) {
-		if (stale_work(work, false)) {
-			HASH_DEL(staged_work, work);
-			discard_work(work);
-			stale++;
-		}
+/* Drain one staged ring and put back everything filter doesn't claim in the
+ * same order, returning how many were claimed. Called with stage_lock held so
+ * nothing can be staged meanwhile, and consumers only make more room, so all
+ * of it fits back. */
+static int filter_staged_ring(struct cgring *ring, bool (*filter)(struct work *, void *),
+			      void *arg)
+{
+	struct work **keep, *work;
+	int i, kept = 0, claimed = 0;
+
+	keep = cgmalloc(sizeof(struct work *) * STAGED_RING_SIZE);
+	while ((work = cgring_pop(ring))) {
+		if (filter(work, arg))
+			claimed++;
+		else
+			keep[kept++] = work;
 	}
-	pthread_cond_signal(&gws_cond);
-	mutex_unlock(stgd_lock);
+	for (i = 0; i < kept; i++) {
+		if (unlikely(!cgring_push(ring, keep[i])))
+			quit(1, "Failed to put back staged work");
+	}
+	free(keep);
+
+	return claimed;
+}
+
+static int filter_staged(bool (*filter)(struct work *, void *), void *arg)
+{
+	struct work *work, *tmp, *kept = NULL;
+	int claimed;
+
+	mutex_lock(&stage_lock);
+	claimed = filter_staged_ring(&staged_works, filter, arg) +
+		  filter_staged_ring(&staged_rolls, filter, arg);
+	HASH_ITER(hh, staged_spill, work, tmp) {
+		/* filter may free the work so it comes out first */
+		HASH_DEL(staged_spill, work);
+		if (filter(work, arg)) {
+			__atomic_sub_fetch(&staged_spilled, 1, __ATOMIC_SEQ_CST);
+			claimed++;
+		} else
+			HASH_ADD_INT(kept, id, work);
+	}
+	staged_spill = kept;
+	mutex_unlock(&stage_lock);
+
+	if (claimed)
+		__atomic_sub_fetch(&staged_count, claimed, __ATOMIC_SEQ_CST);
+	wake_staged_waiters();
+	return claimed;
+}
+
+static bool discard_if_stale(struct work *work, void __maybe_unused *arg)
+{
+	if (!stale_work(work, false))
+		return false;
+	discard_work(work);
+	return true;
+}
+
+/* Staged work only goes stale with a new block, a new stratum job or a
+ * stratum pool going inactive, or by expiring which takes at least 5
+ * seconds. This summarises the first three so discard_stale only walks the
+ * staged work when one of them may have happened. */
+static uint64_t stale_signature(void)
+{
+	uint64_t sig = work_block;
+	int i;
+
+	for (i = 0; i < total_pools; i++) {
+		struct pool *pool = pools[i];
+
+		sig = sig * 31 + __atomic_load_n(&pool->job_gen, __ATOMIC_ACQUIRE) * 2;
+		sig += pool->stratum_active && pool->stratum_notify;
+	}
+	return sig;
+}
+
+#define STALE_SWEEP_INTERVAL 5
+
+static void discard_stale(void)
+{
+	static uint64_t last_sig;
+	static time_t last_sweep;
+	uint64_t sig;
+	time_t now;
+	int stale;
+
+	sig = stale_signature();
+	now = time(NULL);
+	mutex_lock(&stale_lock);
+	if (sig == last_sig && now - last_sweep < STALE_SWEEP_INTERVAL) {
+		mutex_unlock(&stale_lock);
+		wake_gws();
+		return;
+	}
+	last_sig = sig;
+	last_sweep = now;
+	mutex_unlock(&stale_lock);
+
+	stale = filter_staged(discard_if_stale, NULL);
+	wake_gws();
 
 	if (stale)
 		applog(LOG_DEBUG, "Discarded %d stales that didn't match current hash", stale);
@@ -5504,13 +6153,16 @@ static bool test_work_current(struct work *work)
 	unsigned char bedata[32];
 	char hexstr[68];
 	bool ret = true;
-	unsigned char *bin_height = &pool->coinbase[43];
-	uint8_t cb_height_sz = bin_height[-1];
+	unsigned char *bin_height;
+	uint8_t cb_height_sz;
 	uint32_t height = 0;
 
 	if (work->mandatory)
 		return ret;
 
+	bin_height = &pool->coinbase[43];
+	cb_height_sz = bin_height[-1];
+
 	swap256(bedata, work->data + 4);
 	__bin2hex(hexstr, bedata, 32);
 
@@ -5603,11 +6255,6 @@ out:
 	return ret;
 }
 
-static int tv_sort(struct work *worka, struct work *workb)
-{
-	return worka->tv_staged.tv_sec - workb->tv_staged.tv_sec;
-}
-
 static bool work_rollable(struct work *work)
 {
 	return (!work->clone && work->rolltime);
@@ -5615,20 +6262,23 @@ static bool work_rollable(struct work *work)
 
 static bool hash_push(struct work *work)
 {
-	bool rc = true;
+	bool rollable = work_rollable(work);
 
-	mutex_lock(stgd_lock);
-	if (work_rollable(work))
-		staged_rollable++;
-	if (likely(!getq->frozen)) {
-		HASH_ADD_INT(staged_work, id, work);
-		HASH_SORT(staged_work, tv_sort);
-	} else
-		rc = false;
-	pthread_cond_broadcast(&getq->cond);
-	mutex_unlock(stgd_lock);
+	if (unlikely(getq->frozen))
+		return false;
+	mutex_lock(&stage_lock);
+	if (unlikely(__atomic_load_n(&staged_spilled, __ATOMIC_SEQ_CST) ||
+		     !cgring_push(rollable ? &staged_rolls : &staged_works, work))) {
+		HASH_ADD_INT(staged_spill, id, work);
+		__atomic_add_fetch(&staged_spilled, 1, __ATOMIC_SEQ_CST);
+	}
+	/* Counted before stage_lock is dropped so filter_staged can't
+	 * subtract it first */
+	__atomic_add_fetch(&staged_count, 1, __ATOMIC_SEQ_CST);
+	mutex_unlock(&stage_lock);
+	wake_staged_waiters();
 
-	return rc;
+	return true;
 }
 
 static void _stage_work(struct work *work)
@@ -5897,6 +6547,9 @@ void zero_stats(void)
 	}
 
 #endif
+	/* So nothing still pending gets added after zeroing */
+	fold_share_stats();
+
 	cgtime(&total_tv_start);
 	copy_time(&tv_hashmeter, &total_tv_start);
 	total_rolling = 0;
@@ -6641,6 +7294,9 @@ static void hashmeter(int thr_id, uint64_t hashes_done)
 	tv_tdiff = tdiff(&total_tv_end, &tv_hashmeter);
 	now_t = total_tv_end.tv_sec;
 	diff_t = now_t - hashdisplay_t;
+	/* Devices' share stats are caught up with by the watchdog */
+	if (thr_id < 0)
+		fold_share_stats();
 	if (diff_t >= opt_log_interval) {
 		alt_status ^= switch_status;
 		hashdisplay_t = now_t;
@@ -6806,13 +7462,14 @@ static bool parse_stratum_response(struct pool *pool, char *s)
 
 	id = json_integer_value(id_val);
 
-	mutex_lock(&sshare_lock);
-	HASH_FIND_INT(stratum_shares, &id, sshare);
+	mutex_lock(&pool->sshare_lock);
+	HASH_FIND_INT(pool->stratum_shares, &id, sshare);
 	if (sshare) {
-		HASH_DEL(stratum_shares, sshare);
+		HASH_DEL(pool->stratum_shares, sshare);
+		list_del(&sshare->wheel);
 		pool->sshares--;
 	}
-	mutex_unlock(&sshare_lock);
+	mutex_unlock(&pool->sshare_lock);
 
 	if (!sshare) {
 		double pool_diff;
@@ -6866,18 +7523,17 @@ void clear_stratum_shares(struct pool *pool)
 	double diff_cleared = 0;
 	int cleared = 0;
 
-	mutex_lock(&sshare_lock);
-	HASH_ITER(hh, stratum_shares, sshare, tmpshare) {
-		if (sshare->work->pool == pool) {
-			HASH_DEL(stratum_shares, sshare);
-			diff_cleared += sshare->work->work_difficulty;
-			free_work(sshare->work);
-			pool->sshares--;
-			free(sshare);
-			cleared++;
-		}
+	mutex_lock(&pool->sshare_lock);
+	HASH_ITER(hh, pool->stratum_shares, sshare, tmpshare) {
+		HASH_DEL(pool->stratum_shares, sshare);
+		list_del(&sshare->wheel);
+		diff_cleared += sshare->work->work_difficulty;
+		free_work(sshare->work);
+		pool->sshares--;
+		free(sshare);
+		cleared++;
 	}
-	mutex_unlock(&sshare_lock);
+	mutex_unlock(&pool->sshare_lock);
 
 	if (cleared) {
 		applog(LOG_WARNING, "Lost %d shares due to stratum disconnect on pool %d", cleared, pool->pool_no);
@@ -6888,20 +7544,19 @@ void clear_stratum_shares(struct pool *pool)
 	}
 }
 
+static bool free_if_pool(struct work *work, void *arg)
+{
+	if (work->pool != (struct pool *)arg)
+		return false;
+	free_work(work);
+	return true;
+}
+
 void clear_pool_work(struct pool *pool)
 {
-	struct work *work, *tmp;
-	int cleared = 0;
+	int cleared;
 
-	mutex_lock(stgd_lock);
-	HASH_ITER(hh, staged_work, work, tmp) {
-		if (work->pool == pool) {
-			HASH_DEL(staged_work, work);
-			free_work(work);
-			cleared++;
-		}
-	}
-	mutex_unlock(stgd_lock);
+	cleared = filter_staged(free_if_pool, pool);
 
 	if (cleared)
 		applog(LOG_INFO, "Cleared %d work items due to stratum disconnect on pool %d", cleared, pool->pool_no);
@@ -6978,6 +7633,313 @@ static bool supports_resume(struct pool *pool)
 	return ret;
 }
 
+/* The stratum connection to pool has dropped or timed out */
+static void stratum_interrupted(struct pool *pool)
+{
+	applog(LOG_NOTICE, "Stratum connection to pool %d interrupted", pool->pool_no);
+	pool->getfail_occasions++;
+	total_go++;
+
+	/* If the socket to our stratum pool disconnects, all tracked submitted
+	 * shares are lost and we will leak the memory if we don't discard their
+	 * records. */
+	if (!supports_resume(pool) || opt_lowmem)
+		clear_stratum_shares(pool);
+	clear_pool_work(pool);
+	if (pool == current_pool())
+		restart_threads();
+}
+
+/* Handle one line received from a stratum pool */
+static void stratum_process_line(struct pool *pool, char *s)
+{
+	unsigned int sockbuf_gen;
+
+	/* Check this pool hasn't died while being a backup pool and has not
+	 * had its idle flag cleared */
+	stratum_resumed(pool);
+
+	/* s points into the pool sockbuf, which a reconnect attempted from
+	 * within parse_method may have reused */
+	sockbuf_gen = pool->sockbuf_gen;
+	if (!parse_method(pool, s)) {
+		if (pool->sockbuf_gen != sockbuf_gen)
+			return;
+		if (!parse_stratum_response(pool, s)) {
+			applog(LOG_INFO, "Unknown stratum msg: %s", s);
+			return;
+		}
+	}
+	if (pool->swork.clean) {
+		struct work *work = make_work();
+
+		/* Generate a single work item to update the current block
+		 * database */
+		gen_stratum_work(pool, work);
+		/* Return value doesn't matter. We're just informing that we
+		 * may need to restart. */
+		test_work_current(work);
+		free_work(work);
+	}
+}
+
+#ifdef STRATUM_REACTOR
+/* All stratum pools' receive sides are serviced by one reactor thread
+ * waiting on an edge triggered epoll set, rather than a receive thread per
+ * pool. The reactor tracks each pool's 90 second message timeout, parks
+ * connections that aren't needed and backs off failed reconnects. Connecting
+ * and authorising can block for a long time so each attempt is run in a short
+ * lived thread of its own, which hands the pool back through reactor_q. */
+#define REACTOR_EVENTS 64
+#define REACTOR_TIMEOUT 90
+#define REACTOR_BACKOFF_MIN 5
+#define REACTOR_BACKOFF_MAX 60
+
+static int reactor_epfd, reactor_evfd;
+static struct thread_q *reactor_q;
+
+static void stratum_reactor_kick(void)
+{
+	uint64_t one = 1;
+
+	if (unlikely(write(reactor_evfd, &one, sizeof(one)) != sizeof(one)))
+		applog(LOG_DEBUG, "Failed to write to stratum reactor eventfd");
+}
+
+static void *stratum_connect_thread(void *userdata)
+{
+	struct pool *pool = (struct pool *)userdata;
+	char threadname[16];
+
+	pthread_detach(pthread_self());
+
+	snprintf(threadname, sizeof(threadname), "%d/CStratum", pool->pool_no);
+	RenameThread(threadname);
+
+	pool->reactor_connected = restart_stratum(pool);
+	tq_push(reactor_q, pool);
+	stratum_reactor_kick();
+
+	return NULL;
+}
+
+static void reactor_connect(struct pool *pool)
+{
+	pthread_t pth;
+
+	pool->reactor_state = REACTOR_CONNECTING;
+	if (unlikely(pthread_create(&pth, NULL, stratum_connect_thread, (void *)pool)))
+		quit(1, "Failed to create stratum connect thread");
+}
+
+/* Every failed reconnect marks the pool dead so we fail over to another pool
+ * while this one backs off */
+static void reactor_backoff(struct pool *pool, time_t now)
+{
+	pool_died(pool);
+	if (!pool->reactor_backoff)
+		pool->reactor_backoff = REACTOR_BACKOFF_MIN;
+	else
+		pool->reactor_backoff = MIN(pool->reactor_backoff * 2, REACTOR_BACKOFF_MAX);
+	pool->reactor_due = now + pool->reactor_backoff;
+	pool->reactor_state = REACTOR_BACKOFF;
+}
+
+static void reactor_read(struct pool *pool);
+
+static void reactor_activate(struct pool *pool)
+{
+	struct epoll_event ev;
+
+	if (unlikely(!pool->sock || !pool->stratum_active)) {
+		stratum_interrupted(pool);
+		reactor_connect(pool);
+		return;
+	}
+
+	/* Closing the old socket took it out of the epoll set, but arm the
+	 * new one as modified should its fd still be there */
+	memset(&ev, 0, sizeof(ev));
+	ev.events = EPOLLIN | EPOLLRDHUP | EPOLLET;
+	ev.data.ptr = pool;
+	if (unlikely(epoll_ctl(reactor_epfd, EPOLL_CTL_ADD, (int)pool->sock, &ev) &&
+		     (errno != EEXIST || epoll_ctl(reactor_epfd, EPOLL_CTL_MOD, (int)pool->sock, &ev)))) {
+		applog(LOG_WARNING, "Failed to add pool %d socket to stratum reactor", pool->pool_no);
+		suspend_stratum(pool);
+		reactor_backoff(pool, time(NULL));
+		return;
+	}
+	pool->reactor_gen = pool->sock_gen;
+	pool->reactor_state = REACTOR_ACTIVE;
+	pool->reactor_backoff = 0;
+	pool->reactor_due = time(NULL) + REACTOR_TIMEOUT;
+	stratum_resumed(pool);
+
+	/* Anything that arrived while connecting may already be buffered */
+	reactor_read(pool);
+}
+
+/* Drain the pool's socket, handling each complete line as we go. */
+static void reactor_read(struct pool *pool)
+{
+	int ret;
+
+	do {
+		char *s;
+
+		ret = recv_sockbuf(pool);
+		if (ret > 0)
+			pool->reactor_due = time(NULL) + REACTOR_TIMEOUT;
+		while ((s = sockbuf_line_view(pool)) != NULL) {
+			stratum_process_line(pool, s);
+			/* Left to reactor_check once the connection changes */
+			if (unlikely(pool->sock_gen != pool->reactor_gen || !pool->stratum_active))
+				return;
+		}
+	} while (ret > 0);
+
+	if (ret < 0) {
+		suspend_stratum(pool);
+		stratum_interrupted(pool);
+		reactor_connect(pool);
+	}
+}
+
+static bool pool_lpwaiting(struct pool *pool);
+
+/* Timeouts and state changes made outside the reactor */
+static void reactor_check(struct pool *pool, time_t now)
+{
+	switch (pool->reactor_state) {
+		case REACTOR_ACTIVE:
+			if (pool->sock_gen != pool->reactor_gen && pool->sock && pool->stratum_active) {
+				/* Reconnected outside the reactor, possibly
+				 * reusing the old fd number, so arm the new
+				 * socket */
+				reactor_activate(pool);
+			} else if (pool->sock_gen != pool->reactor_gen || !pool->stratum_active) {
+				stratum_interrupted(pool);
+				reactor_connect(pool);
+			} else if (now >= pool->reactor_due) {
+				/* The protocol specifies that notify messages
+				 * should be sent every minute so if we fail to
+				 * receive any for 90 seconds we assume the
+				 * connection has been dropped and treat this pool
+				 * as dead */
+				applog(LOG_DEBUG, "Stratum timed out on pool %d", pool->pool_no);
+				suspend_stratum(pool);
+				stratum_interrupted(pool);
+				reactor_connect(pool);
+			} else if (!sock_full(pool) && !cnx_needed(pool)) {
+				/* We don't need to maintain this connection
+				 * until we switch to this pool */
+				suspend_stratum(pool);
+				clear_stratum_shares(pool);
+				clear_pool_work(pool);
+				pool->reactor_state = REACTOR_PARKED;
+			}
+			break;
+		case REACTOR_PARKED:
+			if (!pool_lpwaiting(pool))
+				reactor_connect(pool);
+			break;
+		case REACTOR_BACKOFF:
+			if (now >= pool->reactor_due)
+				reactor_connect(pool);
+			break;
+		default:
+			break;
+	}
+}
+
+static void *stratum_reactor_thread(void __maybe_unused *userdata)
+{
+	struct epoll_event events[REACTOR_EVENTS];
+	struct pool **rpools = NULL;
+	int nrpools = 0;
+
+	pthread_detach(pthread_self());
+
+	RenameThread("SReactor");
+
+	while (42) {
+		struct pool *pool;
+		uint64_t kicks;
+		time_t now;
+		int i, n;
+
+		n = epoll_wait(reactor_epfd, events, REACTOR_EVENTS, 1000);
+		for (i = 0; i < n; i++) {
+			pool = (struct pool *)events[i].data.ptr;
+			if (!pool) {
+				if (read(reactor_evfd, &kicks, sizeof(kicks)) < 0)
+					applog(LOG_DEBUG, "Failed to read stratum reactor eventfd");
+				continue;
+			}
+			/* The socket may have been replaced since */
+			if (pool->reactor_state == REACTOR_ACTIVE && pool->sock_gen == pool->reactor_gen)
+				reactor_read(pool);
+		}
+
+		now = time(NULL);
+		while ((pool = tq_pop_ms(reactor_q, 0)) != NULL) {
+			if (pool->reactor_state == REACTOR_NEW) {
+				rpools = cgrealloc(rpools, sizeof(struct pool *) * (nrpools + 1));
+				rpools[nrpools++] = pool;
+				reactor_activate(pool);
+			} else if (pool->removed)
+				pool->reactor_state = REACTOR_PARKED;
+			else if (pool->reactor_connected)
+				reactor_activate(pool);
+			else
+				reactor_backoff(pool, now);
+		}
+
+		for (i = 0; i < nrpools; ) {
+			pool = rpools[i];
+			if (unlikely(pool->removed && pool->reactor_state != REACTOR_CONNECTING)) {
+				suspend_stratum(pool);
+				rpools[i] = rpools[--nrpools];
+				continue;
+			}
+			reactor_check(pool, now);
+			i++;
+		}
+	}
+
+	return NULL;
+}
+
+static void stratum_reactor_add(struct pool *pool)
+{
+	pool->reactor_state = REACTOR_NEW;
+	tq_push(reactor_q, pool);
+	stratum_reactor_kick();
+}
+
+static void stratum_reactor_init(void)
+{
+	struct epoll_event ev;
+	pthread_t pth;
+
+	reactor_q = tq_new();
+	if (unlikely(!reactor_q))
+		quit(1, "Failed to tq_new reactor_q");
+	reactor_epfd = epoll_create1(EPOLL_CLOEXEC);
+	reactor_evfd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (unlikely(reactor_epfd < 0 || reactor_evfd < 0))
+		quit(1, "Failed to create stratum reactor fds");
+
+	memset(&ev, 0, sizeof(ev));
+	ev.events = EPOLLIN;
+	ev.data.ptr = NULL;
+	if (unlikely(epoll_ctl(reactor_epfd, EPOLL_CTL_ADD, reactor_evfd, &ev)))
+		quit(1, "Failed to add eventfd to stratum reactor");
+
+	if (unlikely(pthread_create(&pth, NULL, stratum_reactor_thread, NULL)))
+		quit(1, "Failed to create stratum reactor thread");
+}
+#else /* STRATUM_REACTOR */
 /* One stratum receive thread per pool that has stratum waits on the socket
  * checking for new messages and for the integrity of the socket connection. We
  * reset the connection based on the integrity of the receive side only as the
@@ -7033,21 +7995,9 @@ static void *stratum_rthread(void *userdata)
 			applog(LOG_DEBUG, "Stratum select failed on pool %d with value %d", pool->pool_no, sel_ret);
 			s = NULL;
 		} else
-			s = recv_line(pool);
+			s = recv_line_view(pool);
 		if (!s) {
-			applog(LOG_NOTICE, "Stratum connection to pool %d interrupted", pool->pool_no);
-			pool->getfail_occasions++;
-			total_go++;
-
-			/* If the socket to our stratum pool disconnects, all
-			 * tracked submitted shares are lost and we will leak
-			 * the memory if we don't discard their records. */
-			if (!supports_resume(pool) || opt_lowmem)
-				clear_stratum_shares(pool);
-			clear_pool_work(pool);
-			if (pool == current_pool())
-				restart_threads();
-
+			stratum_interrupted(pool);
 			while (!restart_stratum(pool)) {
 				pool_died(pool);
 				if (pool->removed)
@@ -7057,36 +8007,137 @@ static void *stratum_rthread(void *userdata)
 			continue;
 		}
 
-		/* Check this pool hasn't died while being a backup pool and
-		 * has not had its idle flag cleared */
-		stratum_resumed(pool);
-
-		if (!parse_method(pool, s) && !parse_stratum_response(pool, s))
-			applog(LOG_INFO, "Unknown stratum msg: %s", s);
-		else if (pool->swork.clean) {
-			struct work *work = make_work();
-
-			/* Generate a single work item to update the current
-			 * block database */
-			gen_stratum_work(pool, work);
-			/* Return value doesn't matter. We're just informing
-			 * that we may need to restart. */
-			test_work_current(work);
-			free_work(work);
-		}
-		free(s);
+		stratum_process_line(pool, s);
 	}
 
 out:
 	return NULL;
 }
+#endif /* STRATUM_REACTOR */
+
+/* A share formatted for submission, held by stratum_sthread until it is sent
+ * or runs out of time to retry */
+struct stratum_submit {
+	struct list_head list;
+	struct stratum_share *sshare;
+	char *msg;
+	size_t len;
+	time_t retry;
+};
+
+/* Turns a work item from the pool's stratum_q into a stratum_submit, or
+ * returns NULL if the share should not be submitted. */
+static struct stratum_submit *stratum_submit_new(struct pool *pool, struct work *work,
+						 uint32_t *last_nonce, uint64_t *last_nonce2)
+{
+	char noncehex[12], nonce2hex[20], s[1024];
+	struct stratum_share *sshare;
+	struct stratum_submit *sub;
+	uint32_t *hash32, nonce;
+	unsigned char nonce2[8];
+	uint64_t *nonce2_64;
+	int len;
+
+	if (unlikely(work->nonce2_len > 8)) {
+		applog(LOG_ERR, "Pool %d asking for inappropriately long nonce2 length %d",
+		       pool->pool_no, (int)work->nonce2_len);
+		applog(LOG_ERR, "Not attempting to submit shares");
+		free_work(work);
+		return NULL;
+	}
+
+	nonce = *((uint32_t *)(work->data + 76));
+	nonce2_64 = (uint64_t *)nonce2;
+	*nonce2_64 = htole64(work->nonce2);
+	/* Filter out duplicate shares */
+	if (unlikely(nonce == *last_nonce && *nonce2_64 == *last_nonce2)) {
+		applog(LOG_INFO, "Filtering duplicate share to pool %d",
+		       pool->pool_no);
+		free_work(work);
+		return NULL;
+	}
+	*last_nonce = nonce;
+	*last_nonce2 = *nonce2_64;
+	__bin2hex(noncehex, (const unsigned char *)&nonce, 4);
+	__bin2hex(nonce2hex, nonce2, work->nonce2_len);
+
+	sshare = cgcalloc(sizeof(struct stratum_share), 1);
+	hash32 = (uint32_t *)work->hash;
+
+	sshare->sshare_time = time(NULL);
+	/* This work item is freed in parse_stratum_response */
+	sshare->work = work;
+
+	/* Give the stratum share a unique id */
+	sshare->id = __atomic_fetch_add(&swork_id, 1, __ATOMIC_RELAXED);
+
+	if (pool->vmask) {
+		/* Submit whichever version bits were rolled into the header,
+		 * either from the work's rolled midstates or by the chip */
+		uint32_t vbits = be32toh(*(uint32_t *)work->data) & pool->vmask_bits;
+
+		len = snprintf(s, sizeof(s),
+			"{\"params\": [\"%s\", \"%s\", \"%s\", \"%s\", \"%s\", \"%08x\"], \"id\": %d, \"method\": \"mining.submit\"}\n",
+			pool->rpc_user, work->job_id, nonce2hex, work->ntime, noncehex, vbits, sshare->id);
+	} else {
+		len = snprintf(s, sizeof(s),
+			"{\"params\": [\"%s\", \"%s\", \"%s\", \"%s\", \"%s\"], \"id\": %d, \"method\": \"mining.submit\"}\n",
+			pool->rpc_user, work->job_id, nonce2hex, work->ntime, noncehex, sshare->id);
+	}
+
+	applog(LOG_INFO, "Submitting share %08lx to pool %d",
+				(long unsigned int)htole32(hash32[6]), pool->pool_no);
+
+	sub = cgcalloc(sizeof(struct stratum_submit), 1);
+	sub->sshare = sshare;
+	sub->len = MIN(len, (int)sizeof(s) - 1);
+	sub->msg = cgmalloc(sub->len + 1);
+	cg_memcpy(sub->msg, s, sub->len + 1);
+	INIT_LIST_HEAD(&sub->list);
+
+	return sub;
+}
+
+static void stratum_submit_free(struct stratum_submit *sub)
+{
+	list_del(&sub->list);
+	free(sub->msg);
+	free(sub);
+}
+
+static void stratum_submit_discard(struct pool *pool, struct stratum_submit *sub)
+{
+	applog(LOG_DEBUG, "Failed to submit stratum share, discarding");
+	free_work(sub->sshare->work);
+	free(sub->sshare);
+	pool->stale_shares++;
+	total_stale++;
+	stratum_submit_free(sub);
+}
+
+/* Add a share waiting for its response to the pool's table and to the wheel
+ * slot of the second it expires in, never behind the prune point when it was
+ * sent late. Must hold pool->sshare_lock */
+static void add_stratum_share(struct pool *pool, struct stratum_share *sshare)
+{
+	sshare->sshare_expire = MAX(sshare->sshare_time + SSHARE_EXPIRE + 1,
+				    pool->sshare_pruned + 1);
+	list_add_tail(&sshare->wheel, &pool->sshare_wheel[sshare->sshare_expire % SSHARE_WHEEL]);
+	HASH_ADD_INT(pool->stratum_shares, id, sshare);
+	pool->sshares++;
+}
 
 /* Each pool has one stratum send thread for sending shares to avoid many
  * threads being created for submission since all sends need to be serialised
- * anyway. */
+ * anyway. Every share waiting in the queue is written out in one batch, and
+ * shares that fail to send are retried on their own timer rather than holding
+ * up the ones behind them. */
 static void *stratum_sthread(void *userdata)
 {
 	struct pool *pool = (struct pool *)userdata;
+	struct stratum_submit *sub, *tmp;
+	struct list_head pending;
+	char *reply;
 	uint64_t last_nonce2 = 0;
 	uint32_t last_nonce = 0;
 	char threadname[16];
@@ -7096,138 +8147,134 @@ static void *stratum_sthread(void *userdata)
 	snprintf(threadname, sizeof(threadname), "%d/SStratum", pool->pool_no);
 	RenameThread(threadname);
 
+	pool->stratum_rq = tq_new();
+	if (!pool->stratum_rq)
+		quit(1, "Failed to create stratum_rq in stratum_sthread");
 	pool->stratum_q = tq_new();
 	if (!pool->stratum_q)
 		quit(1, "Failed to create stratum_q in stratum_sthread");
+	INIT_LIST_HEAD(&pending);
 
 	while (42) {
-		char noncehex[12], nonce2hex[20], s[1024];
-		struct stratum_share *sshare;
-		uint32_t *hash32, nonce;
-		unsigned char nonce2[8];
-		uint64_t *nonce2_64;
+		struct stratum_submit *batch[STRATUM_BATCH_MAX];
+		size_t lens[STRATUM_BATCH_MAX];
+		char *msgs[STRATUM_BATCH_MAX];
+		time_t now, next_retry = 0;
 		struct work *work;
-		bool submitted;
+		bool sessionid_match;
+		int i, sent, n = 0;
 
 		if (unlikely(pool->removed))
 			break;
 
-		work = tq_pop(pool->stratum_q);
-		if (unlikely(!work))
-			quit(1, "Stratum q returned empty work");
-
-		if (unlikely(work->nonce2_len > 8)) {
-			applog(LOG_ERR, "Pool %d asking for inappropriately long nonce2 length %d",
-			       pool->pool_no, (int)work->nonce2_len);
-			applog(LOG_ERR, "Not attempting to submit shares");
-			free_work(work);
-			continue;
+		/* Wait for new shares, or until the next retry is due */
+		list_for_each_entry(sub, &pending, list) {
+			if (!next_retry || sub->retry < next_retry)
+				next_retry = sub->retry;
+		}
+		if (!next_retry)
+			work = tq_pop(pool->stratum_q);
+		else {
+			now = time(NULL);
+			work = tq_pop_ms(pool->stratum_q, next_retry > now ? (next_retry - now) * 1000 : 0);
+		}
+		while (work) {
+			sub = stratum_submit_new(pool, work, &last_nonce, &last_nonce2);
+			if (sub)
+				list_add_tail(&sub->list, &pending);
+			work = tq_pop_ms(pool->stratum_q, 0);
+		}
+		/* Replies the reactor queued to requests from the pool. Each
+		 * one pushes an empty entry to stratum_q to wake us, which may
+		 * end the loop above early but anything behind it is popped at
+		 * once on the next pass. */
+		while ((reply = tq_pop_ms(pool->stratum_rq, 0)) != NULL) {
+			stratum_send(pool, reply, strlen(reply));
+			free(reply);
+		}
+
+		now = time(NULL);
+		list_for_each_entry(sub, &pending, list) {
+			if (sub->retry > now)
+				continue;
+			batch[n] = sub;
+			msgs[n] = sub->msg;
+			lens[n] = sub->len;
+			if (++n == STRATUM_BATCH_MAX)
+				break;
 		}
+		if (!n)
+			continue;
 
-		nonce = *((uint32_t *)(work->data + 76));
-		nonce2_64 = (uint64_t *)nonce2;
-		*nonce2_64 = htole64(work->nonce2);
-		/* Filter out duplicate shares */
-		if (unlikely(nonce == last_nonce && *nonce2_64 == last_nonce2)) {
-			applog(LOG_INFO, "Filtering duplicate share to pool %d",
-			       pool->pool_no);
-			free_work(work);
+		/* A failed send closes the socket, so only the shares written
+		 * out in full before it failed count as sent, and the rest
+		 * are resent whole on the next connection */
+		sent = stratum_send_batch(pool, msgs, lens, n);
+		if (sent) {
+			now = time(NULL);
+			/* The shares belong to parse_stratum_response as soon as
+			 * they're in stratum_shares */
+			mutex_lock(&pool->sshare_lock);
+			for (i = 0; i < sent; i++) {
+				struct stratum_share *sshare = batch[i]->sshare;
+				int ssdiff;
+
+				sshare->sshare_sent = now;
+				ssdiff = sshare->sshare_sent - sshare->sshare_time;
+				if (opt_debug || ssdiff > 0) {
+					applog(LOG_INFO, "Pool %d stratum share submission lag time %d seconds",
+					       pool->pool_no, ssdiff);
+				}
+				add_stratum_share(pool, sshare);
+				stratum_submit_free(batch[i]);
+			}
+			mutex_unlock(&pool->sshare_lock);
+			applog(LOG_DEBUG, "Successfully submitted %d, adding to stratum_shares db", sent);
+		}
+		if (likely(sent == n)) {
+			if (pool_tclear(pool, &pool->submit_fail))
+					applog(LOG_WARNING, "Pool %d communication resumed, submitting work", pool->pool_no);
 			continue;
 		}
-		last_nonce = nonce;
-		last_nonce2 = *nonce2_64;
-		__bin2hex(noncehex, (const unsigned char *)&nonce, 4);
-		__bin2hex(nonce2hex, nonce2, work->nonce2_len);
-
-		sshare = cgcalloc(sizeof(struct stratum_share), 1);
-		hash32 = (uint32_t *)work->hash;
-		submitted = false;
-
-		sshare->sshare_time = time(NULL);
-		/* This work item is freed in parse_stratum_response */
-		sshare->work = work;
-		memset(s, 0, 1024);
-
-		mutex_lock(&sshare_lock);
-		/* Give the stratum share a unique id */
-		sshare->id = swork_id++;
-		mutex_unlock(&sshare_lock);
-
-		if (pool->vmask) {
-			snprintf(s, sizeof(s),
-				 "{\"params\": [\"%s\", \"%s\", \"%s\", \"%s\", \"%s\", \"%s\"], \"id\": %d, \"method\": \"mining.submit\"}",
-				pool->rpc_user, work->job_id, nonce2hex, work->ntime, noncehex, pool->vmask_002[work->micro_job_id], sshare->id);
-		} else {
-			snprintf(s, sizeof(s),
-				"{\"params\": [\"%s\", \"%s\", \"%s\", \"%s\", \"%s\"], \"id\": %d, \"method\": \"mining.submit\"}",
-				pool->rpc_user, work->job_id, nonce2hex, work->ntime, noncehex, sshare->id);
-		}
-
-		applog(LOG_INFO, "Submitting share %08lx to pool %d",
-					(long unsigned int)htole32(hash32[6]), pool->pool_no);
-
-		/* Try resubmitting for up to 2 minutes if we fail to submit
-		 * once and the stratum pool nonce1 still matches suggesting
-		 * we may be able to resume. */
-		while (time(NULL) < sshare->sshare_time + 120) {
-			bool sessionid_match;
-
-			if (likely(stratum_send(pool, s, strlen(s)))) {
-				mutex_lock(&sshare_lock);
-				HASH_ADD_INT(stratum_shares, id, sshare);
-				pool->sshares++;
-				mutex_unlock(&sshare_lock);
-
-				if (pool_tclear(pool, &pool->submit_fail))
-						applog(LOG_WARNING, "Pool %d communication resumed, submitting work", pool->pool_no);
-				applog(LOG_DEBUG, "Successfully submitted, adding to stratum_shares db");
-				submitted = true;
-				break;
-			}
-			if (!pool_tset(pool, &pool->submit_fail) && cnx_needed(pool)) {
-				applog(LOG_WARNING, "Pool %d stratum share submission failure", pool->pool_no);
-				total_ro++;
-				pool->remotefail_occasions++;
-			}
+		if (!pool_tset(pool, &pool->submit_fail) && cnx_needed(pool)) {
+			applog(LOG_WARNING, "Pool %d stratum share submission failure", pool->pool_no);
+			total_ro++;
+			pool->remotefail_occasions++;
+		}
 
+		/* Try resubmitting each share every 5 seconds for up to 2
+		 * minutes as long as the stratum pool nonce1 still matches
+		 * suggesting we may be able to resume. */
+		for (i = sent; i < n; i++) {
+			sub = batch[i];
 			if (opt_lowmem) {
 				applog(LOG_DEBUG, "Lowmem option prevents resubmitting stratum share");
-				break;
+				stratum_submit_discard(pool, sub);
+				continue;
 			}
 
 			cg_rlock(&pool->data_lock);
-			sessionid_match = (pool->nonce1 && !strcmp(work->nonce1, pool->nonce1));
+			sessionid_match = (pool->nonce1 && !strcmp(sub->sshare->work->nonce1, pool->nonce1));
 			cg_runlock(&pool->data_lock);
 
 			if (!sessionid_match) {
 				applog(LOG_DEBUG, "No matching session id for resubmitting stratum share");
-				break;
-			}
-			/* Retry every 5 seconds */
-			sleep(5);
-		}
-
-		if (unlikely(!submitted)) {
-			applog(LOG_DEBUG, "Failed to submit stratum share, discarding");
-			free_work(work);
-			free(sshare);
-			pool->stale_shares++;
-			total_stale++;
-		} else {
-			int ssdiff;
-
-			sshare->sshare_sent = time(NULL);
-			ssdiff = sshare->sshare_sent - sshare->sshare_time;
-			if (opt_debug || ssdiff > 0) {
-				applog(LOG_INFO, "Pool %d stratum share submission lag time %d seconds",
-				       pool->pool_no, ssdiff);
+				stratum_submit_discard(pool, sub);
+				continue;
 			}
+			sub->retry = now + 5;
+			if (sub->retry >= sub->sshare->sshare_time + 120)
+				stratum_submit_discard(pool, sub);
 		}
 	}
 
+	list_for_each_entry_safe(sub, tmp, &pending, list)
+		stratum_submit_discard(pool, sub);
+
 	/* Freeze the work queue but don't free up its memory in case there is
 	 * work still trying to be submitted to the removed pool. */
 	tq_freeze(pool->stratum_q);
+	tq_freeze(pool->stratum_rq);
 
 	return NULL;
 }
@@ -7238,8 +8285,12 @@ static void init_stratum_threads(struct pool *pool)
 
 	if (unlikely(pthread_create(&pool->stratum_sthread, NULL, stratum_sthread, (void *)pool)))
 		quit(1, "Failed to create stratum sthread");
+#ifdef STRATUM_REACTOR
+	stratum_reactor_add(pool);
+#else
 	if (unlikely(pthread_create(&pool->stratum_rthread, NULL, stratum_rthread, (void *)pool)))
 		quit(1, "Failed to create stratum rthread");
+#endif
 }
 
 static void *longpoll_thread(void *userdata);
@@ -7558,19 +8609,55 @@ static void pool_resus(struct pool *pool)
 static bool work_filled;
 static bool work_emptied;
 
+static struct work *staged_pop(void)
+{
+	struct work *work;
+
+	/* Find clone work if possible, to allow masters to be reused */
+	work = cgring_pop(&staged_works);
+	if (!work)
+		work = cgring_pop(&staged_rolls);
+	if (unlikely(!work && __atomic_load_n(&staged_spilled, __ATOMIC_SEQ_CST))) {
+		/* The rings are retried under stage_lock since filter_staged
+		 * may have been putting older work back in them */
+		mutex_lock(&stage_lock);
+		work = cgring_pop(&staged_works);
+		if (!work)
+			work = cgring_pop(&staged_rolls);
+		if (!work && staged_spill) {
+			work = staged_spill;
+			HASH_DEL(staged_spill, work);
+			__atomic_sub_fetch(&staged_spilled, 1, __ATOMIC_SEQ_CST);
+		}
+		mutex_unlock(&stage_lock);
+	}
+	if (!work)
+		return NULL;
+	__atomic_sub_fetch(&staged_count, 1, __ATOMIC_SEQ_CST);
+
+	/* Signal the getwork scheduler to look for more work if it's waiting */
+	if (__atomic_load_n(&gws_waiting, __ATOMIC_SEQ_CST))
+		wake_gws();
+
+	return work;
+}
+
 /* If this is called non_blocking, it will return NULL for work so that must
  * be handled. */
 static struct work *hash_pop(bool blocking)
 {
-	struct work *work = NULL, *tmp;
-	int hc;
+	struct work *work;
 
-	mutex_lock(stgd_lock);
-	if (!HASH_COUNT(staged_work)) {
+	work = staged_pop();
+	if (!work) {
 		work_emptied = true;
 		if (!blocking)
-			goto out_unlock;
-		do {
+			return NULL;
+
+		mutex_lock(stgd_lock);
+		__atomic_add_fetch(&staged_waiters, 1, __ATOMIC_SEQ_CST);
+		__atomic_thread_fence(__ATOMIC_SEQ_CST);
+		while (!(work = staged_pop())) {
 			struct timespec abstime, tdiff = {10, 0};
 			int rc;
 
@@ -7585,48 +8672,47 @@ static struct work *hash_pop(bool blocking)
 				no_work = true;
 				applog(LOG_WARNING, "Waiting for work to be available from pools.");
 			}
-		} while (!HASH_COUNT(staged_work));
-	}
-
-	if (no_work) {
-		applog(LOG_WARNING, "Work available from pools, resuming.");
-		no_work = false;
-	}
-
-	hc = HASH_COUNT(staged_work);
-	/* Find clone work if possible, to allow masters to be reused */
-	if (hc > staged_rollable) {
-		HASH_ITER(hh, staged_work, work, tmp) {
-			if (!work_rollable(work))
-				break;
 		}
-	} else
-		work = staged_work;
-	HASH_DEL(staged_work, work);
-	if (work_rollable(work))
-		staged_rollable--;
-
-	/* Signal the getwork scheduler to look for more work */
-	pthread_cond_signal(&gws_cond);
-
-	/* Signal hash_pop again in case there are mutliple hash_pop waiters */
-	pthread_cond_signal(&getq->cond);
+		__atomic_sub_fetch(&staged_waiters, 1, __ATOMIC_SEQ_CST);
+		if (no_work) {
+			applog(LOG_WARNING, "Work available from pools, resuming.");
+			no_work = false;
+		}
+		mutex_unlock(stgd_lock);
+	}
 
 	/* Keep track of last getwork grabbed */
 	last_getwork = time(NULL);
-out_unlock:
-	mutex_unlock(stgd_lock);
 
 	return work;
 }
 
 static void gen_hash(unsigned char *data, unsigned char *hash, int len)
 {
-	unsigned char hash1[32];
+	sha256d(data, len, hash);
+}
+
+#ifdef HAVE_LIBCURL
+/* Hash a row of 64 byte merkle node pairs from in into their 32 byte parents
+ * at out, as many at a time as the sha256 backend allows. out may overlap in
+ * as long as it does not start after it. */
+static void gen_hash_pairs(const unsigned char *in, unsigned char *out, int pairs)
+{
+	unsigned char hash[SHA256_MAX_LANES][32], *digest[SHA256_MAX_LANES];
+	const unsigned char *message[SHA256_MAX_LANES];
+	int i, j, n;
 
-	sha256(data, len, hash1);
-	sha256(hash1, 32, hash);
+	for (i = 0; i < pairs; i += n) {
+		n = MIN(pairs - i, SHA256_MAX_LANES);
+		for (j = 0; j < n; j++) {
+			message[j] = in + 64 * (i + j);
+			digest[j] = hash[j];
+		}
+		sha256d_mb(message, 64, digest, n);
+		cg_memcpy(out + 32 * i, hash, 32 * n);
+	}
 }
+#endif
 
 void set_target(unsigned char *dest_target, double diff)
 {
@@ -7748,82 +8834,151 @@ void get_work_by_nonce2(struct thr_info *thr,
 #endif
 
 
+/* Keep a reference counted copy of a pool job string, only replacing it when
+ * the job changes it */
+static void intern_job_string(char **interned, const char *str)
+{
+	if (*interned && !strcmp(*interned, str))
+		return;
+	cgstr_put(*interned);
+	*interned = cgstr_new(str);
+}
+
+/* Fills in the merkle root of n works whose coinbase tails from nonce2's
+ * block onwards are at tail, tail_len bytes apart, running the lanes of the
+ * sha256 backend across the works at each level of the merkle branch. */
+static void gen_merkle_roots(struct pool *pool, struct work **works,
+			     const unsigned char *tail, int tail_len, int n)
+{
+	unsigned char node[SHA256_MAX_LANES][64], *digest[SHA256_MAX_LANES];
+	const unsigned char *message[SHA256_MAX_LANES];
+	int i, j, lanes;
+
+	for (i = 0; i < n; i += lanes) {
+		lanes = MIN(n - i, SHA256_MAX_LANES);
+		for (j = 0; j < lanes; j++) {
+			message[j] = tail + (i + j) * tail_len;
+			digest[j] = node[j];
+		}
+		if (pool->cb_prefix_len)
+			sha256d_resume_mb(pool->cb_midstate, pool->cb_prefix_len,
+					  message, tail_len, digest, lanes);
+		else
+			sha256d_mb(message, tail_len, digest, lanes);
+
+		for (j = 0; j < lanes; j++)
+			message[j] = node[j];
+		for (j = 0; j < pool->merkles; j++) {
+			int k;
+
+			for (k = 0; k < lanes; k++)
+				cg_memcpy(node[k] + 32, pool->swork.merkle_bin[j], 32);
+			sha256d_mb(message, 64, digest, lanes);
+		}
+		for (j = 0; j < lanes; j++) {
+			struct work *work = works[i + j];
+
+			flip32(work->data + 36, node[j]);
+		}
+	}
+}
+
 /* Generates stratum based work based on the most recent notify information
  * from the pool. This will keep generating work while a pool is down so we use
- * other means to detect when the pool has died in stratum_thread */
-static void gen_stratum_work(struct pool *pool, struct work *work)
+ * other means to detect when the pool has died in stratum_thread. The n works
+ * are generated from consecutive nonce2 values under the one data_lock
+ * acquisition. */
+static void gen_stratum_works(struct pool *pool, struct work **works, int n)
 {
-	unsigned char merkle_root[32], merkle_sha[64];
-	uint32_t *data32, *swap32;
+	unsigned char *tail;
 	uint64_t nonce2le;
-	int i;
+	int i, tail_len;
 
 	cg_wlock(&pool->data_lock);
 
-	/* Update coinbase. Always use an LE encoded nonce2 to fill in values
-	 * from left to right and prevent overflow errors with small n2sizes */
-	nonce2le = htole64(pool->nonce2);
-	cg_memcpy(pool->coinbase + pool->nonce2_offset, &nonce2le, pool->n2size);
-	work->nonce2 = pool->nonce2++;
-	work->nonce2_len = pool->n2size;
+	intern_job_string(&pool->work_job_id, pool->swork.job_id);
+	intern_job_string(&pool->work_nonce1, pool->nonce1);
+	intern_job_string(&pool->work_ntime, pool->ntime);
+
+	/* Only the coinbase from the last whole block before nonce2 changes
+	 * between works, so each work gets its own copy of just that part */
+	tail_len = pool->coinbase_len - pool->cb_prefix_len;
+	tail = cgmalloc(tail_len * n);
+	for (i = 0; i < n; i++) {
+		struct work *work = works[i];
+
+		/* Update coinbase. Always use an LE encoded nonce2 to fill in
+		 * values from left to right and prevent overflow errors with
+		 * small n2sizes */
+		nonce2le = htole64(pool->nonce2);
+		cg_memcpy(pool->coinbase + pool->nonce2_offset, &nonce2le, pool->n2size);
+		cg_memcpy(tail + i * tail_len, pool->coinbase + pool->cb_prefix_len, tail_len);
+		work->nonce2 = pool->nonce2++;
+		work->nonce2_len = pool->n2size;
+	}
 
 	/* Downgrade to a read lock to read off the pool variables */
 	cg_dwlock(&pool->data_lock);
 
-	/* Generate merkle root */
-	gen_hash(pool->coinbase, merkle_root, pool->coinbase_len);
-	cg_memcpy(merkle_sha, merkle_root, 32);
-	for (i = 0; i < pool->merkles; i++) {
-		cg_memcpy(merkle_sha + 32, pool->swork.merkle_bin[i], 32);
-		gen_hash(merkle_sha, merkle_root, 64);
-		cg_memcpy(merkle_sha, merkle_root, 32);
-	}
-	data32 = (uint32_t *)merkle_sha;
-	swap32 = (uint32_t *)merkle_root;
-	flip32(swap32, data32);
+	for (i = 0; i < n; i++) {
+		struct work *work = works[i];
 
-	/* Copy the data template from header_bin */
-	cg_memcpy(work->data, pool->header_bin, 112);
-	cg_memcpy(work->data + 36, merkle_root, 32);
+		/* Copy the data template from header_bin */
+		cg_memcpy(work->data, pool->header_bin, 112);
 
-	/* Store the stratum work diff to check it still matches the pool's
-	 * stratum diff when submitting shares */
-	work->sdiff = pool->sdiff;
+		/* Store the stratum work diff to check it still matches the
+		 * pool's stratum diff when submitting shares */
+		work->sdiff = pool->sdiff;
+		work->job_gen = pool->job_gen;
 
-	/* Copy parameters required for share submission */
-	work->job_id = strdup(pool->swork.job_id);
-	work->nonce1 = strdup(pool->nonce1);
-	work->ntime = strdup(pool->ntime);
+		/* Share the parameters required for share submission */
+		work->job_id = cgstr_get(pool->work_job_id);
+		work->nonce1 = cgstr_get(pool->work_nonce1);
+		work->ntime = cgstr_get(pool->work_ntime);
+	}
+
+	/* Generate merkle roots */
+	gen_merkle_roots(pool, works, tail, tail_len, n);
 	cg_runlock(&pool->data_lock);
+	free(tail);
 
-	if (opt_debug) {
-		char *header, *merkle_hash;
+	for (i = 0; i < n; i++) {
+		struct work *work = works[i];
 
-		header = bin2hex(work->data, 112);
-		merkle_hash = bin2hex((const unsigned char *)merkle_root, 32);
-		applog(LOG_DEBUG, "Generated stratum merkle %s", merkle_hash);
-		applog(LOG_DEBUG, "Generated stratum header %s", header);
-		applog(LOG_DEBUG, "Work job_id %s nonce2 %"PRIu64" ntime %s", work->job_id,
-		       work->nonce2, work->ntime);
-		free(header);
-		free(merkle_hash);
-	}
+		if (opt_debug) {
+			char *header, *merkle_hash;
 
-	calc_midstate(pool, work);
-	set_target(work->target, work->sdiff);
+			header = bin2hex(work->data, 112);
+			merkle_hash = bin2hex(work->data + 36, 32);
+			applog(LOG_DEBUG, "Generated stratum merkle %s", merkle_hash);
+			applog(LOG_DEBUG, "Generated stratum header %s", header);
+			applog(LOG_DEBUG, "Work job_id %s nonce2 %"PRIu64" ntime %s", work->job_id,
+			       work->nonce2, work->ntime);
+			free(header);
+			free(merkle_hash);
+		}
 
-	local_work++;
-	work->pool = pool;
-	work->stratum = true;
-	work->nonce = 0;
-	work->longpoll = false;
-	work->getwork_mode = GETWORK_MODE_STRATUM;
-	work->work_block = work_block;
-	/* Nominally allow a driver to ntime roll 60 seconds */
-	work->drv_rolllimit = 60;
-	calc_diff(work, work->sdiff);
+		calc_midstate(pool, work);
+		set_target(work->target, work->sdiff);
 
-	cgtime(&work->tv_staged);
+		local_work++;
+		work->pool = pool;
+		work->stratum = true;
+		work->nonce = 0;
+		work->longpoll = false;
+		work->getwork_mode = GETWORK_MODE_STRATUM;
+		work->work_block = work_block;
+		/* Nominally allow a driver to ntime roll 60 seconds */
+		work->drv_rolllimit = 60;
+		calc_diff(work, work->sdiff);
+
+		cgtime(&work->tv_staged);
+	}
+}
+
+static void gen_stratum_work(struct pool *pool, struct work *work)
+{
+	gen_stratum_works(pool, &work, 1);
 }
 
 #ifdef HAVE_LIBCURL
@@ -7934,7 +9089,7 @@ static void gen_solo_work(struct pool *pool, struct work *work)
 	work->sdiff = pool->sdiff;
 
 	/* Copy parameters required for share submission */
-	work->ntime = strdup(pool->ntime);
+	work->ntime = cgstr_new(pool->ntime);
 	cg_memcpy(work->target, pool->gbt_target, 32);
 	cg_runlock(&pool->gbt_lock);
 
@@ -8030,7 +9185,6 @@ struct work *get_work(struct thr_info *thr, const int thr_id)
 static void submit_work_async(struct work *work)
 {
 	struct pool *pool = work->pool;
-	pthread_t submit_thread;
 
 	cgtime(&work->tv_work_found);
 	if (opt_benchmark) {
@@ -8079,42 +9233,115 @@ static void submit_work_async(struct work *work)
 			free_work(work);
 		}
 	} else {
-		applog(LOG_DEBUG, "Pushing submit work to work thread");
-		if (unlikely(pthread_create(&submit_thread, NULL, submit_work_thread, (void *)work)))
-			quit(1, "Failed to create submit_work_thread");
+		applog(LOG_DEBUG, "Pushing submit work to submit queue");
+		submit_work_queue(work);
 	}
 }
 
-void inc_hw_errors(struct thr_info *thr)
+/* Counts valid diff1 work for pool and HW errors against a device straight
+ * away, holding them in its share_stats until fold_share_stats adds them to
+ * the pool and global totals. */
+static void add_share_stats(struct cgpu_info *cgpu, struct pool *pool, int64_t diff1, int hw)
 {
-	applog(LOG_INFO, "%s %d: invalid nonce - HW error", thr->cgpu->drv->name,
-	       thr->cgpu->device_id);
+	struct share_stats *ss = &cgpu->share_stats;
+	struct pool *last_pool = NULL;
+	int64_t last_diff1 = 0;
+
+	mutex_lock(&ss->lock);
+	if (diff1) {
+		if (unlikely(ss->pool != pool)) {
+			last_pool = ss->pool;
+			last_diff1 = ss->pool_diff1;
+			ss->pool = pool;
+			ss->pool_diff1 = 0;
+		}
+		cgpu->diff1 += diff1;
+		ss->diff1 += diff1;
+		ss->pool_diff1 += diff1;
+		cgpu->last_device_valid_work = time(NULL);
+	}
+	cgpu->hw_errors += hw;
+	ss->hw_errors += hw;
+	mutex_unlock(&ss->lock);
+
+	/* The device has moved on to another pool, so settle up with the
+	 * last one now */
+	if (unlikely(last_pool && last_diff1)) {
+		mutex_lock(&stats_lock);
+		last_pool->diff1 += last_diff1;
+		mutex_unlock(&stats_lock);
+	}
+}
+
+static void fold_cgpu_stats(struct cgpu_info *cgpu)
+{
+	struct share_stats *ss = &cgpu->share_stats;
+	int64_t diff1, pool_diff1;
+	struct pool *pool;
+	int hw;
+
+	mutex_lock(&ss->lock);
+	diff1 = ss->diff1;
+	pool = ss->pool;
+	pool_diff1 = ss->pool_diff1;
+	hw = ss->hw_errors;
+	ss->diff1 = ss->pool_diff1 = 0;
+	ss->hw_errors = 0;
+	mutex_unlock(&ss->lock);
+
+	if (!diff1 && !hw)
+		return;
 
 	mutex_lock(&stats_lock);
-	hw_errors++;
-	thr->cgpu->hw_errors++;
+	total_diff1 += diff1;
+	if (pool)
+		pool->diff1 += pool_diff1;
+	hw_errors += hw;
 	mutex_unlock(&stats_lock);
+}
+
+/* Brings the pool and global diff1 and HW error totals up to date with what
+ * every device has reported. Called by anything about to display them. */
+void fold_share_stats(void)
+{
+	int i;
+
+	rd_lock(&devices_lock);
+	for (i = 0; i < total_devices; i++)
+		fold_cgpu_stats(devices[i]);
+	rd_unlock(&devices_lock);
+}
+
+static void log_hw_error(struct cgpu_info *cgpu)
+{
+	applog(LOG_INFO, "%s %d: invalid nonce - HW error", cgpu->drv->name,
+	       cgpu->device_id);
+}
+
+void inc_hw_errors(struct thr_info *thr)
+{
+	log_hw_error(thr->cgpu);
+
+	add_share_stats(thr->cgpu, NULL, 0, 1);
 
 	thr->cgpu->drv->hw_error(thr);
 }
 
-/* Fills in the work nonce and builds the output data in work->hash */
-static void rebuild_nonce(struct work *work, uint32_t nonce)
+/* Fills in the work nonce and builds the output data in work->hash. Returns
+ * false early, with work->hash only partly rebuilt, if it can't meet diff 1 */
+static bool rebuild_nonce(struct work *work, uint32_t nonce)
 {
 	uint32_t *work_nonce = (uint32_t *)(work->data + 64 + 12);
 
 	*work_nonce = htole32(nonce);
 
-	regen_hash(work);
+	return regen_hash_diff1(work);
 }
 
 /* For testing a nonce against diff 1 */
 bool test_nonce(struct work *work, uint32_t nonce)
 {
-	uint32_t *hash_32 = (uint32_t *)(work->hash + 28);
-
-	rebuild_nonce(work, nonce);
-	return (*hash_32 == 0);
+	return rebuild_nonce(work, nonce);
 }
 
 /* For testing a nonce against an arbitrary diff */
@@ -8122,14 +9349,21 @@ bool test_nonce_diff(struct work *work, uint32_t nonce, double diff)
 {
 	uint64_t *hash64 = (uint64_t *)(work->hash + 24), diff64;
 
-	rebuild_nonce(work, nonce);
 	diff64 = 0x00000000ffff0000ULL;
 	diff64 /= diff;
 
+	if (unlikely(diff < 1)) {
+		/* rebuild_nonce may stop short of a hash this could accept */
+		rebuild_nonce(work, nonce);
+		regen_hash(work);
+	} else if (!rebuild_nonce(work, nonce))
+		return false;
+
 	return (le64toh(*hash64) <= diff64);
 }
 
-static void update_work_stats(struct thr_info *thr, struct work *work)
+/* Works out the share diff of work and flags it if it solves a block */
+static void update_work_block(struct work *work)
 {
 	double test_diff = current_diff;
 
@@ -8142,30 +9376,35 @@ static void update_work_stats(struct thr_info *thr, struct work *work)
 		work->mandatory = true;
 		applog(LOG_NOTICE, "Found block for pool %d!", work->pool->pool_no);
 	}
+}
 
-	mutex_lock(&stats_lock);
-	total_diff1 += work->device_diff;
-	thr->cgpu->diff1 += work->device_diff;
-	work->pool->diff1 += work->device_diff;
-	thr->cgpu->last_device_valid_work = time(NULL);
-	mutex_unlock(&stats_lock);
+static void update_work_stats(struct thr_info *thr, struct work *work)
+{
+	update_work_block(work);
+
+	add_share_stats(thr->cgpu, work->pool, work->device_diff, 0);
+}
+
+/* Submits a copy of work if it meets the work target, returning whether it
+ * did */
+static bool submit_target_work(struct cgpu_info *cgpu, struct work *work)
+{
+	if (!fulltest(work->hash, work->target)) {
+		applog(LOG_INFO, "%s %d: Share above target", cgpu->drv->name,
+		       cgpu->device_id);
+		return false;
+	}
+	submit_work_async(copy_work(work));
+	return true;
 }
 
 /* To be used once the work has been tested to be meet diff1 and has had its
  * nonce adjusted. Returns true if the work target is met. */
 bool submit_tested_work(struct thr_info *thr, struct work *work)
 {
-	struct work *work_out;
 	update_work_stats(thr, work);
 
-	if (!fulltest(work->hash, work->target)) {
-		applog(LOG_INFO, "%s %d: Share above target", thr->cgpu->drv->name,
-		       thr->cgpu->device_id);
-		return false;
-	}
-	work_out = copy_work(work);
-	submit_work_async(work_out);
-	return true;
+	return submit_target_work(thr->cgpu, work);
 }
 
 /* Rudimentary test to see if cgpu has returned the same nonce twice in a row which is
@@ -8200,6 +9439,76 @@ bool submit_nonce(struct thr_info *thr, struct work *work, uint32_t nonce)
 	return true;
 }
 
+/* Batched version of submit_nonce for drivers that read several nonces for
+ * the same work item at once, eg. from a result FIFO. The nonces are hashed
+ * together from the work midstate and the device/pool stats are updated in
+ * one go. Only shares meeting the work target are copied and
+ * submitted. Returns the number of valid nonces. */
+int submit_nonces(struct thr_info *thr, struct work *work, const uint32_t *nonces, int count)
+{
+	unsigned char hash[SHA256_MAX_LANES][32], *digest[SHA256_MAX_LANES];
+	uint32_t tail[SHA256_MAX_LANES][4], *work_nonce, state[8];
+	const unsigned char *tails[SHA256_MAX_LANES];
+	struct cgpu_info *cgpu = thr->cgpu;
+	uint32_t *data32 = (uint32_t *)(work->data + 64);
+	int i, j, n, valid = 0, hw = 0;
+	unsigned char *midstate;
+
+	midstate = work_midstate(work);
+	if (midstate) {
+		cg_memcpy(state, midstate, 32);
+		endian_flip32(state, state);
+	}
+	work_nonce = (uint32_t *)(work->data + 64 + 12);
+
+	for (i = 0; i < count; i += n) {
+		n = MIN(count - i, SHA256_MAX_LANES);
+
+		if (likely(midstate)) {
+			for (j = 0; j < n; j++) {
+				tail[j][0] = swab32(data32[0]);
+				tail[j][1] = swab32(data32[1]);
+				tail[j][2] = swab32(data32[2]);
+				tail[j][3] = swab32(htole32(nonces[i + j]));
+				tails[j] = (unsigned char *)tail[j];
+				digest[j] = hash[j];
+			}
+			sha256d_midstate_tail_mb(state, tails, digest, n);
+		} else {
+			for (j = 0; j < n; j++) {
+				*work_nonce = htole32(nonces[i + j]);
+				regen_hash(work);
+				cg_memcpy(hash[j], work->hash, 32);
+			}
+		}
+
+		for (j = 0; j < n; j++) {
+			uint32_t nonce = nonces[i + j];
+			uint32_t *hash_32 = (uint32_t *)(hash[j] + 28);
+
+			if (!new_nonce(thr, nonce) || *hash_32 != 0) {
+				log_hw_error(cgpu);
+				hw++;
+				continue;
+			}
+			valid++;
+			*work_nonce = htole32(nonce);
+			cg_memcpy(work->hash, hash[j], 32);
+			update_work_block(work);
+			if (opt_benchfile && opt_benchfile_display)
+				benchfile_dspwork(work, nonce);
+			submit_target_work(cgpu, work);
+		}
+	}
+
+	add_share_stats(cgpu, work->pool, work->device_diff * valid, hw);
+
+	for (i = 0; i < hw; i++)
+		cgpu->drv->hw_error(thr);
+
+	return valid;
+}
+
 /* Allows drivers to submit work items where the driver has changed the ntime
  * value by noffset. Must be only used with a work protocol that does not ntime
  * roll itself intrinsically to generate work (eg stratum). We do not touch
@@ -8222,13 +9531,8 @@ bool submit_noffset_nonce(struct thr_info *thr, struct work *work_in, uint32_t n
 		benchfile_dspwork(work, nonce);
 
 	ret = true;
-	if (!fulltest(work->hash, work->target)) {
-		free_work(work);
-		applog(LOG_INFO, "%s %d: Share above target", thr->cgpu->drv->name,
-		       thr->cgpu->device_id);
-		goto  out;
-	}
-	submit_work_async(work);
+	submit_target_work(thr->cgpu, work);
+	free_work(work);
 
 out:
 	return ret;
@@ -8439,11 +9743,15 @@ static void fill_queue(struct thr_info *mythr, struct cgpu_info *cgpu, struct de
 	} while (!drv->queue_full(cgpu));
 }
 
-/* Add a work item to a cgpu's queued hashlist */
+/* Add a work item to a cgpu's queued hashlist, and to the midstate index */
 void __add_queued(struct cgpu_info *cgpu, struct work *work)
 {
 	cgpu->queued_count++;
 	HASH_ADD_INT(cgpu->queued_work, id, work);
+	cg_memcpy(work->midstate_key, work->midstate, 32);
+	cg_memcpy(work->midstate_key + 32, work->data + 64, 12);
+	HASH_ADD(hh_midstate, cgpu->queued_midstate, midstate_key,
+		 sizeof(work->midstate_key), work);
 }
 
 struct work *__get_queued(struct cgpu_info *cgpu)
@@ -8513,6 +9821,23 @@ struct work *__find_work_bymidstate(struct work *que, char *midstate, size_t mid
 	return ret;
 }
 
+/* As __find_work_bymidstate on a cgpu's queued work, looking the common
+ * values of 32, 64, 12 up in the midstate index instead of searching. */
+static struct work *__find_queued_bymidstate(struct cgpu_info *cgpu, char *midstate, size_t midstatelen, char *data, int offset, size_t datalen)
+{
+	unsigned char key[44];
+	struct work *ret = NULL;
+
+	if (midstatelen != 32 || offset != 64 || datalen != 12)
+		return __find_work_bymidstate(cgpu->queued_work, midstate, midstatelen, data, offset, datalen);
+
+	cg_memcpy(key, midstate, 32);
+	cg_memcpy(key + 32, data, 12);
+	HASH_FIND(hh_midstate, cgpu->queued_midstate, key, sizeof(key), ret);
+
+	return ret;
+}
+
 /* This function is for finding an already queued work item in the
  * device's queued_work hashtable. Code using this function must be able
  * to handle NULL as a return which implies there is no matching work.
@@ -8522,7 +9847,7 @@ struct work *find_queued_work_bymidstate(struct cgpu_info *cgpu, char *midstate,
 	struct work *ret;
 
 	rd_lock(&cgpu->qlock);
-	ret = __find_work_bymidstate(cgpu->queued_work, midstate, midstatelen, data, offset, datalen);
+	ret = __find_queued_bymidstate(cgpu, midstate, midstatelen, data, offset, datalen);
 	rd_unlock(&cgpu->qlock);
 
 	return ret;
@@ -8533,7 +9858,7 @@ struct work *clone_queued_work_bymidstate(struct cgpu_info *cgpu, char *midstate
 	struct work *work, *ret = NULL;
 
 	rd_lock(&cgpu->qlock);
-	work = __find_work_bymidstate(cgpu->queued_work, midstate, midstatelen, data, offset, datalen);
+	work = __find_queued_bymidstate(cgpu, midstate, midstatelen, data, offset, datalen);
 	if (work)
 		ret = copy_work(work);
 	rd_unlock(&cgpu->qlock);
@@ -8580,6 +9905,7 @@ void __work_completed(struct cgpu_info *cgpu, struct work *work)
 {
 	cgpu->queued_count--;
 	HASH_DEL(cgpu->queued_work, work);
+	HASH_DELETE(hh_midstate, cgpu->queued_midstate, work);
 }
 
 /* This iterates over a queued hashlist finding work started more than secs
@@ -8624,7 +9950,7 @@ struct work *take_queued_work_bymidstate(struct cgpu_info *cgpu, char *midstate,
 	struct work *work;
 
 	wr_lock(&cgpu->qlock);
-	work = __find_work_bymidstate(cgpu->queued_work, midstate, midstatelen, data, offset, datalen);
+	work = __find_queued_bymidstate(cgpu, midstate, midstatelen, data, offset, datalen);
 	if (work)
 		__work_completed(cgpu, work);
 	wr_unlock(&cgpu->qlock);
@@ -8857,11 +10183,16 @@ static struct pool *select_longpoll_pool(struct pool *cp)
 /* This will make the longpoll thread wait till it's the current pool, or it
  * has been flagged as rejecting, before attempting to open any connections.
  */
+static bool pool_lpwaiting(struct pool *pool)
+{
+	return (!cnx_needed(pool) && (pool->enabled == POOL_DISABLED ||
+		(pool != current_pool() && pool_strategy != POOL_LOADBALANCE &&
+		pool_strategy != POOL_BALANCE)));
+}
+
 static void wait_lpcurrent(struct pool *pool)
 {
-	while (!cnx_needed(pool) && (pool->enabled == POOL_DISABLED ||
-	       (pool != current_pool() && pool_strategy != POOL_LOADBALANCE &&
-	       pool_strategy != POOL_BALANCE))) {
+	while (pool_lpwaiting(pool)) {
 		mutex_lock(&lp_lock);
 		pthread_cond_wait(&lp_cond, &lp_lock);
 		mutex_unlock(&lp_lock);
@@ -9110,18 +10441,28 @@ static void prune_stratum_shares(struct pool *pool)
 {
 	struct stratum_share *sshare, *tmpshare;
 	time_t current_time = time(NULL);
+	struct list_head *slot;
 	int cleared = 0;
 
-	mutex_lock(&sshare_lock);
-	HASH_ITER(hh, stratum_shares, sshare, tmpshare) {
-		if (sshare->work->pool == pool && current_time > sshare->sshare_time + 120) {
-			HASH_DEL(stratum_shares, sshare);
+	mutex_lock(&pool->sshare_lock);
+	/* Only the wheel slots for the seconds passed since the last prune
+	 * need looking at, and everything in them has expired */
+	if (current_time - pool->sshare_pruned > SSHARE_WHEEL)
+		pool->sshare_pruned = current_time - SSHARE_WHEEL;
+	while (pool->sshare_pruned < current_time) {
+		slot = &pool->sshare_wheel[++pool->sshare_pruned % SSHARE_WHEEL];
+		list_for_each_entry_safe(sshare, tmpshare, slot, wheel) {
+			if (sshare->sshare_expire > current_time)
+				continue;
+			HASH_DEL(pool->stratum_shares, sshare);
+			list_del(&sshare->wheel);
 			free_work(sshare->work);
+			pool->sshares--;
 			free(sshare);
 			cleared++;
 		}
 	}
-	mutex_unlock(&sshare_lock);
+	mutex_unlock(&pool->sshare_lock);
 
 	if (cleared) {
 		applog(LOG_WARNING, "Lost %d shares due to no stratum share response from pool %d",
@@ -9408,6 +10749,8 @@ void print_summary(void)
 	int hours, mins, secs, i;
 	double utility, displayed_hashes, work_util;
 
+	fold_share_stats();
+
 	timersub(&total_tv_end, &total_tv_start, &diff);
 	hours = diff.tv_sec / 3600;
 	mins = (diff.tv_sec % 3600) / 60;
@@ -9514,6 +10857,9 @@ static void clean_up(bool restarting)
 #ifdef HAVE_CURSES
 	disable_curses();
 #endif
+	if (sharelog_running)
+		sharelog_flush(true);
+
 	if (!restarting && !opt_realquiet && successful_connect)
 		print_summary();
 
@@ -9550,6 +10896,8 @@ void __quit(int status, bool clean)
 		disable_curses();
 #endif
 
+	log_async_stop();
+
 #if defined(unix) || defined(__APPLE__)
 	if (forkpid > 0) {
 		kill(forkpid, SIGTERM);
@@ -9928,6 +11276,8 @@ void fill_device_drv(struct device_drv *drv)
 		drv->max_diff = 1;
 	if (!drv->genwork)
 		opt_gen_stratum_work = true;
+	if (drv->midstates > max_midstates)
+		max_midstates = drv->midstates;
 }
 
 void null_device_drv(struct device_drv *drv)
@@ -9980,6 +11330,7 @@ void enable_device(struct cgpu_info *cgpu)
 
 	rwlock_init(&cgpu->qlock);
 	cgpu->queued_work = NULL;
+	cgpu->queued_midstate = NULL;
 }
 
 struct _cgpu_devid_counter {
@@ -10027,6 +11378,7 @@ bool add_cgpu(struct cgpu_info *cgpu)
 	devices = cgrealloc(devices, sizeof(struct cgpu_info *) * (total_devices + new_devices + 2));
 	wr_unlock(&devices_lock);
 
+	mutex_init(&cgpu->share_stats.lock);
 	mutex_lock(&stats_lock);
 	cgpu->last_device_valid_work = time(NULL);
 	mutex_unlock(&stats_lock);
@@ -10213,8 +11565,9 @@ static void *libusb_poll_thread(void __maybe_unused *arg)
 		libusb_handle_events_timeout_completed(NULL, &tv_end, NULL);
 	}
 
-	/* Cancel any cancellable usb transfers */
+	/* Cancel any cancellable usb transfers and stop any read streams */
 	cancel_usb_transfers();
+	stop_usb_streams();
 
 	/* Keep event handling going until there are no async transfers in
 	 * flight. */
@@ -10308,18 +11661,19 @@ int main(int argc, char *argv[])
 	initial_args[argc] = NULL;
 
 	mutex_init(&hash_lock);
+	mutex_init(&work_depot_lock);
 	mutex_init(&console_lock);
 	cglock_init(&control_lock);
 	mutex_init(&stats_lock);
 	mutex_init(&sharelog_lock);
 	cglock_init(&ch_lock);
-	mutex_init(&sshare_lock);
 	rwlock_init(&blk_lock);
 	rwlock_init(&netacc_lock);
 	rwlock_init(&mining_thr_lock);
 	rwlock_init(&devices_lock);
 
 	mutex_init(&lp_lock);
+	mutex_init(&stale_lock);
 	if (unlikely(pthread_cond_init(&lp_cond, NULL)))
 		early_quit(1, "Failed to pthread_cond_init lp_cond");
 
@@ -10336,6 +11690,9 @@ int main(int argc, char *argv[])
 		early_quit(1, "Failed to create getq");
 	/* We use the getq mutex as the staged lock */
 	stgd_lock = &getq->mutex;
+	cgring_init(&staged_works, STAGED_RING_SIZE);
+	cgring_init(&staged_rolls, STAGED_RING_SIZE);
+	mutex_init(&stage_lock);
 
 	initialise_usb();
 
@@ -10385,6 +11742,9 @@ int main(int argc, char *argv[])
 	if (!config_loaded)
 		load_default_config();
 
+	/* --sharelog-binary may have come after --sharelog */
+	sharelog_set_mode();
+
 	if (opt_benchmark || opt_benchfile) {
 		struct pool *pool;
 
@@ -10510,6 +11870,8 @@ int main(int argc, char *argv[])
 		setlogmask(LOG_UPTO(LOG_NOTICE));
 #endif
 
+	applog(LOG_INFO, "Using %s SHA256 implementation", sha256_impl_name());
+
 	total_control_threads = 8;
 	control_thr = cgcalloc(total_control_threads, sizeof(*thr));
 
@@ -10563,6 +11925,12 @@ int main(int argc, char *argv[])
 		openlog(PACKAGE, LOG_PID, LOG_USER);
 #endif
 
+	if (opt_log_async)
+		log_async_start();
+
+	sharelog_init();
+	submit_init();
+
 	#if defined(unix) || defined(__APPLE__)
 		if (opt_stderr_cmd)
 			fork_monitor();
@@ -10578,6 +11946,10 @@ int main(int argc, char *argv[])
 		pool->idle = true;
 	}
 
+#ifdef STRATUM_REACTOR
+	stratum_reactor_init();
+#endif
+
 	/* Look for at least one active pool before starting */
 	applog(LOG_NOTICE, "Probing for an alive pool");
 	probe_pools();
@@ -10782,15 +12154,21 @@ begin_bench:
 			signal_work_update();
 		opt_work_update = false;
 
-		mutex_lock(stgd_lock);
 		ts = __total_staged();
-		/* Wait until hash_pop tells us we need to create more work */
+		/* Wait until hash_pop tells us we need to create more work,
+		 * rechecking once hash_pop can see we're waiting */
 		if (ts > max_staged) {
-			work_filled = true;
-			pthread_cond_wait(&gws_cond, stgd_lock);
+			mutex_lock(stgd_lock);
+			__atomic_store_n(&gws_waiting, true, __ATOMIC_SEQ_CST);
 			ts = __total_staged();
+			if (ts > max_staged) {
+				work_filled = true;
+				pthread_cond_wait(&gws_cond, stgd_lock);
+				ts = __total_staged();
+			}
+			__atomic_store_n(&gws_waiting, false, __ATOMIC_SEQ_CST);
+			mutex_unlock(stgd_lock);
 		}
-		mutex_unlock(stgd_lock);
 
 		if (ts > max_staged) {
 			/* Keeps slowly generating work even if it's not being
@@ -10818,9 +12196,20 @@ begin_bench:
 		};
 		if (pool->has_stratum) {
 			if (opt_gen_stratum_work) {
-				gen_stratum_work(pool, work);
-				applog(LOG_DEBUG, "Generated stratum work");
-				stage_work(work);
+				struct work *works[SHA256_MAX_LANES];
+				int n = MIN(max_staged - ts + 1, SHA256_MAX_LANES);
+
+				/* Fill the shortfall from one pass over the job,
+				 * never staging past max_staged. With the
+				 * default max_queue that is at most two works */
+				works[0] = work;
+				for (i = 1; i < n; i++)
+					works[i] = make_work();
+				gen_stratum_works(pool, works, n);
+				applog(LOG_DEBUG, "Generated %d stratum work", n);
+				for (i = 0; i < n; i++)
+					stage_work(works[i]);
+				work = NULL;
 			}
 			continue;
 		}
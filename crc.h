@@ -19,5 +19,7 @@
 #define _CRC_H_
 
 unsigned short crc16(const unsigned char *buffer, int len);
+unsigned short crc16_false(const unsigned char *buffer, int len);
+unsigned char crc5_bits(const unsigned char *ptr, int bits);
 
 #endif	/* _CRC_H_ */
@@ -43,3 +43,32 @@ unsigned short crc16(const unsigned char *buffer, int len)
 
 	return crc;
 }
+
+/* CRC-16/CCITT-FALSE as used by Bitmain BM13xx job frames */
+unsigned short crc16_false(const unsigned char *buffer, int len)
+{
+	unsigned short crc;
+
+	crc = 0xffff;
+	while(len-- > 0)
+	    crc = crc16_table[((crc >> 8) ^ (*buffer++)) & 0xFF] ^ (crc << 8);
+
+	return crc;
+}
+
+/* The 5 bit CRC of BM13xx command and reply frames over the first bits of
+ * ptr, msb first. Over a whole reply including its CRC it is 0. */
+unsigned char crc5_bits(const unsigned char *ptr, int bits)
+{
+	unsigned char crc = 0x1f, fb;
+	int i;
+
+	for (i = 0; i < bits; i++) {
+		fb = ((crc >> 4) ^ (ptr[i >> 3] >> (7 - (i & 7)))) & 1;
+		crc = (crc << 1) & 0x1f;
+		if (fb)
+			crc ^= 0x05;
+	}
+
+	return crc;
+}
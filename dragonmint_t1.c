@@ -890,10 +890,16 @@ uint8_t *create_job(uint8_t chip_id, uint8_t job_id, struct work *work)
 	job[0] = (job_id << 4) | CMD_WRITE_JOB_T1;		// fixed by duanhao
 	job[1] = chip_id;
 
-	swab256(job + 2, work->midstate3);
-	swab256(job + 34, work->midstate2);
-	swab256(job + 66, work->midstate1);
+	/* Midstates go last first, zeroed when the pool does not roll */
 	swab256(job + 98, work->midstate);
+	for (i = 1; i < T1_MIDSTATES; i++) {
+		uint8_t *ms = job + 98 - i * 32;
+
+		if (work->vmidstates && i < work->vmidstates->count)
+			swab256(ms, work->vmidstates->ms[i].midstate);
+		else
+			memset(ms, 0, 32);
+	}
 	p1 = (uint32_t *) &job[130];
 	p2 = (uint32_t *) (work->data + 64);
 	p1[0] = bswap_32(p2[0]);
@@ -19,6 +19,8 @@
 #define CMD_TYPE_T1						(0x0)
 
 #define JOB_LENGTH						(162)
+/* Each job carries four version rolled midstates */
+#define T1_MIDSTATES						(4)
 #define NONCE_LEN						(6)
 
 #define T1_PLL_LV_NUM                  	(324)
@@ -243,32 +243,76 @@ static uint8_t *cmd_READ_REG(struct A1_chain *a1, uint8_t chip)
 	return ret;
 }
 
-static uint8_t *cmd_WRITE_JOB(struct A1_chain *a1, uint8_t chip_id,
-			      uint8_t *job)
+/********** batched A1 SPI commands */
+/*
+ * Commands to different chips do not depend on each other, so the register
+ * reads for all chips and then the jobs for all chips needing work are each
+ * queued into one batch and pushed with a single SPI_IOC_MESSAGE. Every chip
+ * gets its own TX/RX buffers and, as with exec_cmd(), the command and its
+ * poll are separate transfers with chip select toggled in between.
+ */
+static void batch_cmd(struct A1_chain *a1, uint8_t chip_id,
+		      int tx_len, int resp_len)
 {
-	/* ensure we push the SPI command to the last chip in chain */
-	int tx_len = WRITE_JOB_LENGTH + 2;
-	memcpy(a1->spi_tx, job, WRITE_JOB_LENGTH);
-	memset(a1->spi_tx + WRITE_JOB_LENGTH, 0, tx_len - WRITE_JOB_LENGTH);
+	uint8_t *tx = a1->batch_tx[chip_id - 1];
+	uint8_t *rx = a1->batch_rx[chip_id - 1];
+	uint16_t delay = a1->spi_ctx->config.delay;
+	int poll_len = resp_len + 4 * chip_id - 2;
 
-	assert(spi_transfer(a1->spi_ctx, a1->spi_tx, a1->spi_rx, tx_len));
-	hexdump("send: TX", a1->spi_tx, tx_len);
-	hexdump("send: RX", a1->spi_rx, tx_len);
+	spi_batch_add(&a1->batch, tx, rx, tx_len, true, delay);
+	spi_batch_add(&a1->batch, NULL, rx + tx_len, poll_len, true, delay);
+}
 
-	int poll_len = 4 * chip_id - 2;
+/* where the ACK of a batched command to given chip ends up */
+static uint8_t *batch_resp(struct A1_chain *a1, uint8_t chip_id)
+{
+	return a1->batch_rx[chip_id - 1] + 4 * chip_id - 2;
+}
 
-	assert(spi_transfer(a1->spi_ctx, NULL, a1->spi_rx + tx_len, poll_len));
-	hexdump("poll: RX", a1->spi_rx + tx_len, poll_len);
+static void batch_READ_REG(struct A1_chain *a1, uint8_t chip_id)
+{
+	uint8_t *tx = a1->batch_tx[chip_id - 1];
 
-	int ack_len = tx_len;
-	int ack_pos = tx_len + poll_len - ack_len;
-	hexdump("poll: ACK", a1->spi_rx + ack_pos, tx_len);
+	memset(tx, 0, 4);
+	tx[0] = A1_READ_REG;
+	tx[1] = chip_id;
+	batch_cmd(a1, chip_id, 4, 6);
+}
+
+static uint8_t *batch_READ_REG_resp(struct A1_chain *a1, uint8_t chip_id)
+{
+	uint8_t *ret = batch_resp(a1, chip_id);
+
+	hexdump("batch: READ_REG", ret, 8);
+	if (ret[0] != A1_READ_REG_RESP || ret[1] != chip_id) {
+		applog(LOG_ERR, "%d: cmd_READ_REG chip %d failed",
+		       a1->chain_id, chip_id);
+		return NULL;
+	}
+	return ret;
+}
 
-	uint8_t *ret = a1->spi_rx + ack_pos;
-	if (ret[0] != a1->spi_tx[0] || ret[1] != a1->spi_tx[1]){
+static void batch_WRITE_JOB(struct A1_chain *a1, uint8_t chip_id,
+			    uint8_t *job)
+{
+	uint8_t *tx = a1->batch_tx[chip_id - 1];
+
+	/* ensure we push the SPI command to the last chip in chain */
+	memcpy(tx, job, WRITE_JOB_LENGTH);
+	memset(tx + WRITE_JOB_LENGTH, 0, 2);
+	batch_cmd(a1, chip_id, WRITE_JOB_LENGTH + 2, 0);
+}
+
+static uint8_t *batch_WRITE_JOB_resp(struct A1_chain *a1, uint8_t chip_id)
+{
+	uint8_t *tx = a1->batch_tx[chip_id - 1];
+	uint8_t *ret = batch_resp(a1, chip_id);
+
+	hexdump("batch: WRITE_JOB ACK", ret, WRITE_JOB_LENGTH + 2);
+	if (ret[0] != tx[0] || ret[1] != tx[1]) {
 		applog(LOG_ERR, "%d: cmd_WRITE_JOB failed: "
 			"0x%02x%02x/0x%02x%02x", a1->chain_id,
-			ret[0], ret[1], a1->spi_tx[0], a1->spi_tx[1]);
+			ret[0], ret[1], tx[0], tx[1]);
 		return NULL;
 	}
 	return ret;
@@ -592,7 +636,10 @@ static uint8_t *create_job(uint8_t chip_id, uint8_t job_id, struct work *work)
 	return job;
 }
 
-/* set work for given chip, returns true if a nonce range was finished */
+/*
+ * queue work for given chip in the job batch, returns true if a nonce range
+ * was finished; check_work() must be called once the batch is submitted
+ */
 static bool set_work(struct A1_chain *a1, uint8_t chip_id, struct work *work,
 		     uint8_t queue_states)
 {
@@ -614,21 +661,33 @@ static bool set_work(struct A1_chain *a1, uint8_t chip_id, struct work *work,
 		retval = true;
 	}
 	uint8_t *jobdata = create_job(chip_id, job_id, work);
-	if (!cmd_WRITE_JOB(a1, chip_id, jobdata)) {
-		/* give back work */
-		work_completed(a1->cgpu, work);
-
-		applog(LOG_ERR, "%d: failed to set work for chip %d.%d",
-		       cid, chip_id, job_id);
-		disable_chip(a1, chip_id);
-	} else {
-		chip->work[chip->last_queued_id] = work;
-		chip->last_queued_id++;
-		chip->last_queued_id &= 3;
-	}
+	batch_WRITE_JOB(a1, chip_id, jobdata);
+	chip->work[chip->last_queued_id] = work;
+	chip->last_queued_id++;
+	chip->last_queued_id &= 3;
+	chip->job_queued = true;
 	return retval;
 }
 
+/* check the ACK of a job queued by set_work(), give back work on failure */
+static void check_work(struct A1_chain *a1, uint8_t chip_id)
+{
+	struct A1_chip *chip = &a1->chips[chip_id - 1];
+
+	chip->job_queued = false;
+	if (batch_WRITE_JOB_resp(a1, chip_id) != NULL)
+		return;
+
+	chip->last_queued_id = (chip->last_queued_id - 1) & 3;
+	/* give back work */
+	work_completed(a1->cgpu, chip->work[chip->last_queued_id]);
+	chip->work[chip->last_queued_id] = NULL;
+
+	applog(LOG_ERR, "%d: failed to set work for chip %d.%d",
+	       a1->chain_id, chip_id, chip->last_queued_id + 1);
+	disable_chip(a1, chip_id);
+}
+
 static bool get_nonce(struct A1_chain *a1, uint8_t *nonce,
 		      uint8_t *chip, uint8_t *job_id)
 {
@@ -659,6 +718,8 @@ void exit_A1_chain(struct A1_chain *a1)
 		return;
 	free(a1->chips);
 	a1->chips = NULL;
+	free(a1->batch_tx);
+	free(a1->batch_rx);
 	a1->spi_ctx = NULL;
 	free(a1);
 }
@@ -697,6 +758,10 @@ struct A1_chain *init_A1_chain(struct spi_ctx *ctx, int chain_id)
 
 	a1->chips = calloc(a1->num_active_chips, sizeof(struct A1_chip));
 	assert (a1->chips != NULL);
+	a1->batch_tx = calloc(a1->num_active_chips, MAX_CMD_LENGTH);
+	a1->batch_rx = calloc(a1->num_active_chips, MAX_CMD_LENGTH);
+	assert(a1->batch_tx != NULL && a1->batch_rx != NULL);
+	spi_batch_init(&a1->batch, a1->spi_ctx);
 
 	if (!cmd_BIST_FIX_BCAST(a1))
 		goto failure;
@@ -974,16 +1039,23 @@ static int64_t A1_scanwork(struct thr_info *thr)
 	}
 
 	/* check for completed works */
+	for (i = a1->num_active_chips; i > 0; i--) {
+		if (!is_chip_disabled(a1, i))
+			batch_READ_REG(a1, i);
+	}
+	if (!spi_batch_submit(&a1->batch))
+		applog(LOG_ERR, "%d: batched READ_REG failed", cid);
 	for (i = a1->num_active_chips; i > 0; i--) {
 		uint8_t c = i;
 		if (is_chip_disabled(a1, c))
 			continue;
-		if (!cmd_READ_REG(a1, c)) {
+		uint8_t *reg = batch_READ_REG_resp(a1, c);
+		if (reg == NULL) {
 			disable_chip(a1, c);
 			continue;
 		}
-		uint8_t qstate = a1->spi_rx[5] & 3;
-		uint8_t qbuff = a1->spi_rx[6];
+		uint8_t qstate = reg[5] & 3;
+		uint8_t qbuff = reg[6];
 		struct work *work;
 		struct A1_chip *chip = &a1->chips[i - 1];
 		switch(qstate) {
@@ -1015,6 +1087,12 @@ static int64_t A1_scanwork(struct thr_info *thr)
 			break;
 		}
 	}
+	if (!spi_batch_submit(&a1->batch))
+		applog(LOG_ERR, "%d: batched WRITE_JOB failed", cid);
+	for (i = a1->num_active_chips; i > 0; i--) {
+		if (a1->chips[i - 1].job_queued)
+			check_work(a1, i);
+	}
 	check_disabled_chips(a1);
 	mutex_unlock(&a1->lock);
 
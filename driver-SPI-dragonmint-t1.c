@@ -1230,8 +1230,13 @@ static int64_t T1_scanwork(struct thr_info *thr)
 			chip->stales++;
 			continue;
 		}
+		/* micro_job_id has one bit set for the midstate that hit */
 		work->micro_job_id = micro_job_id;
-		memcpy(work->data, &(work->pool->vmask_001[micro_job_id]), 4);
+		i = ffs(micro_job_id) - 1;
+		if (i > 0 && work->vmidstates && i < work->vmidstates->count)
+			memcpy(work->data, &work->vmidstates->ms[i].version, 4);
+		else
+			memcpy(work->data, &work->midstate_ver, 4);
 
 		if (!submit_nonce(thr, work, nonce)) {
 			applog(LOG_INFO, "%d: chip %d: invalid nonce 0x%08x", cid, chip_id, nonce);
@@ -1529,6 +1534,7 @@ struct device_drv dragonmintT1_drv = {
 	.drv_detect = T1_detect,
 	/* Set to lowest diff we can reliably use to get accurate hashrates. */
 	.max_diff = 129,
+	.midstates = T1_MIDSTATES,
 
 	.hash_work = hash_driver_work,
 	.scanwork = T1_scanwork,
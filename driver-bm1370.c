@@ -1,26 +1,803 @@
+/*
+ * Driver for chains of BM1370 ASICs on a UART, as found on the Bitaxe Gamma
+ * and similar boards. The protocol follows the ESP-Miner implementation.
+ *
+ * A TX thread sends a fresh job to the chain every job interval, or at once
+ * on a work restart, keeping the chip's job slots full. An RX thread splits
+ * the reply stream into frames and maps each nonce back to its work through
+ * the 16 entry job ring indexed by the chip's job id. The chip only returns
+ * nonces that meet its ticket mask, which is set to the largest power of 2
+ * not above the device difficulty of the last work sent, and each nonce is
+ * credited at the ticket in effect when it arrives.
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 3 of the License, or (at your option)
+ * any later version.  See COPYING for more details.
+ */
+
 #include "config.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <termios.h>
+#include <unistd.h>
+#include <sys/select.h>
+
+#include "compat.h"
 #include "miner.h"
 #include "logging.h"
+#include "crc.h"
 #include "driver-bm1370.h"
 
-/*
- * Stub driver for BM1370 ASIC based on ESP-Miner reference implementation.
- * This only implements minimal hooks required by cgminer and does not
- * support real hardware interaction. It serves as a placeholder for future
- * development.
- */
+static bool bm1370_write(struct bm1370_info *info, const uint8_t *buf, int len)
+{
+	int ret;
+
+	while (len > 0) {
+		ret = write(info->fd, buf, len);
+		if (ret < 0) {
+			if (errno == EINTR || errno == EAGAIN)
+				continue;
+			applog(LOG_ERR, "BM1370 %s: write failed: %s",
+			       info->device, strerror(errno));
+			return false;
+		}
+		buf += ret;
+		len -= ret;
+	}
+	return true;
+}
+
+/* Frame data with the preamble, header and length, and append a CRC16 to
+ * jobs or a CRC5 to commands, both over the header onward */
+static bool bm1370_send(struct bm1370_info *info, uint8_t header,
+			const uint8_t *data, int datalen)
+{
+	uint8_t buf[BM1370_JOB_LEN + 6];
+	int len = 0;
+
+	buf[len++] = BM1370_PREAMBLE_TX0;
+	buf[len++] = BM1370_PREAMBLE_TX1;
+	buf[len++] = header;
+	if (header & BM1370_TYPE_JOB) {
+		unsigned short crc;
+
+		buf[len++] = datalen + 4;
+		memcpy(buf + len, data, datalen);
+		len += datalen;
+		crc = crc16_false(buf + 2, datalen + 2);
+		buf[len++] = crc >> 8;
+		buf[len++] = crc & 0xff;
+	} else {
+		buf[len++] = datalen + 3;
+		memcpy(buf + len, data, datalen);
+		len += datalen;
+		buf[len] = crc5_bits(buf + 2, (datalen + 2) * 8);
+		len++;
+	}
+	return bm1370_write(info, buf, len);
+}
+
+static bool bm1370_write_reg(struct bm1370_info *info, bool all, uint8_t addr,
+			     uint8_t reg, uint32_t val)
+{
+	uint8_t header = BM1370_TYPE_CMD | BM1370_CMD_WRITE;
+	uint8_t data[6];
+
+	if (all)
+		header |= BM1370_GROUP_ALL;
+	data[0] = addr;
+	data[1] = reg;
+	data[2] = val >> 24;
+	data[3] = val >> 16;
+	data[4] = val >> 8;
+	data[5] = val;
+	return bm1370_send(info, header, data, sizeof(data));
+}
+
+static bool bm1370_cmd(struct bm1370_info *info, uint8_t header, uint8_t addr, uint8_t reg)
+{
+	uint8_t data[2] = { addr, reg };
+
+	return bm1370_send(info, BM1370_TYPE_CMD | header, data, sizeof(data));
+}
+
+/* Returns the bytes read, 0 on timeout or -1 on error */
+static int bm1370_read(struct bm1370_info *info, uint8_t *buf, int len, int ms)
+{
+	struct timeval tv;
+	fd_set rfds;
+	int ret;
+
+	FD_ZERO(&rfds);
+	FD_SET(info->fd, &rfds);
+	tv.tv_sec = ms / 1000;
+	tv.tv_usec = (ms % 1000) * 1000;
+	ret = select(info->fd + 1, &rfds, NULL, NULL, &tv);
+	if (ret <= 0)
+		return (ret < 0 && errno != EINTR) ? -1 : 0;
+	ret = read(info->fd, buf, len);
+	if (ret < 0)
+		return (errno == EINTR || errno == EAGAIN) ? 0 : -1;
+	/* Readable with nothing to read means the port has hung up */
+	if (!ret) {
+		errno = EIO;
+		return -1;
+	}
+	return ret;
+}
+
+static bool bm1370_set_baud(struct bm1370_info *info, speed_t speed)
+{
+	struct termios tio;
+
+	if (tcgetattr(info->fd, &tio) < 0)
+		return false;
+	cfmakeraw(&tio);
+	tio.c_cflag &= ~(CSTOPB | PARENB | CRTSCTS);
+	tio.c_cflag |= CLOCAL | CREAD;
+	tio.c_cc[VMIN] = 0;
+	tio.c_cc[VTIME] = 0;
+	cfsetispeed(&tio, speed);
+	cfsetospeed(&tio, speed);
+	if (tcsetattr(info->fd, TCSANOW, &tio) < 0)
+		return false;
+	tcflush(info->fd, TCIOFLUSH);
+	return true;
+}
+
+static uint8_t reverse_bits(uint8_t b)
+{
+	b = (b & 0xf0) >> 4 | (b & 0x0f) << 4;
+	b = (b & 0xcc) >> 2 | (b & 0x33) << 2;
+	b = (b & 0xaa) >> 1 | (b & 0x55) << 1;
+	return b;
+}
+
+/* The ticket mask is diff - 1 with each byte bit reversed */
+static bool bm1370_set_ticket(struct bm1370_info *info, int ticket)
+{
+	uint32_t mask = ticket - 1, val = 0;
+	int i;
+
+	for (i = 0; i < 4; i++)
+		val |= (uint32_t)reverse_bits(mask >> (i * 8)) << (i * 8);
+	return bm1370_write_reg(info, true, 0, BM1370_REG_TICKET_MASK, val);
+}
+
+static bool bm1370_set_vmask(struct bm1370_info *info, uint32_t vmask)
+{
+	return bm1370_write_reg(info, true, 0, BM1370_REG_VERSION_MASK,
+				0x90000000 | ((vmask >> 13) & 0xffff));
+}
+
+/* Search the PLL dividers for the closest match to freq within 1MHz */
+static bool bm1370_send_freq(struct bm1370_info *info, double freq)
+{
+	int fb, ref, pd1, pd2, best_fb = 0, best_ref = 0, best_pd1 = 0, best_pd2 = 0;
+	double best = 1.0;
+	uint32_t val;
+
+	for (ref = 2; ref > 0; ref--) {
+		for (pd1 = 7; pd1 > 0; pd1--) {
+			for (pd2 = pd1; pd2 > 0; pd2--) {
+				double actual, diff;
+
+				fb = (int)(pd1 * pd2 * freq * ref / 25.0 + 0.5);
+				if (fb < 0xa0 || fb > 0xef)
+					continue;
+				actual = 25.0 * fb / (ref * pd1 * pd2);
+				diff = actual > freq ? actual - freq : freq - actual;
+				if (diff < best) {
+					best = diff;
+					best_fb = fb;
+					best_ref = ref;
+					best_pd1 = pd1;
+					best_pd2 = pd2;
+				}
+			}
+		}
+	}
+	if (!best_fb) {
+		applog(LOG_ERR, "BM1370 %s: no PLL settings for %.2fMHz",
+		       info->device, freq);
+		return false;
+	}
+	val = (best_fb * 25 / best_ref >= 2400) ? 0x50 : 0x40;
+	val = (val << 24) | (best_fb << 16) | (best_ref << 8) |
+	      ((best_pd1 - 1) << 4) | (best_pd2 - 1);
+	return bm1370_write_reg(info, true, 0, BM1370_REG_PLL0, val);
+}
+
+/* The chips start at 56.25MHz and must be stepped up gradually */
+static bool bm1370_ramp_freq(struct bm1370_info *info, int freq)
+{
+	double f;
+
+	for (f = BM1370_FREQ_START + BM1370_FREQ_STEP; f < freq; f += BM1370_FREQ_STEP) {
+		if (!bm1370_send_freq(info, f))
+			return false;
+		cgsleep_ms(BM1370_RAMP_mS);
+	}
+	return bm1370_send_freq(info, freq);
+}
+
+/* Read chip id replies until none arrive for BM1370_DETECT_mS */
+static int bm1370_count_chips(struct bm1370_info *info)
+{
+	uint8_t buf[BM1370_REPLY_LEN * 8];
+	int len = 0, ret, chips = 0;
+
+	while (42) {
+		ret = bm1370_read(info, buf + len, sizeof(buf) - len, BM1370_DETECT_mS);
+		if (ret <= 0)
+			break;
+		len += ret;
+		while (len >= BM1370_REPLY_LEN) {
+			if (buf[0] == BM1370_PREAMBLE_RX0 && buf[1] == BM1370_PREAMBLE_RX1 &&
+			    !crc5_bits(buf + 2, (BM1370_REPLY_LEN - 2) * 8) &&
+			    ((buf[2] << 8) | buf[3]) == BM1370_CHIP_ID) {
+				applog(LOG_DEBUG, "BM1370 %s: chip %d cores 0x%02x addr 0x%02x",
+				       info->device, chips, buf[4], buf[5]);
+				if (chips < BM1370_MAX_CHIPS)
+					chips++;
+				len -= BM1370_REPLY_LEN;
+				memmove(buf, buf + BM1370_REPLY_LEN, len);
+			} else
+				memmove(buf, buf + 1, --len);
+		}
+	}
+	return chips;
+}
+
+static bool bm1370_init_chips(struct bm1370_info *info)
+{
+	uint8_t addr, interval;
+	int i;
+
+	if (!bm1370_set_baud(info, BM1370_BAUD_INIT))
+		return false;
+
+	for (i = 0; i < 3; i++)
+		bm1370_set_vmask(info, BM1370_VMASK_DEF);
+	bm1370_cmd(info, BM1370_GROUP_ALL | BM1370_CMD_READ, 0, BM1370_REG_CHIP_ID);
+	info->chips = bm1370_count_chips(info);
+	if (!info->chips)
+		return false;
+
+	bm1370_set_vmask(info, BM1370_VMASK_DEF);
+	bm1370_write_reg(info, true, 0, BM1370_REG_A8, 0x00070000);
+	bm1370_write_reg(info, true, 0, BM1370_REG_MISC_CONTROL, 0xf000c100);
+	bm1370_cmd(info, BM1370_GROUP_ALL | BM1370_CMD_INACTIVE, 0, 0);
+
+	/* Spread the chip addresses evenly over the address space */
+	interval = 256 / info->chips;
+	for (i = 0; i < info->chips; i++)
+		bm1370_cmd(info, BM1370_GROUP_SINGLE | BM1370_CMD_SETADDRESS, i * interval, 0);
+
+	bm1370_write_reg(info, true, 0, BM1370_REG_CORE_CONTROL, 0x80008b00);
+	bm1370_write_reg(info, true, 0, BM1370_REG_CORE_CONTROL, 0x8000800c);
+	info->ticket = BM1370_DIFF_DEF;
+	bm1370_set_ticket(info, info->ticket);
+	bm1370_write_reg(info, true, 0, BM1370_REG_IO_STRENGTH, 0x00011111);
+
+	for (i = 0; i < info->chips; i++) {
+		addr = i * interval;
+		bm1370_write_reg(info, false, addr, BM1370_REG_A8, 0x000701f0);
+		bm1370_write_reg(info, false, addr, BM1370_REG_MISC_CONTROL, 0xf000c100);
+		bm1370_write_reg(info, false, addr, BM1370_REG_CORE_CONTROL, 0x80008b00);
+		bm1370_write_reg(info, false, addr, BM1370_REG_CORE_CONTROL, 0x8000800c);
+		bm1370_write_reg(info, false, addr, BM1370_REG_CORE_CONTROL, 0x800082aa);
+	}
+
+	bm1370_write_reg(info, true, 0, BM1370_REG_B9, 0x00004480);
+	bm1370_write_reg(info, true, 0, BM1370_REG_ANALOG_MUX, 0x00000002);
+	bm1370_write_reg(info, true, 0, BM1370_REG_B9, 0x00004480);
+	bm1370_write_reg(info, true, 0, BM1370_REG_CORE_CONTROL, 0x80008dee);
+
+	if (!bm1370_ramp_freq(info, info->freq))
+		return false;
+	bm1370_write_reg(info, true, 0, BM1370_REG_HASH_COUNT, 0x00001eb5);
+
+	/* Switch the chain and then ourselves to 1M baud */
+	bm1370_write_reg(info, true, 0, BM1370_REG_FAST_UART, 0x11300200);
+	tcdrain(info->fd);
+	cgsleep_ms(10);
+	if (!bm1370_set_baud(info, BM1370_BAUD_FAST))
+		return false;
+
+	info->vmask = BM1370_VMASK_DEF;
+	return true;
+}
+
+/* How long the chain takes to run out of nonces with vmask's version bits,
+ * capped at the interval ESP-Miner uses */
+static int bm1370_job_ms(struct bm1370_info *info, uint32_t vmask)
+{
+	double ms = 4294967296.0 * 1000.0 / info->hashrate;
+	int i;
+
+	for (i = 0; i < 32; i++) {
+		if (vmask & (1U << i))
+			ms *= 2;
+		if (ms >= BM1370_JOB_mS)
+			return BM1370_JOB_mS;
+	}
+	if (ms < BM1370_JOB_mS_MIN)
+		return BM1370_JOB_mS_MIN;
+	return ms;
+}
+
+static void bm1370_detect_one(const char *device)
+{
+	struct cgpu_info *cgpu;
+	struct bm1370_info *info;
+
+	info = cgcalloc(1, sizeof(*info));
+	info->device = strdup(device);
+	info->freq = opt_bm1370_freq;
+	info->fd = open(device, O_RDWR | O_NOCTTY);
+	if (info->fd < 0) {
+		applog(LOG_INFO, "BM1370 %s: open failed: %s", device, strerror(errno));
+		goto out_free;
+	}
+
+	if (!bm1370_init_chips(info)) {
+		applog(LOG_INFO, "BM1370 %s: no chips found", device);
+		goto out_close;
+	}
+	info->hashrate = (double)info->freq * 1000000 * BM1370_SMALL_CORES * info->chips;
+	info->job_ms = bm1370_job_ms(info, info->vmask);
+
+	cgpu = cgcalloc(1, sizeof(*cgpu));
+	cgpu->drv = &bm1370_drv;
+	cgpu->device_path = info->device;
+	cgpu->device_data = info;
+	cgpu->deven = DEV_ENABLED;
+	cgpu->threads = 1;
+
+	mutex_init(&info->lock);
+	cgsem_init(&info->tx_sem);
+	cgsem_init(&info->scan_sem);
+
+	if (!add_cgpu(cgpu)) {
+		free(cgpu);
+		goto out_close;
+	}
+
+	applog(LOG_WARNING, "%s%d: %d chip%s on %s at %dMHz",
+	       cgpu->drv->name, cgpu->device_id, info->chips,
+	       info->chips == 1 ? "" : "s", device, info->freq);
+	return;
+
+out_close:
+	close(info->fd);
+out_free:
+	free(info->device);
+	free(info);
+}
+
+static void bm1370_detect(bool hotplug)
+{
+	char *devs, *dev, *save = NULL;
+	int diff;
+
+	if (hotplug)
+		return;
+
+	/* Let the work difficulty follow the pool up to the ticket limit */
+	diff = opt_bm1370_diff;
+	while (diff & (diff - 1))
+		diff &= diff - 1;
+	bm1370_drv.max_diff = diff;
+
+	devs = strdup(opt_bm1370_dev ? opt_bm1370_dev : BM1370_DEV_DEF);
+	if (unlikely(!devs))
+		quithere(1, "Failed to strdup devs");
+	for (dev = strtok_r(devs, ",", &save); dev; dev = strtok_r(NULL, ",", &save))
+		bm1370_detect_one(dev);
+	free(devs);
+}
+
+static void bm1370_build_job(uint8_t *job, uint8_t job_id, struct work *work)
+{
+	unsigned char hdr[80];
+	int i;
+
+	flip80(hdr, work->data);
+	job[0] = job_id;
+	job[1] = 1;
+	memset(job + 2, 0, 4);
+	memcpy(job + 6, hdr + 72, 4);
+	memcpy(job + 10, hdr + 68, 4);
+	/* Merkle root and previous hash go in reversed word order, which
+	 * is the reverse of the byte swapped words in work->data */
+	for (i = 0; i < 32; i++) {
+		job[14 + i] = work->data[67 - i];
+		job[46 + i] = work->data[35 - i];
+	}
+	memcpy(job + 78, hdr, 4);
+}
+
+static void bm1370_send_job(struct cgpu_info *cgpu, struct bm1370_info *info,
+			    struct work *work, uint32_t flush_gen)
+{
+	struct pool *pool = work->pool;
+	uint8_t job[BM1370_JOB_LEN];
+	struct work *old;
+	uint32_t vmask = 0;
+	int ticket, slot;
+
+	if (pool->vmask)
+		vmask = pool->vmask_bits & BM1370_VMASK_BITS;
+	if (vmask != info->vmask) {
+		bm1370_set_vmask(info, vmask);
+		info->vmask = vmask;
+		info->job_ms = bm1370_job_ms(info, vmask);
+	}
+
+	/* device_diff is already capped at max_diff, which is a power of 2 */
+	for (ticket = 1; ticket * 2 <= work->device_diff; ticket *= 2)
+		;
+	if (ticket != info->ticket) {
+		bm1370_set_ticket(info, ticket);
+		mutex_lock(&info->lock);
+		info->ticket = ticket;
+		mutex_unlock(&info->lock);
+	}
+	work->device_diff = ticket;
+
+	info->job_id = (info->job_id + BM1370_JOB_ID_STEP) % BM1370_JOB_ID_MAX;
+	slot = info->job_id / 8;
+	bm1370_build_job(job, info->job_id, work);
+
+	/* Place the work in the ring before sending so no reply can beat it,
+	 * unless a flush has cleared the ring since the work was taken */
+	mutex_lock(&info->lock);
+	if (unlikely(info->flush_gen != flush_gen)) {
+		mutex_unlock(&info->lock);
+		work_completed(cgpu, work);
+		return;
+	}
+	old = info->jobs[slot].work;
+	info->jobs[slot].work = work;
+	info->jobs[slot].vmask = vmask;
+	info->jobs_sent++;
+	mutex_unlock(&info->lock);
+
+	if (old)
+		work_completed(cgpu, old);
+
+	bm1370_send(info, BM1370_TYPE_JOB | BM1370_GROUP_SINGLE | BM1370_CMD_WRITE,
+		    job, sizeof(job));
+}
+
+static void *bm1370_tx(void *userdata)
+{
+	struct cgpu_info *cgpu = (struct cgpu_info *)userdata;
+	struct bm1370_info *info = (struct bm1370_info *)cgpu->device_data;
+	char threadname[16];
+	uint32_t flush_gen;
+	struct work *work;
+
+	snprintf(threadname, sizeof(threadname), "%s%dTX", cgpu->drv->name, cgpu->device_id);
+	RenameThread(threadname);
+
+	while (likely(!cgpu->shutdown)) {
+		mutex_lock(&info->lock);
+		work = info->next;
+		info->next = NULL;
+		info->starved = !work;
+		flush_gen = info->flush_gen;
+		mutex_unlock(&info->lock);
+
+		if (work) {
+			bm1370_send_job(cgpu, info, work, flush_gen);
+			/* Let the hash thread refill info->next */
+			cgsem_post(&info->scan_sem);
+		}
+		/* queue_full or flush_work post tx_sem when a job is wanted early */
+		cgsem_mswait(&info->tx_sem, info->job_ms);
+	}
+	return NULL;
+}
+
+/* Hand the nonces from one read over in groups sharing a job and rolled
+ * version, so each group is hashed together by submit_nonces() */
+static void bm1370_results(struct cgpu_info *cgpu, struct bm1370_info *info,
+			   uint8_t **frames, int count)
+{
+	uint32_t nonces[BM1370_RXBUF / BM1370_REPLY_LEN], version = 0, vbits;
+	struct work *work;
+	int i, j, n, slot, valid;
+
+	for (i = 0; i < count; i++) {
+		if (!frames[i])
+			continue;
+		slot = (frames[i][7] & 0xf0) >> 4;
+		for (n = 0, j = i; j < count; j++) {
+			uint8_t *frame = frames[j];
+
+			if (!frame || (frame[7] & 0xf0) >> 4 != slot ||
+			    frame[8] != frames[i][8] || frame[9] != frames[i][9])
+				continue;
+			nonces[n++] = (uint32_t)frame[2] << 24 | frame[3] << 16 |
+				      frame[4] << 8 | frame[5];
+			if (j != i)
+				frames[j] = NULL;
+		}
+		vbits = (uint32_t)(frames[i][8] << 8 | frames[i][9]) << 13;
+
+		/* The ticket mask is chip wide, so jobs still running from
+		 * before it last changed return nonces at the new ticket, not
+		 * the one they were sent with */
+		work = NULL;
+		mutex_lock(&info->lock);
+		if (info->jobs[slot].work) {
+			work = copy_work(info->jobs[slot].work);
+			work->device_diff = info->ticket;
+			vbits &= info->jobs[slot].vmask;
+			version = be32toh(*(uint32_t *)work->data);
+			version = (version & ~info->jobs[slot].vmask) | vbits;
+			*(uint32_t *)work->data = htobe32(version);
+		} else
+			info->stale_nonces += n;
+		mutex_unlock(&info->lock);
+
+		if (!work) {
+			applog(LOG_DEBUG, "%s%d: %d nonces for flushed job %d",
+			       cgpu->drv->name, cgpu->device_id, n, slot);
+			continue;
+		}
+		applog(LOG_DEBUG, "%s%d: %d nonces job %d version %08x",
+		       cgpu->drv->name, cgpu->device_id, n, slot, version);
+
+		valid = submit_nonces(info->thr, work, nonces, n);
+		mutex_lock(&info->lock);
+		info->nonces += valid;
+		info->bad_nonces += n - valid;
+		info->hashes += 0xffffffffull * work->device_diff * valid;
+		mutex_unlock(&info->lock);
+		free_work(work);
+	}
+}
+
+/* Split the reply stream into frames, resynchronising on the preamble after
+ * any CRC failure. Returns how many bytes are left over for next time. */
+static int bm1370_parse(struct cgpu_info *cgpu, struct bm1370_info *info,
+			uint8_t *buf, int len)
+{
+	uint8_t *results[BM1370_RXBUF / BM1370_REPLY_LEN];
+	uint64_t skipped = 0, crc_errors = 0, regs = 0;
+	int off = 0, count = 0;
+
+	while (len - off >= BM1370_REPLY_LEN) {
+		uint8_t *frame = buf + off;
+
+		if (frame[0] != BM1370_PREAMBLE_RX0 || frame[1] != BM1370_PREAMBLE_RX1) {
+			skipped++;
+			off++;
+			continue;
+		}
+		if (crc5_bits(frame + 2, (BM1370_REPLY_LEN - 2) * 8)) {
+			crc_errors++;
+			off++;
+			continue;
+		}
+		if (frame[10] & BM1370_REPLY_JOB)
+			results[count++] = frame;
+		else
+			regs++;
+		off += BM1370_REPLY_LEN;
+	}
+	if (count)
+		bm1370_results(cgpu, info, results, count);
+	if (skipped || crc_errors || regs) {
+		mutex_lock(&info->lock);
+		info->sync_bytes += skipped;
+		info->crc_errors += crc_errors;
+		info->reg_replies += regs;
+		mutex_unlock(&info->lock);
+	}
+	len -= off;
+	memmove(buf, buf + off, len);
+	return len;
+}
+
+static void *bm1370_rx(void *userdata)
+{
+	struct cgpu_info *cgpu = (struct cgpu_info *)userdata;
+	struct bm1370_info *info = (struct bm1370_info *)cgpu->device_data;
+	uint8_t buf[BM1370_RXBUF];
+	int len = 0, ret, fails = 0;
+	char threadname[16];
+
+	snprintf(threadname, sizeof(threadname), "%s%dRX", cgpu->drv->name, cgpu->device_id);
+	RenameThread(threadname);
+
+	while (likely(!cgpu->shutdown)) {
+		ret = bm1370_read(info, buf + len, sizeof(buf) - len, BM1370_READ_mS);
+		if (ret < 0) {
+			/* Only the first failure in a row is worth reporting, and
+			 * a port that keeps failing has most likely gone */
+			if (!fails++)
+				applog(LOG_ERR, "%s%d: read failed: %s",
+				       cgpu->drv->name, cgpu->device_id, strerror(errno));
+			if (fails >= BM1370_READ_FAILS) {
+				applog(LOG_ERR, "%s%d: %d reads failed in a row, shutting down",
+				       cgpu->drv->name, cgpu->device_id, fails);
+				cgpu->status = LIFE_DEAD;
+				cgpu->shutdown = true;
+				break;
+			}
+			cgsleep_ms(BM1370_READ_mS);
+			continue;
+		}
+		fails = 0;
+		if (ret)
+			len = bm1370_parse(cgpu, info, buf, len + ret);
+	}
+	return NULL;
+}
+
+static bool bm1370_thread_prepare(struct thr_info *thr)
+{
+	struct cgpu_info *cgpu = thr->cgpu;
+	struct bm1370_info *info = (struct bm1370_info *)cgpu->device_data;
+
+	info->thr = thr;
+	if (thr_info_create(&info->rx_thr, NULL, bm1370_rx, (void *)cgpu)) {
+		applog(LOG_ERR, "%s%d: RX thread create failed",
+		       cgpu->drv->name, cgpu->device_id);
+		return false;
+	}
+
+	if (thr_info_create(&info->tx_thr, NULL, bm1370_tx, (void *)cgpu)) {
+		applog(LOG_ERR, "%s%d: TX thread create failed",
+		       cgpu->drv->name, cgpu->device_id);
+		cgpu->shutdown = true;
+		pthread_join(info->rx_thr.pth, NULL);
+		return false;
+	}
+
+	return true;
+}
+
+/* Keep one work item ready for the TX thread */
+static bool bm1370_queue_full(struct cgpu_info *cgpu)
+{
+	struct bm1370_info *info = (struct bm1370_info *)cgpu->device_data;
+	uint32_t flush_gen;
+	struct work *work;
+	bool wake = false;
+
+	mutex_lock(&info->lock);
+	if (info->next) {
+		mutex_unlock(&info->lock);
+		return true;
+	}
+	flush_gen = info->flush_gen;
+	mutex_unlock(&info->lock);
+
+	work = get_queued(cgpu);
+	if (!work)
+		return false;
+
+	mutex_lock(&info->lock);
+	if (unlikely(info->flush_gen != flush_gen)) {
+		mutex_unlock(&info->lock);
+		work_completed(cgpu, work);
+		return false;
+	}
+	info->next = work;
+	wake = info->starved;
+	info->starved = false;
+	mutex_unlock(&info->lock);
+
+	if (wake)
+		cgsem_post(&info->tx_sem);
+	return true;
+}
+
+/* Drop the pending work and every job on the chip so nothing stale is
+ * submitted, then have the TX thread send new work as soon as it arrives */
+static void bm1370_flush_work(struct cgpu_info *cgpu)
+{
+	struct bm1370_info *info = (struct bm1370_info *)cgpu->device_data;
+	struct work *flushed[BM1370_JOBS + 1];
+	int i, count = 0;
+
+	mutex_lock(&info->lock);
+	if (info->next)
+		flushed[count++] = info->next;
+	info->next = NULL;
+	for (i = 0; i < BM1370_JOBS; i++) {
+		if (info->jobs[i].work)
+			flushed[count++] = info->jobs[i].work;
+		info->jobs[i].work = NULL;
+	}
+	info->starved = true;
+	info->flush_gen++;
+	mutex_unlock(&info->lock);
 
-static void bm1370_detect(__maybe_unused bool hotplug)
+	for (i = 0; i < count; i++)
+		work_completed(cgpu, flushed[i]);
+}
+
+static int64_t bm1370_scanwork(struct thr_info *thr)
+{
+	struct cgpu_info *cgpu = thr->cgpu;
+	struct bm1370_info *info = (struct bm1370_info *)cgpu->device_data;
+	int64_t hashes;
+
+	cgsem_mswait(&info->scan_sem, BM1370_SCAN_mS);
+
+	mutex_lock(&info->lock);
+	hashes = info->hashes;
+	info->hashes = 0;
+	mutex_unlock(&info->lock);
+
+	return hashes;
+}
+
+static void bm1370_get_statline_before(char *buf, size_t bufsiz, struct cgpu_info *cgpu)
+{
+	struct bm1370_info *info = (struct bm1370_info *)cgpu->device_data;
+
+	tailsprintf(buf, bufsiz, "%3d %4dMHz ", info->chips, info->freq);
+}
+
+static struct api_data *bm1370_api_stats(struct cgpu_info *cgpu)
+{
+	struct bm1370_info *info = (struct bm1370_info *)cgpu->device_data;
+	struct api_data *root = NULL;
+
+	root = api_add_string(root, "Device", info->device, false);
+	root = api_add_int(root, "Chips", &info->chips, false);
+	root = api_add_int(root, "Frequency", &info->freq, false);
+	root = api_add_int(root, "Ticket Diff", &info->ticket, false);
+	root = api_add_hex32(root, "Version Mask", &info->vmask, false);
+	root = api_add_int(root, "Job mS", &info->job_ms, false);
+
+	mutex_lock(&info->lock);
+	root = api_add_uint64(root, "Jobs Sent", &info->jobs_sent, true);
+	root = api_add_uint64(root, "Nonces", &info->nonces, true);
+	root = api_add_uint64(root, "Bad Nonces", &info->bad_nonces, true);
+	root = api_add_uint64(root, "Stale Nonces", &info->stale_nonces, true);
+	root = api_add_uint64(root, "CRC Errors", &info->crc_errors, true);
+	root = api_add_uint64(root, "Sync Bytes", &info->sync_bytes, true);
+	root = api_add_uint64(root, "Register Replies", &info->reg_replies, true);
+	mutex_unlock(&info->lock);
+
+	return root;
+}
+
+static void bm1370_shutdown(struct thr_info *thr)
 {
-    applog(LOG_INFO, "BM1370 driver stub loaded");
+	struct cgpu_info *cgpu = thr->cgpu;
+	struct bm1370_info *info = (struct bm1370_info *)cgpu->device_data;
+
+	cgpu->shutdown = true;
+	cgsem_post(&info->tx_sem);
+	pthread_join(info->tx_thr.pth, NULL);
+	pthread_join(info->rx_thr.pth, NULL);
+	close(info->fd);
+	info->fd = -1;
 }
 
 struct device_drv bm1370_drv = {
-    .drv_id    = DRIVER_bm1370,
-    .dname     = "BM1370",
-    .name      = "BM1370",
-    .drv_detect = bm1370_detect,
-    .hash_work  = hash_driver_work,
-    .get_statline_before = blank_get_statline_before,
+	.drv_id = DRIVER_bm1370,
+	.dname = "BM1370",
+	.name = "BM1370",
+	.drv_detect = bm1370_detect,
+	.get_api_stats = bm1370_api_stats,
+	.get_statline_before = bm1370_get_statline_before,
+	.thread_prepare = bm1370_thread_prepare,
+	.hash_work = hash_queued_work,
+	.scanwork = bm1370_scanwork,
+	.queue_full = bm1370_queue_full,
+	.flush_work = bm1370_flush_work,
+	.thread_shutdown = bm1370_shutdown,
 };
-
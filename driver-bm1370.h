@@ -1,6 +1,132 @@
+/*
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 3 of the License, or (at your option)
+ * any later version.  See COPYING for more details.
+ */
+
 #ifndef DRIVER_BM1370_H
 #define DRIVER_BM1370_H
 
 #include "miner.h"
 
-#endif // DRIVER_BM1370_H
+#define BM1370_CHIP_ID		0x1370
+#define BM1370_MAX_CHIPS	128
+/* Used only to estimate the nonce range run time of a job */
+#define BM1370_SMALL_CORES	2040
+
+#define BM1370_DEV_DEF		"/dev/ttyUSB0"
+#define BM1370_FREQ_DEF		525
+#define BM1370_FREQ_MIN		50
+#define BM1370_FREQ_MAX		1000
+#define BM1370_FREQ_START	56.25
+#define BM1370_FREQ_STEP	6.25
+#define BM1370_DIFF_DEF		256
+
+/* The chips start at 115200 and are switched to 1M once initialised */
+#define BM1370_BAUD_INIT	B115200
+#define BM1370_BAUD_FAST	B1000000
+
+#define BM1370_PREAMBLE_TX0	0x55
+#define BM1370_PREAMBLE_TX1	0xAA
+#define BM1370_PREAMBLE_RX0	0xAA
+#define BM1370_PREAMBLE_RX1	0x55
+
+/* Frame header: type | group | command */
+#define BM1370_TYPE_JOB		0x20
+#define BM1370_TYPE_CMD		0x40
+#define BM1370_GROUP_SINGLE	0x00
+#define BM1370_GROUP_ALL	0x10
+#define BM1370_CMD_SETADDRESS	0x00
+#define BM1370_CMD_WRITE	0x01
+#define BM1370_CMD_READ		0x02
+#define BM1370_CMD_INACTIVE	0x03
+
+#define BM1370_REG_CHIP_ID	0x00
+#define BM1370_REG_PLL0		0x08
+#define BM1370_REG_HASH_COUNT	0x10
+#define BM1370_REG_TICKET_MASK	0x14
+#define BM1370_REG_MISC_CONTROL	0x18
+#define BM1370_REG_FAST_UART	0x28
+#define BM1370_REG_CORE_CONTROL	0x3C
+#define BM1370_REG_ANALOG_MUX	0x54
+#define BM1370_REG_IO_STRENGTH	0x58
+#define BM1370_REG_VERSION_MASK	0xA4
+#define BM1370_REG_A8		0xA8
+#define BM1370_REG_B9		0xB9
+
+/* Every reply, register or nonce, is 11 bytes:
+ * AA 55 | 4 data | 2 addr/midstate,job_id | 2 reg/version | flags+crc5 */
+#define BM1370_REPLY_LEN	11
+#define BM1370_REPLY_JOB	0x80
+
+/* Job payload: job_id, num_midstates, starting_nonce[4], nbits[4],
+ * ntime[4], merkle_root[32], prev_block_hash[32], version[4] */
+#define BM1370_JOB_LEN		82
+
+/* The chip keeps 16 jobs. Job ids are multiples of 8 below 128, stepped
+ * by 24 so consecutive jobs never share an id, and come back in the top
+ * nibble of the reply's job_id byte with the small core in the bottom. */
+#define BM1370_JOBS		16
+#define BM1370_JOB_ID_STEP	24
+#define BM1370_JOB_ID_MAX	128
+
+/* Version bits the chip can roll: its register holds mask >> 13 */
+#define BM1370_VMASK_BITS	0x1fffe000
+#define BM1370_VMASK_DEF	0x1fffe000
+
+/* Longest time between jobs, and shortest when not version rolling */
+#define BM1370_JOB_mS		500
+#define BM1370_JOB_mS_MIN	5
+#define BM1370_RAMP_mS		100
+#define BM1370_DETECT_mS	1000
+#define BM1370_READ_mS		100
+#define BM1370_SCAN_mS		100
+
+/* Consecutive read failures, BM1370_READ_mS apart, before giving up */
+#define BM1370_READ_FAILS	50
+
+#define BM1370_RXBUF		1024
+
+struct bm1370_job {
+	struct work *work;
+	uint32_t vmask;
+};
+
+struct bm1370_info {
+	struct thr_info *thr;
+	struct thr_info tx_thr;
+	struct thr_info rx_thr;
+	char *device;
+	int fd;
+	int chips;
+	int freq;
+	double hashrate;
+
+	/* Owned by the TX thread once mining */
+	uint8_t job_id;
+	uint32_t vmask;
+	int ticket;
+	int job_ms;
+
+	/* Protects everything below */
+	pthread_mutex_t lock;
+	struct work *next;
+	bool starved;
+	/* Bumped by every flush so work taken before it is never sent */
+	uint32_t flush_gen;
+	struct bm1370_job jobs[BM1370_JOBS];
+	int64_t hashes;
+	uint64_t jobs_sent;
+	uint64_t nonces;
+	uint64_t bad_nonces;
+	uint64_t stale_nonces;
+	uint64_t crc_errors;
+	uint64_t sync_bytes;
+	uint64_t reg_replies;
+
+	cgsem_t tx_sem;
+	cgsem_t scan_sem;
+};
+
+#endif /* DRIVER_BM1370_H */
@@ -11,6 +11,9 @@
 #include "config.h"
 
 #include <unistd.h>
+#ifndef WIN32
+#include <sys/uio.h>
+#endif
 
 #include "logging.h"
 #include "miner.h"
@@ -21,6 +24,55 @@ bool opt_log_output = false;
 /* per default priorities higher than LOG_NOTICE are logged */
 int opt_log_level = LOG_NOTICE;
 
+bool opt_log_async = false;
+
+/* Async logging: messages are copied into preallocated entries and queued
+ * on a lock free ring for the writer thread, so a logging thread never
+ * waits on the console, stderr or syslog. If the writer falls behind and
+ * no entry is free, the message is counted as dropped instead. The writer is
+ * only woken when the queue goes from empty to non-empty. */
+#define LOG_ENTRIES 1024
+#define LOG_BATCH 64
+
+struct log_ent {
+	struct timeval tv;
+	int prio;
+	bool stamp;
+	char str[LOGBUFSIZ * 2];
+};
+
+static bool log_async;
+static struct log_ent *log_ents;
+static struct cgring log_free;
+static struct cgring log_queue;
+static cgsem_t log_sem;
+static int log_queued;
+static int log_dropped;
+static pthread_mutex_t log_drain_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* localtime() is only needed once a second per thread */
+static void log_datetime(char *buf, size_t siz, struct timeval *tv)
+{
+	static __thread time_t last_sec = -1;
+	static __thread char last[32];
+
+	if (tv->tv_sec != last_sec) {
+		const time_t tmp_time = tv->tv_sec;
+		struct tm *tm = localtime(&tmp_time);
+
+		snprintf(last, sizeof(last), "%d-%02d-%02d %02d:%02d:%02d",
+			tm->tm_year + 1900,
+			tm->tm_mon + 1,
+			tm->tm_mday,
+			tm->tm_hour,
+			tm->tm_min,
+			tm->tm_sec);
+		last_sec = tv->tv_sec;
+	}
+
+	snprintf(buf, siz, " [%s.%03d] ", last, (int)(tv->tv_usec / 1000));
+}
+
 static void my_log_curses(int prio, const char *datetime, const char *str, bool force)
 {
 	if (opt_quiet && prio != LOG_ERR)
@@ -45,6 +97,194 @@ static void my_log_curses(int prio, const char *datetime, const char *str, bool
 	}
 }
 
+/* Returns false if the message must be written directly */
+static bool log_queue_add(int prio, const char *str, bool stamp)
+{
+	struct log_ent *ent;
+	size_t len;
+
+	len = strlen(str);
+	if (unlikely(len >= sizeof(ent->str)))
+		return false;
+
+	ent = cgring_pop(&log_free);
+	if (unlikely(!ent)) {
+		__atomic_add_fetch(&log_dropped, 1, __ATOMIC_RELAXED);
+		return true;
+	}
+
+	cgtime(&ent->tv);
+	ent->prio = prio;
+	ent->stamp = stamp;
+	memcpy(ent->str, str, len + 1);
+
+	cgring_push(&log_queue, ent);
+	if (!__atomic_fetch_add(&log_queued, 1, __ATOMIC_SEQ_CST))
+		cgsem_post(&log_sem);
+
+	return true;
+}
+
+#ifndef WIN32
+static void log_writev(int fd, struct iovec *iov, int cnt)
+{
+	ssize_t n;
+
+	while (cnt > 0) {
+		n = writev(fd, iov, cnt);
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			return;
+		}
+		while (cnt > 0 && (size_t)n >= iov->iov_len) {
+			n -= iov->iov_len;
+			iov++;
+			cnt--;
+		}
+		if (cnt > 0) {
+			iov->iov_base = (char *)iov->iov_base + n;
+			iov->iov_len -= n;
+		}
+	}
+}
+#endif
+
+static void log_write(struct log_ent **batch, int count)
+{
+	char datetime[LOG_BATCH][64];
+	int i;
+
+	for (i = 0; i < count; i++) {
+		if (batch[i]->stamp)
+			log_datetime(datetime[i], sizeof(datetime[i]), &batch[i]->tv);
+		else
+			datetime[i][0] = '\0';
+	}
+
+#ifdef HAVE_SYSLOG_H
+	if (use_syslog) {
+		for (i = 0; i < count; i++)
+			syslog(LOG_LOCAL0 | batch[i]->prio, "%s", batch[i]->str);
+		return;
+	}
+#endif
+
+	/* Only output to stderr if it's not going to the screen as well */
+	if (!isatty(fileno((FILE *)stderr))) {
+#ifndef WIN32
+		struct iovec iov[LOG_BATCH * 3];
+
+		for (i = 0; i < count; i++) {
+			iov[i * 3].iov_base = datetime[i];
+			iov[i * 3].iov_len = strlen(datetime[i]);
+			iov[i * 3 + 1].iov_base = batch[i]->str;
+			iov[i * 3 + 1].iov_len = strlen(batch[i]->str);
+			iov[i * 3 + 2].iov_base = "\n";
+			iov[i * 3 + 2].iov_len = 1;
+		}
+		fflush(stderr);
+		log_writev(fileno((FILE *)stderr), iov, count * 3);
+#else
+		for (i = 0; i < count; i++)
+			fprintf(stderr, "%s%s\n", datetime[i], batch[i]->str);
+		fflush(stderr);
+#endif
+	}
+
+	for (i = 0; i < count; i++)
+		my_log_curses(batch[i]->prio, datetime[i], batch[i]->str, false);
+}
+
+/* Write out everything queued so far. Must hold log_drain_lock. Entries are
+ * counted in log_queued only after they're pushed, so while it stays above
+ * zero there is more to pop, and whoever queues into an empty queue after
+ * we stop wakes the writer thread. */
+static void __log_drain(void)
+{
+	struct log_ent *batch[LOG_BATCH];
+	int count, i, dropped;
+
+	do {
+		for (count = 0; count < LOG_BATCH; count++) {
+			batch[count] = cgring_pop(&log_queue);
+			if (!batch[count])
+				break;
+		}
+		if (count) {
+			log_write(batch, count);
+			for (i = 0; i < count; i++)
+				cgring_push(&log_free, batch[i]);
+		}
+	} while (__atomic_sub_fetch(&log_queued, count, __ATOMIC_SEQ_CST) > 0);
+
+	dropped = __atomic_exchange_n(&log_dropped, 0, __ATOMIC_RELAXED);
+	if (unlikely(dropped)) {
+		char tmp42[LOGBUFSIZ];
+
+		snprintf(tmp42, sizeof(tmp42), "Logging fell behind and dropped %d messages", dropped);
+		log_queue_add(LOG_WARNING, tmp42, true);
+	}
+}
+
+/* The writer thread's drain. A thread writing a message directly holds
+ * log_drain_lock and drains everything before its message itself, so the
+ * writer leaves the queue to it rather than wait. */
+static void log_drain(void)
+{
+	if (mutex_trylock(&log_drain_lock))
+		return;
+	__log_drain();
+	mutex_unlock(&log_drain_lock);
+}
+
+static void *log_thread(void __maybe_unused *userdata)
+{
+	pthread_detach(pthread_self());
+
+	RenameThread("Logger");
+
+	while (42) {
+		cgsem_mswait(&log_sem, 1000);
+		cgsem_reset(&log_sem);
+		log_drain();
+	}
+
+	return NULL;
+}
+
+void log_async_start(void)
+{
+	pthread_t pth;
+	int i;
+
+	log_ents = cgcalloc(LOG_ENTRIES, sizeof(*log_ents));
+	cgring_init(&log_free, LOG_ENTRIES);
+	cgring_init(&log_queue, LOG_ENTRIES);
+	for (i = 0; i < LOG_ENTRIES; i++)
+		cgring_push(&log_free, &log_ents[i]);
+	cgsem_init(&log_sem);
+
+	if (unlikely(pthread_create(&pth, NULL, log_thread, NULL))) {
+		applog(LOG_ERR, "Failed to create logging thread, logging synchronously");
+		return;
+	}
+
+	log_async = true;
+}
+
+/* Back to writing directly, with anything still queued written first */
+void log_async_stop(void)
+{
+	if (!log_async)
+		return;
+
+	log_async = false;
+	mutex_lock(&log_drain_lock);
+	__log_drain();
+	mutex_unlock(&log_drain_lock);
+}
+
 /* high-level logging function, based on global opt_log_level */
 
 /*
@@ -52,6 +292,18 @@ static void my_log_curses(int prio, const char *datetime, const char *str, bool
  */
 void _applog(int prio, const char *str, bool force)
 {
+	bool drained = false;
+
+	if (log_async) {
+		if (!force && log_queue_add(prio, str, true))
+			return;
+		/* Get everything before this out first, and keep anything
+		 * queued after it from being written before it */
+		mutex_lock(&log_drain_lock);
+		__log_drain();
+		drained = true;
+	}
+
 #ifdef HAVE_SYSLOG_H
 	if (use_syslog) {
 		syslog(LOG_LOCAL0 | prio, "%s", str);
@@ -62,21 +314,9 @@ void _applog(int prio, const char *str, bool force)
 	else {
 		char datetime[64];
 		struct timeval tv = {0, 0};
-		struct tm *tm;
 
 		cgtime(&tv);
-
-		const time_t tmp_time = tv.tv_sec;
-		int ms = (int)(tv.tv_usec / 1000);
-		tm = localtime(&tmp_time);
-
-		snprintf(datetime, sizeof(datetime), " [%d-%02d-%02d %02d:%02d:%02d.%03d] ",
-			tm->tm_year + 1900,
-			tm->tm_mon + 1,
-			tm->tm_mday,
-			tm->tm_hour,
-			tm->tm_min,
-			tm->tm_sec, ms);
+		log_datetime(datetime, sizeof(datetime), &tv);
 
 		/* Only output to stderr if it's not going to the screen as well */
 		if (!isatty(fileno((FILE *)stderr))) {
@@ -86,10 +326,22 @@ void _applog(int prio, const char *str, bool force)
 
 		my_log_curses(prio, datetime, str, force);
 	}
+	if (drained)
+		mutex_unlock(&log_drain_lock);
 }
 
 void _simplelog(int prio, const char *str, bool force)
 {
+	bool drained = false;
+
+	if (log_async) {
+		if (!force && log_queue_add(prio, str, false))
+			return;
+		mutex_lock(&log_drain_lock);
+		__log_drain();
+		drained = true;
+	}
+
 #ifdef HAVE_SYSLOG_H
 	if (use_syslog) {
 		syslog(LOG_LOCAL0 | prio, "%s", str);
@@ -106,4 +358,6 @@ void _simplelog(int prio, const char *str, bool force)
 
 		my_log_curses(prio, "", str, force);
 	}
+	if (drained)
+		mutex_unlock(&log_drain_lock);
 }
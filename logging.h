@@ -27,10 +27,15 @@ extern bool want_per_device_stats;
 /* global log_level, messages with lower or equal prio are logged */
 extern int opt_log_level;
 
+/* write log messages from a background thread */
+extern bool opt_log_async;
+
 #define LOGBUFSIZ 256
 
 extern void _applog(int prio, const char *str, bool force);
 extern void _simplelog(int prio, const char *str, bool force);
+extern void log_async_start(void);
+extern void log_async_stop(void);
 
 #define IN_FMT_FFL " in %s %s():%d"
 
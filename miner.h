@@ -96,6 +96,8 @@ static inline int fsync (int fd)
  #ifndef LINUX
   #define LINUX
  #endif
+ /* Stratum pool sockets are serviced by a single epoll reactor thread */
+ #define STRATUM_REACTOR
 #endif
 
 #ifdef WIN32
@@ -378,6 +380,10 @@ struct device_drv {
 
 	/* Does this device generate work itself and not require stratum work generation? */
 	bool genwork;
+
+	/* Version rolled midstates wanted with each work when the pool
+	 * allows version rolling, 0 or 1 for just work->midstate */
+	int midstates;
 };
 
 extern struct device_drv *copy_drv(struct device_drv*);
@@ -448,6 +454,18 @@ struct cgminer_pool_stats {
 	uint64_t net_bytes_received;
 };
 
+/* Valid diff1 work and HW errors reported by a device that are yet to be
+ * added to the pool and global totals by fold_share_stats. Kept on a cache
+ * line of its own with its own lock so devices reporting shares at the same
+ * time don't contend with each other. */
+struct share_stats {
+	pthread_mutex_t lock;
+	struct pool *pool;
+	int64_t diff1;
+	int64_t pool_diff1;
+	int hw_errors;
+} __attribute__((aligned(64)));
+
 struct cgpu_info {
 	int cgminer_id;
 	struct device_drv *drv;
@@ -545,9 +563,11 @@ struct cgpu_info {
 	int dev_throttle_count;
 
 	struct cgminer_stats cgminer_stats;
+	struct share_stats share_stats;
 
 	pthread_rwlock_t qlock;
 	struct work *queued_work;
+	struct work *queued_midstate;
 	struct work *unqueued_work;
 	unsigned int queued_count;
 
@@ -1019,6 +1039,7 @@ extern int opt_api_mcast_port;
 extern char *opt_api_groups;
 extern char *opt_api_description;
 extern int opt_api_port;
+extern int opt_api_cache;
 extern char *opt_api_host;
 extern bool opt_api_listen;
 extern bool opt_api_network;
@@ -1052,6 +1073,11 @@ extern char *opt_bab_options;
 #ifdef USE_BITMINE_A1
 extern char *opt_bitmine_a1_options;
 #endif
+#ifdef USE_BM1370
+extern char *opt_bm1370_dev;
+extern int opt_bm1370_diff;
+extern int opt_bm1370_freq;
+#endif
 #ifdef USE_DRAGONMINT_T1
 extern char *opt_dragonmint_t1_options;
 extern int opt_T1Pll[];
@@ -1102,6 +1128,7 @@ extern char *opt_minion_temp;
 extern char *opt_usb_select;
 extern int opt_usbdump;
 extern bool opt_usb_list_all;
+extern bool opt_usb_stream;
 extern cgsem_t usb_resource_sem;
 #endif
 #ifdef USE_BITFORCE
@@ -1118,10 +1145,15 @@ extern pthread_rwlock_t netacc_lock;
 extern const uint32_t sha256_init_state[];
 #ifdef HAVE_LIBCURL
 extern json_t *json_web_config(const char *url);
+struct pool;
+struct json_rpc_req;
 extern json_t *json_rpc_call(CURL *curl, const char *url, const char *userpass,
 			     const char *rpc_req, bool, bool, int *,
 			     struct pool *pool, bool);
-struct pool;
+extern struct json_rpc_req *json_rpc_setup(CURL *curl, const char *url,
+					   const char *userpass, const char *rpc_req,
+					   bool, bool, struct pool *pool, bool);
+extern json_t *json_rpc_result(struct json_rpc_req *req, int rc, int *rolltime);
 extern struct pool *opt_btcd;
 #endif
 extern const char *proxytype(proxytypes_t proxytype);
@@ -1256,6 +1288,14 @@ enum pool_enable {
 	POOL_REJECTING,
 };
 
+enum reactor_state {
+	REACTOR_NEW,		/* Queued to be added to the stratum reactor */
+	REACTOR_ACTIVE,		/* Socket is being watched by the reactor */
+	REACTOR_PARKED,		/* Disconnected until the pool is needed */
+	REACTOR_CONNECTING,	/* A connect thread is running restart_stratum */
+	REACTOR_BACKOFF,	/* Waiting to retry a failed connect */
+};
+
 struct stratum_work {
 	char *job_id;
 	unsigned char **merkle_bin;
@@ -1267,6 +1307,12 @@ struct stratum_work {
 #define RBUFSIZE 8192
 #define RECVSIZE (RBUFSIZE - 4)
 
+/* Seconds covered by a pool's stratum share timing wheel, must be more than
+ * SSHARE_EXPIRE */
+#define SSHARE_WHEEL 128
+
+struct stratum_share;
+
 struct pool {
 	int pool_no;
 	int prio;
@@ -1287,9 +1333,7 @@ struct pool {
 
 	/* Vmask data */
 	bool vmask; /* Supports vmask */
-	uint32_t vmask_001[16];
-	char vmask_002[16][9];
-	int vmask_003[4];
+	uint32_t vmask_bits; /* Version bits the pool allows rolling */
 
 	bool submit_fail;
 	bool idle;
@@ -1331,7 +1375,6 @@ struct pool {
 	bool testing;
 
 	int curls;
-	pthread_cond_t cr_cond;
 	struct list_head curlring;
 
 	time_t last_share_time;
@@ -1351,6 +1394,15 @@ struct pool {
 	SOCKETTYPE sock;
 	char *sockbuf;
 	size_t sockbuf_size;
+	/* Received data not yet handed out is sockbuf[sockbuf_start,
+	 * sockbuf_end), searched for a newline as far as sockbuf_scan */
+	size_t sockbuf_start;
+	size_t sockbuf_end;
+	size_t sockbuf_scan;
+	/* Bumped whenever lines already handed out may be overwritten */
+	unsigned int sockbuf_gen;
+	/* Bumped for every new socket since its fd number may be reused */
+	unsigned int sock_gen;
 	char *sockaddr_url; /* stripped url used for sockaddr */
 	char *sockaddr_proxy_url;
 	char *sockaddr_proxy_port;
@@ -1368,9 +1420,24 @@ struct pool {
 	pthread_t stratum_sthread;
 	pthread_t stratum_rthread;
 	pthread_mutex_t stratum_lock;
+
+	/* Stratum reactor bookkeeping, see stratum_reactor_thread */
+	enum reactor_state reactor_state;
+	unsigned int reactor_gen;
+	time_t reactor_due;
+	int reactor_backoff;
+	bool reactor_connected;
 	struct thread_q *stratum_q;
+	struct thread_q *stratum_rq; /* replies queued for stratum_sthread */
 	int sshares; /* stratum shares submitted waiting on response */
 
+	/* Those shares by id, and in a timing wheel by the second they
+	 * expire, see prune_stratum_shares */
+	pthread_mutex_t sshare_lock;
+	struct stratum_share *stratum_shares;
+	struct list_head sshare_wheel[SSHARE_WHEEL];
+	time_t sshare_pruned;
+
 	/* GBT  variables */
 	bool has_gbt;
 	cglock_t gbt_lock;
@@ -1402,6 +1469,17 @@ struct pool {
 	unsigned char *coinbase;
 	int coinbase_len;
 	int nonce2_offset;
+	/* Stratum only: hash state over the whole blocks of the coinbase
+	 * preceding nonce2, which stay the same for the life of a job */
+	uint32_t cb_midstate[8];
+	int cb_prefix_len;
+	/* Stratum only: reference counted copies of the job strings shared by
+	 * all work generated from the current job */
+	char *work_job_id;
+	char *work_nonce1;
+	char *work_ntime;
+	/* Stratum only: bumped by parse_notify for every new job_id */
+	unsigned int job_gen;
 	unsigned char header_bin[128];
 	int merkles;
 	char prev_hash[68];
@@ -1429,17 +1507,37 @@ struct pool {
 #define GETWORK_MODE_GBT 'G'
 #define GETWORK_MODE_SOLO 'C'
 
+/* One version rolled midstate, in the same layout as work->midstate */
+struct vmidstate {
+	/* The first word of work->data this was generated from, as stored */
+	uint32_t	version;
+	unsigned char	midstate[32];
+};
+
+/* The version rolled midstates of a work item. Reference counted and
+ * shared read only with every copy of the work. */
+struct vmidstates {
+	int		refs;
+	int		count;
+	struct vmidstate ms[];
+};
+
 struct work {
 	unsigned char	data[128];
 	unsigned char	midstate[32];
-	unsigned char   midstate1[32];
-	unsigned char   midstate2[32];
-	unsigned char   midstate3[32];
 	unsigned char	target[32];
 	unsigned char	hash[32];
 
 	uint16_t        micro_job_id;
 
+	/* Header version midstate above was generated from, so nonces can be
+	 * checked from the cached midstate. Only valid if midstates is set. */
+	uint32_t	midstate_ver;
+	int		midstates;
+	/* With more than one midstate they are all kept here, with ms[0]
+	 * the same as midstate above, else NULL */
+	struct vmidstates *vmidstates;
+
 	/* This is the diff the device is currently aiming for and must be
 	 * the minimum of work_difficulty & drv->max_diff */
 	double		device_diff;
@@ -1463,6 +1561,7 @@ struct work {
 	bool		mandatory;
 	bool		block;
 
+	/* job_id, ntime and nonce1 are cgstr reference counted strings */
 	bool		stratum;
 	char 		*job_id;
 	uint64_t	nonce2;
@@ -1476,8 +1575,13 @@ struct work {
 	int		gbt_txns;
 
 	unsigned int	work_block;
+	unsigned int	job_gen;
 	uint32_t	id;
 	UT_hash_handle	hh;
+	/* Secondary index of a cgpu's queued work by the midstate and the 12
+	 * bytes of data after it, as copied in when queued */
+	UT_hash_handle	hh_midstate;
+	unsigned char	midstate_key[44];
 
 	/* This is the diff work we're aiming to submit and should match the
 	 * work->target binary */
@@ -1547,6 +1651,8 @@ extern bool test_nonce(struct work *work, uint32_t nonce);
 extern bool test_nonce_diff(struct work *work, uint32_t nonce, double diff);
 extern bool submit_tested_work(struct thr_info *thr, struct work *work);
 extern bool submit_nonce(struct thr_info *thr, struct work *work, uint32_t nonce);
+extern int submit_nonces(struct thr_info *thr, struct work *work, const uint32_t *nonces,
+			 int count);
 extern bool submit_noffset_nonce(struct thr_info *thr, struct work *work, uint32_t nonce,
 			  int noffset);
 extern int share_work_tdiff(struct cgpu_info *cgpu);
@@ -1581,6 +1687,7 @@ extern void remove_pool(struct pool *pool);
 extern void write_config(FILE *fcfg);
 extern void zero_bestshare(void);
 extern void zero_stats(void);
+extern void fold_share_stats(void);
 extern void default_save_file(char *filename);
 extern bool log_curses_only(int prio, const char *datetime, const char *str);
 extern void clear_logwin(void);
@@ -1592,6 +1699,7 @@ extern struct thread_q *tq_new(void);
 extern void tq_free(struct thread_q *tq);
 extern bool tq_push(struct thread_q *tq, void *data);
 extern void *tq_pop(struct thread_q *tq);
+extern void *tq_pop_ms(struct thread_q *tq, int ms);
 extern void tq_freeze(struct thread_q *tq);
 extern void tq_thaw(struct thread_q *tq);
 extern bool successful_connect;
@@ -1640,15 +1748,6 @@ enum api_data_type {
 	API_AVG
 };
 
-struct api_data {
-	enum api_data_type type;
-	char *name;
-	void *data;
-	bool data_was_malloc;
-	struct api_data *prev;
-	struct api_data *next;
-};
-
 extern struct api_data *api_add_escape(struct api_data *root, char *name, char *data, bool copy_data);
 extern struct api_data *api_add_string(struct api_data *root, char *name, char *data, bool copy_data);
 extern struct api_data *api_add_const(struct api_data *root, char *name, const char *data, bool copy_data);
@@ -10,19 +10,37 @@
 #include "miner.h"
 #include "klist.h"
 
+/*
+ * Nonces seen in the last timelimit seconds are kept in a chained hash
+ * table keyed on (work_id, nonce) for the lookup, and in one store per
+ * second of age for the expiry - when a second's store becomes too old
+ * its items are unhashed and the whole store goes back to the free list
+ * So each check costs the same no matter how many nonces are held
+ */
+
 // Nonce
 typedef struct nitem {
 	uint32_t work_id;
 	uint32_t nonce;
-	struct timeval when;
+	K_ITEM *hnext;
+	K_ITEM **hprev;
 } NITEM;
 
 #define DATAN(_item) ((NITEM *)(_item->data))
 
+// Initial hash slots, doubled when they average more than 2 nonces
+#define DUP_HASH_SLOTS 4096
+
 struct dupdata {
 	int timelimit;
 	K_LIST *nfree_list;
-	K_STORE *nonce_list;
+	// ages stores, store[sec % ages] holds the nonces from second sec
+	K_STORE **age_list;
+	int ages;
+	time_t newest;
+	K_ITEM **hash;
+	uint32_t hash_mask;
+	int count;
 	uint64_t checked;
 	uint64_t dups;
 };
@@ -30,6 +48,7 @@ struct dupdata {
 void dupalloc(struct cgpu_info *cgpu, int timelimit)
 {
 	struct dupdata *dup;
+	int i;
 
 	dup = calloc(1, sizeof(*dup));
 	if (unlikely(!dup))
@@ -37,7 +56,16 @@ void dupalloc(struct cgpu_info *cgpu, int timelimit)
 
 	dup->timelimit = timelimit;
 	dup->nfree_list = k_new_list("Nonces", sizeof(NITEM), 1024, 0, true);
-	dup->nonce_list = k_new_store(dup->nfree_list);
+	dup->ages = timelimit + 1;
+	dup->age_list = calloc(dup->ages, sizeof(*(dup->age_list)));
+	if (unlikely(!dup->age_list))
+		quithere(1, "Failed to calloc dupdata age_list");
+	for (i = 0; i < dup->ages; i++)
+		dup->age_list[i] = k_new_store(dup->nfree_list);
+	dup->hash = calloc(DUP_HASH_SLOTS, sizeof(*(dup->hash)));
+	if (unlikely(!dup->hash))
+		quithere(1, "Failed to calloc dupdata hash");
+	dup->hash_mask = DUP_HASH_SLOTS - 1;
 
 	cgpu->dup_data = dup;
 }
@@ -55,6 +83,86 @@ void dupcounters(struct cgpu_info *cgpu, uint64_t *checked, uint64_t *dups)
 	}
 }
 
+static inline uint32_t dup_hash(uint32_t work_id, uint32_t nonce)
+{
+	uint32_t h = work_id * 0x9E3779B1U ^ nonce;
+
+	h ^= h >> 16;
+	h *= 0x85EBCA6BU;
+	h ^= h >> 13;
+
+	return h;
+}
+
+static void dup_hash_add(struct dupdata *dup, K_ITEM *item)
+{
+	K_ITEM **slot = &(dup->hash[dup_hash(DATAN(item)->work_id, DATAN(item)->nonce) & dup->hash_mask]);
+	K_ITEM *next = *slot;
+
+	DATAN(item)->hnext = next;
+	DATAN(item)->hprev = slot;
+	if (next)
+		DATAN(next)->hprev = &(DATAN(item)->hnext);
+	*slot = item;
+}
+
+static void dup_hash_del(K_ITEM *item)
+{
+	K_ITEM *next = DATAN(item)->hnext;
+
+	*(DATAN(item)->hprev) = next;
+	if (next)
+		DATAN(next)->hprev = DATAN(item)->hprev;
+}
+
+static void dup_hash_grow(struct dupdata *dup)
+{
+	uint32_t slots = (dup->hash_mask + 1) * 2;
+	K_ITEM **hash;
+	K_ITEM *item;
+	int i;
+
+	hash = calloc(slots, sizeof(*hash));
+	// Just keep the current size if there's no memory
+	if (unlikely(!hash))
+		return;
+
+	free(dup->hash);
+	dup->hash = hash;
+	dup->hash_mask = slots - 1;
+	for (i = 0; i < dup->ages; i++) {
+		for (item = dup->age_list[i]->head; item; item = item->next)
+			dup_hash_add(dup, item);
+	}
+}
+
+// Discard the nonces that are now older than timelimit
+static void dup_expire(struct dupdata *dup, time_t now)
+{
+	K_STORE *store;
+	K_ITEM *item;
+	int n;
+
+	if (now <= dup->newest)
+		return;
+
+	// Everything is old after a long enough gap
+	if (now - dup->newest > dup->ages)
+		dup->newest = now - dup->ages;
+
+	while (dup->newest < now) {
+		dup->newest++;
+		store = dup->age_list[dup->newest % dup->ages];
+		n = 0;
+		for (item = store->head; item; item = item->next) {
+			dup_hash_del(item);
+			n++;
+		}
+		dup->count -= n;
+		k_list_transfer_to_head(store, dup->nfree_list);
+	}
+}
+
 bool isdupnonce(struct cgpu_info *cgpu, struct work *work, uint32_t nonce)
 {
 	struct dupdata *dup = (struct dupdata *)(cgpu->dup_data);
@@ -68,27 +176,24 @@ bool isdupnonce(struct cgpu_info *cgpu, struct work *work, uint32_t nonce)
 	cgtime(&now);
 	dup->checked++;
 	K_WLOCK(dup->nfree_list);
-	item = dup->nonce_list->tail;
+	dup_expire(dup, now.tv_sec);
+	item = dup->hash[dup_hash(work->id, nonce) & dup->hash_mask];
 	while (unique && item) {
 		if (DATAN(item)->work_id == work->id && DATAN(item)->nonce == nonce) {
 			unique = false;
 			applog(LOG_WARNING, "%s%d: Duplicate nonce %08x",
 					    cgpu->drv->name, cgpu->device_id, nonce);
 		} else
-			item = item->prev;
+			item = DATAN(item)->hnext;
 	}
 	if (unique) {
 		item = k_unlink_head(dup->nfree_list);
 		DATAN(item)->work_id = work->id;
 		DATAN(item)->nonce = nonce;
-		memcpy(&(DATAN(item)->when), &now, sizeof(now));
-		k_add_head(dup->nonce_list, item);
-	}
-	item = dup->nonce_list->tail;
-	while (item && tdiff(&(DATAN(item)->when), &now) > dup->timelimit) {
-		item = k_unlink_tail(dup->nonce_list);
-		k_add_head(dup->nfree_list, item);
-		item = dup->nonce_list->tail;
+		k_add_head(dup->age_list[dup->newest % dup->ages], item);
+		dup_hash_add(dup, item);
+		if (++dup->count > (int)(dup->hash_mask + 1) * 2)
+			dup_hash_grow(dup);
 	}
 	K_WUNLOCK(dup->nfree_list);
 
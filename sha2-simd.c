@@ -0,0 +1,409 @@
+/* SIMD SHA256 block transforms selected at runtime by sha2.c. Each backend
+ * compresses one 64 byte block into several independent states at once
+ * (sse4 4 lanes, avx2 8 lanes, neon 4 lanes) or uses the dedicated SHA
+ * instructions to do a single block quickly (sha-ni, armv8). Anything not
+ * built for the target cpu is simply left out of sha256_simd_impls. */
+
+#include "config.h"
+
+#include <string.h>
+
+#include "sha2.h"
+
+#if defined(__GNUC__) && (__GNUC__ > 4 || (__GNUC__ == 4 && __GNUC_MINOR__ >= 9)) && \
+    (defined(__x86_64__) || defined(__i386__))
+#define SHA256_X86
+#include <cpuid.h>
+#include <immintrin.h>
+#endif
+
+#if defined(__aarch64__) && defined(__ARM_NEON)
+#define SHA256_NEON
+#include <arm_neon.h>
+#if defined(__ARM_FEATURE_CRYPTO) || defined(__ARM_FEATURE_SHA2)
+#define SHA256_ARMV8
+#endif
+#ifdef __linux
+#include <sys/auxv.h>
+#include <asm/hwcap.h>
+#endif
+#endif
+
+#if defined(SHA256_X86) || defined(SHA256_NEON)
+static inline uint32_t mb_be32(const unsigned char *p)
+{
+	return ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) |
+	       ((uint32_t)p[2] << 8) | (uint32_t)p[3];
+}
+
+/* Lane-wise SHA256 round functions, given the vector primitives VADD, VXOR,
+ * VAND, VOR, VANDNOT(x, y) (~x & y), VSHR, VSHL and VSET1 for the backend. */
+#define MB_ROTR(x, n)	VOR(VSHR(x, n), VSHL(x, 32 - (n)))
+#define MB_F1(x)	VXOR(VXOR(MB_ROTR(x, 2), MB_ROTR(x, 13)), MB_ROTR(x, 22))
+#define MB_F2(x)	VXOR(VXOR(MB_ROTR(x, 6), MB_ROTR(x, 11)), MB_ROTR(x, 25))
+#define MB_F3(x)	VXOR(VXOR(MB_ROTR(x, 7), MB_ROTR(x, 18)), VSHR(x, 3))
+#define MB_F4(x)	VXOR(VXOR(MB_ROTR(x, 17), MB_ROTR(x, 19)), VSHR(x, 10))
+#define MB_CH(x, y, z)	VXOR(VAND(x, y), VANDNOT(x, z))
+#define MB_MAJ(x, y, z)	VOR(VAND(x, y), VAND(z, VOR(x, y)))
+
+/* Run the 64 rounds over the message schedule w[64] (first 16 filled in)
+ * and add the result into s[8]. */
+#define MB_COMPRESS(vec_t, s, w) do {					\
+	vec_t a = s[0], b = s[1], c = s[2], d = s[3];			\
+	vec_t e = s[4], f = s[5], g = s[6], h = s[7];			\
+	vec_t t1, t2;							\
+	int r;								\
+									\
+	for (r = 16; r < 64; r++)					\
+		w[r] = VADD(VADD(MB_F4(w[r - 2]), w[r - 7]),		\
+			    VADD(MB_F3(w[r - 15]), w[r - 16]));		\
+	for (r = 0; r < 64; r++) {					\
+		t1 = VADD(VADD(h, MB_F2(e)), VADD(MB_CH(e, f, g),	\
+			  VADD(VSET1(sha256_k[r]), w[r])));		\
+		t2 = VADD(MB_F1(a), MB_MAJ(a, b, c));			\
+		h = g;							\
+		g = f;							\
+		f = e;							\
+		e = VADD(d, t1);					\
+		d = c;							\
+		c = b;							\
+		b = a;							\
+		a = VADD(t1, t2);					\
+	}								\
+	s[0] = VADD(s[0], a);						\
+	s[1] = VADD(s[1], b);						\
+	s[2] = VADD(s[2], c);						\
+	s[3] = VADD(s[3], d);						\
+	s[4] = VADD(s[4], e);						\
+	s[5] = VADD(s[5], f);						\
+	s[6] = VADD(s[6], g);						\
+	s[7] = VADD(s[7], h);						\
+} while (0)
+
+/* Transpose n states and blocks into lane order, padding unused lanes with
+ * lane 0 so the vector code needn't care about short batches. */
+#define MB_LOAD(lanes, VLOAD, s, w, state, block, n) do {		\
+	uint32_t lbuf[lanes];						\
+	int l, r;							\
+									\
+	for (r = 0; r < 8; r++) {					\
+		for (l = 0; l < lanes; l++)				\
+			lbuf[l] = state[l < n ? l : 0][r];		\
+		s[r] = VLOAD(lbuf);					\
+	}								\
+	for (r = 0; r < 16; r++) {					\
+		for (l = 0; l < lanes; l++)				\
+			lbuf[l] = mb_be32(block[l < n ? l : 0] + (r << 2)); \
+		w[r] = VLOAD(lbuf);					\
+	}								\
+} while (0)
+
+#define MB_STORE(lanes, VSTORE, s, state, n) do {			\
+	uint32_t lbuf[lanes];						\
+	int l, r;							\
+									\
+	for (r = 0; r < 8; r++) {					\
+		VSTORE(lbuf, s[r]);					\
+		for (l = 0; l < n; l++)					\
+			state[l][r] = lbuf[l];				\
+	}								\
+} while (0)
+#endif /* SHA256_X86 || SHA256_NEON */
+
+#ifdef SHA256_X86
+static bool sha256_usable_sse4(void)
+{
+	__builtin_cpu_init();
+	return __builtin_cpu_supports("sse4.1");
+}
+
+static bool sha256_usable_avx2(void)
+{
+	__builtin_cpu_init();
+	return __builtin_cpu_supports("avx2");
+}
+
+static bool sha256_usable_shani(void)
+{
+	unsigned int eax, ebx, ecx, edx;
+
+	if (!__get_cpuid_count(7, 0, &eax, &ebx, &ecx, &edx))
+		return false;
+	/* CPUID.(EAX=7,ECX=0):EBX.SHA[bit 29] */
+	if (!(ebx & (1 << 29)))
+		return false;
+	return sha256_usable_sse4();
+}
+
+#define VADD(x, y)	_mm_add_epi32(x, y)
+#define VXOR(x, y)	_mm_xor_si128(x, y)
+#define VAND(x, y)	_mm_and_si128(x, y)
+#define VOR(x, y)	_mm_or_si128(x, y)
+#define VANDNOT(x, y)	_mm_andnot_si128(x, y)
+#define VSHR(x, n)	_mm_srli_epi32(x, n)
+#define VSHL(x, n)	_mm_slli_epi32(x, n)
+#define VSET1(x)	_mm_set1_epi32(x)
+#define VLOAD(p)	_mm_loadu_si128((const __m128i *)(p))
+#define VSTORE(p, x)	_mm_storeu_si128((__m128i *)(p), x)
+
+__attribute__((target("sse4.1")))
+static void sha256_transform_sse4(uint32_t * const *state,
+				  const unsigned char * const *block, int n)
+{
+	__m128i s[8], w[64];
+
+	MB_LOAD(4, VLOAD, s, w, state, block, n);
+	MB_COMPRESS(__m128i, s, w);
+	MB_STORE(4, VSTORE, s, state, n);
+}
+
+#undef VADD
+#undef VXOR
+#undef VAND
+#undef VOR
+#undef VANDNOT
+#undef VSHR
+#undef VSHL
+#undef VSET1
+#undef VLOAD
+#undef VSTORE
+
+#define VADD(x, y)	_mm256_add_epi32(x, y)
+#define VXOR(x, y)	_mm256_xor_si256(x, y)
+#define VAND(x, y)	_mm256_and_si256(x, y)
+#define VOR(x, y)	_mm256_or_si256(x, y)
+#define VANDNOT(x, y)	_mm256_andnot_si256(x, y)
+#define VSHR(x, n)	_mm256_srli_epi32(x, n)
+#define VSHL(x, n)	_mm256_slli_epi32(x, n)
+#define VSET1(x)	_mm256_set1_epi32(x)
+#define VLOAD(p)	_mm256_loadu_si256((const __m256i *)(p))
+#define VSTORE(p, x)	_mm256_storeu_si256((__m256i *)(p), x)
+
+__attribute__((target("avx2")))
+static void sha256_transform_avx2(uint32_t * const *state,
+				  const unsigned char * const *block, int n)
+{
+	__m256i s[8], w[64];
+
+	MB_LOAD(8, VLOAD, s, w, state, block, n);
+	MB_COMPRESS(__m256i, s, w);
+	MB_STORE(8, VSTORE, s, state, n);
+}
+
+#undef VADD
+#undef VXOR
+#undef VAND
+#undef VOR
+#undef VANDNOT
+#undef VSHR
+#undef VSHL
+#undef VSET1
+#undef VLOAD
+#undef VSTORE
+
+/* Four rounds with the SHA extensions, also advancing the message schedule
+ * held in m0..m3 where m0 is the current group of 4 words. */
+#define SHANI_ROUNDS(g, m0, m1, m2, m3) do {				\
+	msg = _mm_add_epi32(m0, _mm_loadu_si128((const __m128i *)&sha256_k[(g) * 4])); \
+	state1 = _mm_sha256rnds2_epu32(state1, state0, msg);		\
+	if ((g) >= 3 && (g) <= 14) {					\
+		tmp = _mm_alignr_epi8(m0, m3, 4);			\
+		m1 = _mm_add_epi32(m1, tmp);				\
+		m1 = _mm_sha256msg2_epu32(m1, m0);			\
+	}								\
+	msg = _mm_shuffle_epi32(msg, 0x0E);				\
+	state0 = _mm_sha256rnds2_epu32(state0, state1, msg);		\
+	if ((g) >= 1 && (g) <= 12)					\
+		m3 = _mm_sha256msg1_epu32(m3, m0);			\
+} while (0)
+
+__attribute__((target("sha,sse4.1")))
+static void sha256_transform_shani(uint32_t * const *state,
+				   const unsigned char * const *block, int n)
+{
+	const __m128i mask = _mm_set_epi64x(0x0c0d0e0f08090a0bULL, 0x0405060700010203ULL);
+	__m128i state0, state1, abef, cdgh, msg, tmp, m0, m1, m2, m3;
+	int i;
+
+	for (i = 0; i < n; i++) {
+		const unsigned char *data = block[i];
+
+		tmp = _mm_loadu_si128((const __m128i *)&state[i][0]);
+		state1 = _mm_loadu_si128((const __m128i *)&state[i][4]);
+		tmp = _mm_shuffle_epi32(tmp, 0xB1);		/* CDAB */
+		state1 = _mm_shuffle_epi32(state1, 0x1B);	/* EFGH */
+		state0 = _mm_alignr_epi8(tmp, state1, 8);	/* ABEF */
+		state1 = _mm_blend_epi16(state1, tmp, 0xF0);	/* CDGH */
+		abef = state0;
+		cdgh = state1;
+
+		m0 = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)(data + 0)), mask);
+		m1 = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)(data + 16)), mask);
+		m2 = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)(data + 32)), mask);
+		m3 = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)(data + 48)), mask);
+
+		SHANI_ROUNDS(0, m0, m1, m2, m3);
+		SHANI_ROUNDS(1, m1, m2, m3, m0);
+		SHANI_ROUNDS(2, m2, m3, m0, m1);
+		SHANI_ROUNDS(3, m3, m0, m1, m2);
+		SHANI_ROUNDS(4, m0, m1, m2, m3);
+		SHANI_ROUNDS(5, m1, m2, m3, m0);
+		SHANI_ROUNDS(6, m2, m3, m0, m1);
+		SHANI_ROUNDS(7, m3, m0, m1, m2);
+		SHANI_ROUNDS(8, m0, m1, m2, m3);
+		SHANI_ROUNDS(9, m1, m2, m3, m0);
+		SHANI_ROUNDS(10, m2, m3, m0, m1);
+		SHANI_ROUNDS(11, m3, m0, m1, m2);
+		SHANI_ROUNDS(12, m0, m1, m2, m3);
+		SHANI_ROUNDS(13, m1, m2, m3, m0);
+		SHANI_ROUNDS(14, m2, m3, m0, m1);
+		SHANI_ROUNDS(15, m3, m0, m1, m2);
+
+		state0 = _mm_add_epi32(state0, abef);
+		state1 = _mm_add_epi32(state1, cdgh);
+
+		tmp = _mm_shuffle_epi32(state0, 0x1B);		/* FEBA */
+		state1 = _mm_shuffle_epi32(state1, 0xB1);	/* DCHG */
+		state0 = _mm_blend_epi16(tmp, state1, 0xF0);	/* DCBA */
+		state1 = _mm_alignr_epi8(state1, tmp, 8);	/* HGFE */
+		_mm_storeu_si128((__m128i *)&state[i][0], state0);
+		_mm_storeu_si128((__m128i *)&state[i][4], state1);
+	}
+}
+
+static const struct sha256_impl sha256_impl_shani = {
+	.name = "sha-ni",
+	.lanes = 1,
+	.usable = sha256_usable_shani,
+	.transform = sha256_transform_shani,
+};
+
+static const struct sha256_impl sha256_impl_avx2 = {
+	.name = "avx2",
+	.lanes = 8,
+	.usable = sha256_usable_avx2,
+	.transform = sha256_transform_avx2,
+};
+
+static const struct sha256_impl sha256_impl_sse4 = {
+	.name = "sse4",
+	.lanes = 4,
+	.usable = sha256_usable_sse4,
+	.transform = sha256_transform_sse4,
+};
+#endif /* SHA256_X86 */
+
+#ifdef SHA256_NEON
+static bool sha256_usable_neon(void)
+{
+	/* Advanced SIMD is mandatory on aarch64 */
+	return true;
+}
+
+#define VADD(x, y)	vaddq_u32(x, y)
+#define VXOR(x, y)	veorq_u32(x, y)
+#define VAND(x, y)	vandq_u32(x, y)
+#define VOR(x, y)	vorrq_u32(x, y)
+#define VANDNOT(x, y)	vbicq_u32(y, x)
+#define VSHR(x, n)	vshrq_n_u32(x, n)
+#define VSHL(x, n)	vshlq_n_u32(x, n)
+#define VSET1(x)	vdupq_n_u32(x)
+#define VLOAD(p)	vld1q_u32(p)
+#define VSTORE(p, x)	vst1q_u32(p, x)
+
+static void sha256_transform_neon(uint32_t * const *state,
+				  const unsigned char * const *block, int n)
+{
+	uint32x4_t s[8], w[64];
+
+	MB_LOAD(4, VLOAD, s, w, state, block, n);
+	MB_COMPRESS(uint32x4_t, s, w);
+	MB_STORE(4, VSTORE, s, state, n);
+}
+
+#undef VADD
+#undef VXOR
+#undef VAND
+#undef VOR
+#undef VANDNOT
+#undef VSHR
+#undef VSHL
+#undef VSET1
+#undef VLOAD
+#undef VSTORE
+
+static const struct sha256_impl sha256_impl_neon = {
+	.name = "neon",
+	.lanes = 4,
+	.usable = sha256_usable_neon,
+	.transform = sha256_transform_neon,
+};
+
+#ifdef SHA256_ARMV8
+static bool sha256_usable_armv8(void)
+{
+#if defined(__linux) && defined(HWCAP_SHA2)
+	return !!(getauxval(AT_HWCAP) & HWCAP_SHA2);
+#else
+	/* Built for a cpu with the crypto extensions */
+	return true;
+#endif
+}
+
+static void sha256_transform_armv8(uint32_t * const *state,
+				   const unsigned char * const *block, int n)
+{
+	uint32x4_t state0, state1, abef, cdgh, msg[4], wk, tmp;
+	int i, g;
+
+	for (i = 0; i < n; i++) {
+		state0 = vld1q_u32(&state[i][0]);
+		state1 = vld1q_u32(&state[i][4]);
+		abef = state0;
+		cdgh = state1;
+
+		for (g = 0; g < 4; g++)
+			msg[g] = vreinterpretq_u32_u8(vrev32q_u8(vld1q_u8(block[i] + g * 16)));
+
+		for (g = 0; g < 16; g++) {
+			wk = vaddq_u32(msg[g & 3], vld1q_u32(&sha256_k[g * 4]));
+			if (g < 12) {
+				msg[g & 3] = vsha256su0q_u32(msg[g & 3], msg[(g + 1) & 3]);
+				msg[g & 3] = vsha256su1q_u32(msg[g & 3], msg[(g + 2) & 3],
+							     msg[(g + 3) & 3]);
+			}
+			tmp = state0;
+			state0 = vsha256hq_u32(state0, state1, wk);
+			state1 = vsha256h2q_u32(state1, tmp, wk);
+		}
+
+		vst1q_u32(&state[i][0], vaddq_u32(state0, abef));
+		vst1q_u32(&state[i][4], vaddq_u32(state1, cdgh));
+	}
+}
+
+static const struct sha256_impl sha256_impl_armv8 = {
+	.name = "armv8",
+	.lanes = 1,
+	.usable = sha256_usable_armv8,
+	.transform = sha256_transform_armv8,
+};
+#endif /* SHA256_ARMV8 */
+#endif /* SHA256_NEON */
+
+/* In order of preference. The first usable single lane entry is used for lone
+ * buffers, the first usable entry of any width for batches. */
+const struct sha256_impl *sha256_simd_impls[] = {
+#ifdef SHA256_X86
+	&sha256_impl_shani,
+	&sha256_impl_avx2,
+	&sha256_impl_sse4,
+#endif
+#ifdef SHA256_ARMV8
+	&sha256_impl_armv8,
+#endif
+#ifdef SHA256_NEON
+	&sha256_impl_neon,
+#endif
+	NULL
+};
@@ -82,8 +82,8 @@ uint32_t sha256_k[64] =
 
 /* SHA-256 functions */
 
-void sha256_transf(sha256_ctx *ctx, const unsigned char *message,
-                   unsigned int block_nb)
+static void sha256_transf_state(uint32_t *h, const unsigned char *message,
+                                unsigned int block_nb)
 {
     uint32_t w[64];
     uint32_t wv[8];
@@ -105,7 +105,7 @@ void sha256_transf(sha256_ctx *ctx, const unsigned char *message,
         }
 
         for (j = 0; j < 8; j++) {
-            wv[j] = ctx->h[j];
+            wv[j] = h[j];
         }
 
         for (j = 0; j < 64; j++) {
@@ -123,11 +123,17 @@ void sha256_transf(sha256_ctx *ctx, const unsigned char *message,
         }
 
         for (j = 0; j < 8; j++) {
-            ctx->h[j] += wv[j];
+            h[j] += wv[j];
         }
     }
 }
 
+void sha256_transf(sha256_ctx *ctx, const unsigned char *message,
+                   unsigned int block_nb)
+{
+    sha256_transf_state(ctx->h, message, block_nb);
+}
+
 void sha256(const unsigned char *message, unsigned int len, unsigned char *digest)
 {
     sha256_ctx ctx;
@@ -206,3 +212,290 @@ void sha256_final(sha256_ctx *ctx, unsigned char *digest)
         UNPACK32(ctx->h[i], &digest[i << 2]);
     }
 }
+
+/* Dispatched multi-buffer functions */
+
+static void sha256_transform_ref(uint32_t * const *state,
+                                 const unsigned char * const *block, int n)
+{
+    int i;
+
+    for (i = 0; i < n; i++)
+        sha256_transf_state(state[i], block[i], 1);
+}
+
+static bool sha256_usable_ref(void)
+{
+    return true;
+}
+
+static const struct sha256_impl sha256_impl_ref = {
+    .name = "reference",
+    .lanes = 1,
+    .usable = sha256_usable_ref,
+    .transform = sha256_transform_ref,
+};
+
+/* The single impl is used for lone buffers (coinbase, merkle branches), the
+ * multi impl, the usable one with the most lanes, whenever more than one
+ * buffer is available. They differ on cpus with both SHA instructions and
+ * wide SIMD. */
+static const struct sha256_impl *sha256_single = &sha256_impl_ref;
+static const struct sha256_impl *sha256_multi = &sha256_impl_ref;
+static char sha256_name[64];
+static pthread_once_t sha256_once = PTHREAD_ONCE_INIT;
+
+static void sha256_select_impl(void)
+{
+    const struct sha256_impl **impl;
+
+    /* sha256_simd_impls is ordered by preference, which breaks ties in
+     * lanes for the multi impl */
+    for (impl = sha256_simd_impls; *impl; impl++) {
+        if (!(*impl)->usable())
+            continue;
+        if (sha256_single == &sha256_impl_ref && (*impl)->lanes == 1)
+            sha256_single = *impl;
+        if (sha256_multi == &sha256_impl_ref || (*impl)->lanes > sha256_multi->lanes)
+            sha256_multi = *impl;
+    }
+    if (sha256_single == sha256_multi)
+        snprintf(sha256_name, sizeof(sha256_name), "%s", sha256_single->name);
+    else
+        snprintf(sha256_name, sizeof(sha256_name), "%s/%s",
+                 sha256_single->name, sha256_multi->name);
+}
+
+const char *sha256_impl_name(void)
+{
+    pthread_once(&sha256_once, sha256_select_impl);
+    return sha256_name;
+}
+
+void sha256_transform_mb(uint32_t * const *state,
+                         const unsigned char * const *block, int n)
+{
+    const struct sha256_impl *impl;
+    int i, lanes;
+
+    pthread_once(&sha256_once, sha256_select_impl);
+    impl = n > 1 ? sha256_multi : sha256_single;
+    for (i = 0; i < n; i += lanes) {
+        lanes = n - i < impl->lanes ? n - i : impl->lanes;
+        impl->transform(state + i, block + i, lanes);
+    }
+}
+
+void sha256_midstate_mb(uint32_t * const *state,
+                        const unsigned char * const *block, int n)
+{
+    int i;
+
+    for (i = 0; i < n; i++)
+        memcpy(state[i], sha256_h0, sizeof(sha256_h0));
+    sha256_transform_mb(state, block, n);
+}
+
+/* Double sha256 of n messages of the same length, all continuing on from the
+ * state midstate left after hashing a common prefix_len bytes, which must be
+ * a multiple of the block size. */
+void sha256d_resume_mb(const uint32_t *midstate, unsigned int prefix_len,
+                       const unsigned char * const *message, unsigned int len,
+                       unsigned char * const *digest, int n)
+{
+    unsigned char pad[SHA256_MAX_LANES][2 * SHA256_BLOCK_SIZE];
+    uint32_t h[SHA256_MAX_LANES][8], *state[SHA256_MAX_LANES];
+    const unsigned char *block[SHA256_MAX_LANES];
+    unsigned int block_nb, rem_len, pad_nb, b;
+    int i, j, lanes;
+
+    block_nb = len / SHA256_BLOCK_SIZE;
+    rem_len = len % SHA256_BLOCK_SIZE;
+    pad_nb = 1 + ((SHA256_BLOCK_SIZE - 9) < rem_len);
+
+    for (lanes = 0; n > 0; message += lanes, digest += lanes, n -= lanes) {
+        lanes = n < SHA256_MAX_LANES ? n : SHA256_MAX_LANES;
+
+        for (i = 0; i < lanes; i++) {
+            memcpy(h[i], midstate, sizeof(h[i]));
+            state[i] = h[i];
+        }
+
+        for (b = 0; b < block_nb; b++) {
+            for (i = 0; i < lanes; i++)
+                block[i] = message[i] + (b << 6);
+            sha256_transform_mb(state, block, lanes);
+        }
+
+        for (i = 0; i < lanes; i++) {
+            memset(pad[i], 0, pad_nb << 6);
+            memcpy(pad[i], message[i] + (block_nb << 6), rem_len);
+            pad[i][rem_len] = 0x80;
+            UNPACK32((prefix_len + len) << 3, pad[i] + (pad_nb << 6) - 4);
+        }
+        for (b = 0; b < pad_nb; b++) {
+            for (i = 0; i < lanes; i++)
+                block[i] = pad[i] + (b << 6);
+            sha256_transform_mb(state, block, lanes);
+        }
+
+        /* Second pass over the 32 byte first digest */
+        for (i = 0; i < lanes; i++) {
+            memset(pad[i], 0, SHA256_BLOCK_SIZE);
+            for (j = 0; j < 8; j++)
+                UNPACK32(h[i][j], &pad[i][j << 2]);
+            pad[i][SHA256_DIGEST_SIZE] = 0x80;
+            UNPACK32(SHA256_DIGEST_SIZE << 3, pad[i] + SHA256_BLOCK_SIZE - 4);
+            memcpy(h[i], sha256_h0, sizeof(sha256_h0));
+            block[i] = pad[i];
+        }
+        sha256_transform_mb(state, block, lanes);
+
+        for (i = 0; i < lanes; i++) {
+            for (j = 0; j < 8; j++)
+                UNPACK32(h[i][j], &digest[i][j << 2]);
+        }
+    }
+}
+
+/* Double sha256 of n messages of the same length */
+void sha256d_mb(const unsigned char * const *message, unsigned int len,
+                unsigned char * const *digest, int n)
+{
+    sha256d_resume_mb(sha256_h0, 0, message, len, digest, n);
+}
+
+void sha256d(const unsigned char *message, unsigned int len, unsigned char *digest)
+{
+    sha256d_mb(&message, len, &digest, 1);
+}
+
+/* Scalar second half of sha256d_midstate_tail, leaving out the last three
+ * rounds of the final block when they can't make the top word zero. */
+static bool sha256d_tail_ref(uint32_t *h, const unsigned char *block,
+                             unsigned char *digest)
+{
+    uint32_t w[64];
+    uint32_t wv[8];
+    uint32_t t1, t2;
+    int j;
+
+    sha256_transf_state(h, block, 1);
+
+    for (j = 0; j < 8; j++)
+        w[j] = h[j];
+    w[8] = 0x80000000;
+    for (j = 9; j < 15; j++)
+        w[j] = 0;
+    w[15] = SHA256_DIGEST_SIZE << 3;
+    for (j = 16; j < 64; j++)
+        SHA256_SCR(j);
+
+    for (j = 0; j < 8; j++)
+        wv[j] = sha256_h0[j];
+
+    for (j = 0; j < 64; j++) {
+        /* After round 60 the e register is all that h[7] still needs */
+        if (j == 61 && sha256_h0[7] + wv[4] != 0) {
+            UNPACK32(sha256_h0[7] + wv[4], &digest[7 << 2]);
+            return false;
+        }
+        t1 = wv[7] + SHA256_F2(wv[4]) + CH(wv[4], wv[5], wv[6])
+            + sha256_k[j] + w[j];
+        t2 = SHA256_F1(wv[0]) + MAJ(wv[0], wv[1], wv[2]);
+        wv[7] = wv[6];
+        wv[6] = wv[5];
+        wv[5] = wv[4];
+        wv[4] = wv[3] + t1;
+        wv[3] = wv[2];
+        wv[2] = wv[1];
+        wv[1] = wv[0];
+        wv[0] = t1 + t2;
+    }
+
+    for (j = 0; j < 8; j++)
+        UNPACK32(sha256_h0[j] + wv[j], &digest[j << 2]);
+    return true;
+}
+
+/* Finish the double sha256 of an 80 byte block header from the state after
+ * its first 64 bytes (midstate) and its last 16 bytes (tail), skipping the
+ * first block entirely. Returns true if the top 32 bits of the digest are
+ * zero. When they are not the rest of the digest may be left unwritten. */
+bool sha256d_midstate_tail(const uint32_t *midstate, const unsigned char *tail,
+                           unsigned char *digest)
+{
+    unsigned char block[2][SHA256_BLOCK_SIZE];
+    uint32_t h[8], *state = h;
+    const unsigned char *bp;
+    int j;
+
+    pthread_once(&sha256_once, sha256_select_impl);
+
+    memcpy(h, midstate, sizeof(h));
+    memcpy(block[0], tail, 16);
+    memset(block[0] + 16, 0, SHA256_BLOCK_SIZE - 16);
+    block[0][16] = 0x80;
+    UNPACK32(80 << 3, block[0] + SHA256_BLOCK_SIZE - 4);
+
+    if (sha256_single == &sha256_impl_ref)
+        return sha256d_tail_ref(h, block[0], digest);
+
+    /* With a hardware transform the whole final block costs less than
+     * the scalar rounds it would save */
+    bp = block[0];
+    sha256_single->transform(&state, &bp, 1);
+    memset(block[1], 0, SHA256_BLOCK_SIZE);
+    for (j = 0; j < 8; j++)
+        UNPACK32(h[j], &block[1][j << 2]);
+    block[1][SHA256_DIGEST_SIZE] = 0x80;
+    UNPACK32(SHA256_DIGEST_SIZE << 3, block[1] + SHA256_BLOCK_SIZE - 4);
+    memcpy(h, sha256_h0, sizeof(h));
+    bp = block[1];
+    sha256_single->transform(&state, &bp, 1);
+    for (j = 0; j < 8; j++)
+        UNPACK32(h[j], &digest[j << 2]);
+    return h[7] == 0;
+}
+
+/* As sha256d_midstate_tail for n headers sharing the same first 64 bytes,
+ * eg. several nonces found on one work item. Full digests are returned. */
+void sha256d_midstate_tail_mb(const uint32_t *midstate,
+                              const unsigned char * const *tail,
+                              unsigned char * const *digest, int n)
+{
+    unsigned char block[SHA256_MAX_LANES][SHA256_BLOCK_SIZE];
+    uint32_t h[SHA256_MAX_LANES][8], *state[SHA256_MAX_LANES];
+    const unsigned char *bp[SHA256_MAX_LANES];
+    int i, j, lanes;
+
+    for (lanes = 0; n > 0; tail += lanes, digest += lanes, n -= lanes) {
+        lanes = n < SHA256_MAX_LANES ? n : SHA256_MAX_LANES;
+
+        for (i = 0; i < lanes; i++) {
+            memcpy(h[i], midstate, sizeof(h[i]));
+            state[i] = h[i];
+            memcpy(block[i], tail[i], 16);
+            memset(block[i] + 16, 0, SHA256_BLOCK_SIZE - 16);
+            block[i][16] = 0x80;
+            UNPACK32(80 << 3, block[i] + SHA256_BLOCK_SIZE - 4);
+            bp[i] = block[i];
+        }
+        sha256_transform_mb(state, bp, lanes);
+
+        for (i = 0; i < lanes; i++) {
+            memset(block[i], 0, SHA256_BLOCK_SIZE);
+            for (j = 0; j < 8; j++)
+                UNPACK32(h[i][j], &block[i][j << 2]);
+            block[i][SHA256_DIGEST_SIZE] = 0x80;
+            UNPACK32(SHA256_DIGEST_SIZE << 3, block[i] + SHA256_BLOCK_SIZE - 4);
+            memcpy(h[i], sha256_h0, sizeof(sha256_h0));
+        }
+        sha256_transform_mb(state, bp, lanes);
+
+        for (i = 0; i < lanes; i++) {
+            for (j = 0; j < 8; j++)
+                UNPACK32(h[i][j], &digest[i][j << 2]);
+        }
+    }
+}
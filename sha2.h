@@ -67,4 +67,42 @@ void sha256_final(sha256_ctx *ctx, unsigned char *digest);
 void sha256(const unsigned char *message, unsigned int len,
             unsigned char *digest);
 
+/* Runtime dispatched SHA256 used on the hot paths (nonce checking, merkle
+ * and midstate generation). The scalar code above is the reference and the
+ * fallback when the running cpu has no faster implementation.
+ *
+ * The _mb variants process up to n independent buffers at once, splitting
+ * them over as many SIMD lanes as the selected backend has. State and
+ * digest pointers must not alias each other. */
+#define SHA256_MAX_LANES 8
+
+struct sha256_impl {
+    const char *name;
+    int lanes;
+    bool (*usable)(void);
+    /* Compress one 64 byte block into each of n <= lanes states */
+    void (*transform)(uint32_t * const *state, const unsigned char * const *block,
+                      int n);
+};
+
+extern const struct sha256_impl *sha256_simd_impls[];
+
+const char *sha256_impl_name(void);
+void sha256_transform_mb(uint32_t * const *state,
+                         const unsigned char * const *block, int n);
+void sha256_midstate_mb(uint32_t * const *state,
+                        const unsigned char * const *block, int n);
+void sha256d_resume_mb(const uint32_t *midstate, unsigned int prefix_len,
+                       const unsigned char * const *message, unsigned int len,
+                       unsigned char * const *digest, int n);
+void sha256d_mb(const unsigned char * const *message, unsigned int len,
+                unsigned char * const *digest, int n);
+void sha256d(const unsigned char *message, unsigned int len,
+             unsigned char *digest);
+bool sha256d_midstate_tail(const uint32_t *midstate, const unsigned char *tail,
+                           unsigned char *digest);
+void sha256d_midstate_tail_mb(const uint32_t *midstate,
+                              const unsigned char * const *tail,
+                              unsigned char * const *digest, int n);
+
 #endif /* !SHA2_H */
@@ -0,0 +1,42 @@
+/*
+ * Binary share log record layout, shared by cgminer --sharelog-binary
+ * and the sharelog2csv converter
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 3 of the License, or (at your option)
+ * any later version.  See COPYING for more details.
+ */
+
+#ifndef SHARELOG_H
+#define SHARELOG_H
+
+/*
+ * Each record is, with all integers little endian:
+ *
+ *	u8	SHARELOG_MAGIC
+ *	u8	SHARELOG_VERSION
+ *	u16	length of the rest of the record
+ *	u64	timestamp (seconds)
+ *	u32	device id
+ *	u32	thread id
+ *	u8[32]	target
+ *	u8[32]	share hash
+ *	u8[128]	share data
+ *	u8	disposition length, then the disposition
+ *	u8	driver name length, then the driver name
+ *	u16	pool url length, then the pool url
+ */
+#define SHARELOG_MAGIC 0xC5
+#define SHARELOG_VERSION 1
+
+#define SHARELOG_HEAD 4
+#define SHARELOG_TARGET 32
+#define SHARELOG_HASH 32
+#define SHARELOG_DATA 128
+#define SHARELOG_FIXED (8 + 4 + 4 + SHARELOG_TARGET + SHARELOG_HASH + SHARELOG_DATA)
+
+// Largest possible record
+#define SHARELOG_MAX (SHARELOG_HEAD + SHARELOG_FIXED + 1 + 255 + 1 + 255 + 2 + 65535)
+
+#endif /* SHARELOG_H */
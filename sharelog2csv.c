@@ -0,0 +1,120 @@
+/*
+ * Convert a cgminer --sharelog-binary file to the --sharelog CSV layout:
+ *	timestamp,disposition,target,pool,dev,thr,sharehash,sharedata
+ *
+ * Build with: cc -o sharelog2csv sharelog2csv.c
+ * Usage: sharelog2csv [share.bin] > share.log
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 3 of the License, or (at your option)
+ * any later version.  See COPYING for more details.
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "sharelog.h"
+
+static unsigned char rec[SHARELOG_MAX];
+
+static uint16_t le16(const unsigned char *p)
+{
+	return (uint16_t)(p[0] | (p[1] << 8));
+}
+
+static uint32_t le32(const unsigned char *p)
+{
+	return (uint32_t)p[0] | ((uint32_t)p[1] << 8) | ((uint32_t)p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+static uint64_t le64(const unsigned char *p)
+{
+	return (uint64_t)le32(p) | ((uint64_t)le32(p + 4) << 32);
+}
+
+static void hexout(const unsigned char *p, size_t len)
+{
+	static const char hex[] = "0123456789abcdef";
+
+	while (len--) {
+		putchar(hex[*p >> 4]);
+		putchar(hex[*(p++) & 0xf]);
+	}
+}
+
+int main(int argc, char **argv)
+{
+	const unsigned char *ptr, *end, *target, *hash, *data;
+	const char *disposition, *drv, *url;
+	int displen, drvlen, urllen;
+	unsigned long int t;
+	uint32_t dev, thr;
+	unsigned long count = 0;
+	size_t len;
+	FILE *f = stdin;
+
+	if (argc > 2 || (argc == 2 && !strcmp(argv[1], "-h"))) {
+		fprintf(stderr, "Usage: %s [sharelog-binary-file]\n", argv[0]);
+		return 1;
+	}
+	if (argc == 2 && !(f = fopen(argv[1], "rb"))) {
+		perror(argv[1]);
+		return 1;
+	}
+
+	while (fread(rec, SHARELOG_HEAD, 1, f) == 1) {
+		if (rec[0] != SHARELOG_MAGIC || rec[1] != SHARELOG_VERSION) {
+			fprintf(stderr, "Bad record header after %lu records\n", count);
+			return 1;
+		}
+		len = le16(rec + 2);
+		if (len < SHARELOG_FIXED + 4 || fread(rec, len, 1, f) != 1) {
+			fprintf(stderr, "Truncated record after %lu records\n", count);
+			return 1;
+		}
+
+		ptr = rec;
+		end = rec + len;
+		t = (unsigned long int)le64(ptr);
+		dev = le32(ptr + 8);
+		thr = le32(ptr + 12);
+		ptr += 16;
+		target = ptr;
+		ptr += SHARELOG_TARGET;
+		hash = ptr;
+		ptr += SHARELOG_HASH;
+		data = ptr;
+		ptr += SHARELOG_DATA;
+
+		displen = *(ptr++);
+		disposition = (const char *)ptr;
+		ptr += displen;
+		if (ptr >= end)
+			goto bad;
+		drvlen = *(ptr++);
+		drv = (const char *)ptr;
+		ptr += drvlen;
+		if (ptr + 2 > end)
+			goto bad;
+		urllen = le16(ptr);
+		url = (const char *)ptr + 2;
+		if (ptr + 2 + urllen != end)
+			goto bad;
+
+		printf("%lu,%.*s,", t, displen, disposition);
+		hexout(target, SHARELOG_TARGET);
+		printf(",%.*s,%.*s%u,%u,", urllen, url, drvlen, drv, (unsigned int)dev, (unsigned int)thr);
+		hexout(hash, SHARELOG_HASH);
+		putchar(',');
+		hexout(data, SHARELOG_DATA);
+		putchar('\n');
+		count++;
+	}
+
+	return 0;
+bad:
+	fprintf(stderr, "Corrupt record %lu\n", count);
+	return 1;
+}
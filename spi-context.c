@@ -92,3 +92,70 @@ extern bool spi_transfer(struct spi_ctx *ctx, uint8_t *txbuf,
 
 	return ret > 0;
 }
+
+extern void spi_batch_init(struct spi_batch *batch, struct spi_ctx *ctx)
+{
+	batch->ctx = ctx;
+	batch->count = 0;
+	batch->len = 0;
+	batch->failed = false;
+}
+
+static void spi_batch_flush(struct spi_batch *batch)
+{
+	int ret;
+
+	if (batch->count == 0)
+		return;
+
+	/* always release chip select at the end of the message */
+	batch->xfr[batch->count - 1].cs_change = 0;
+
+	ret = ioctl(batch->ctx->fd, SPI_IOC_MESSAGE(batch->count), batch->xfr);
+	if (ret < 1) {
+		applog(LOG_ERR, "SPI: ioctl error on SPI device: %d (%d transfers)",
+		       ret, batch->count);
+		batch->failed = true;
+	}
+	batch->count = 0;
+	batch->len = 0;
+}
+
+extern void spi_batch_add(struct spi_batch *batch, uint8_t *txbuf,
+			  uint8_t *rxbuf, int len, bool cs_change,
+			  uint16_t delay)
+{
+	struct spi_ioc_transfer *xfr;
+
+	if (len <= 0)
+		return;
+
+	if (batch->count == SPI_BATCH_MAX_SEGMENTS ||
+	    batch->len + len > SPI_BATCH_MAX_LEN)
+		spi_batch_flush(batch);
+
+	if (rxbuf != NULL)
+		memset(rxbuf, 0xff, len);
+
+	xfr = &batch->xfr[batch->count++];
+	memset(xfr, 0, sizeof(*xfr));
+	xfr->tx_buf = (unsigned long)txbuf;
+	xfr->rx_buf = (unsigned long)rxbuf;
+	xfr->len = len;
+	xfr->speed_hz = batch->ctx->config.speed;
+	xfr->delay_usecs = delay;
+	xfr->bits_per_word = batch->ctx->config.bits;
+	xfr->cs_change = cs_change;
+	batch->len += len;
+}
+
+extern bool spi_batch_submit(struct spi_batch *batch)
+{
+	bool ret;
+
+	spi_batch_flush(batch);
+	ret = !batch->failed;
+	batch->failed = false;
+
+	return ret;
+}
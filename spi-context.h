@@ -37,6 +37,23 @@ struct spi_ctx {
 	struct spi_config config;
 };
 
+/*
+ * A batch queues many transfers and submits them to spidev as few
+ * SPI_IOC_MESSAGE(n) calls as possible. spidev rejects messages longer in
+ * total than its bufsiz module parameter (4096 by default), so a batch is
+ * split into several messages when it grows beyond SPI_BATCH_MAX_LEN.
+ */
+#define SPI_BATCH_MAX_SEGMENTS		128
+#define SPI_BATCH_MAX_LEN		4096
+
+struct spi_batch {
+	struct spi_ctx *ctx;
+	int count;
+	int len;
+	bool failed;
+	struct spi_ioc_transfer xfr[SPI_BATCH_MAX_SEGMENTS];
+};
+
 /* create SPI context with given configuration, returns NULL on failure */
 extern struct spi_ctx *spi_init(struct spi_config *config);
 /* close descriptor and free resources */
@@ -45,4 +62,17 @@ extern void spi_exit(struct spi_ctx *ctx);
 extern bool spi_transfer(struct spi_ctx *ctx, uint8_t *txbuf,
 			 uint8_t *rxbuf, int len);
 
+/* start an empty batch on given context */
+extern void spi_batch_init(struct spi_batch *batch, struct spi_ctx *ctx);
+/*
+ * queue RX/TX transfer, buffers must stay valid until the batch is submitted;
+ * cs_change releases chip select after this transfer like separate calls to
+ * spi_transfer() would, delay is applied after it in usecs
+ */
+extern void spi_batch_add(struct spi_batch *batch, uint8_t *txbuf,
+			  uint8_t *rxbuf, int len, bool cs_change,
+			  uint16_t delay);
+/* process all queued transfers, returns false if any of them failed */
+extern bool spi_batch_submit(struct spi_batch *batch);
+
 #endif /* SPI_CONTEXT_H */
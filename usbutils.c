@@ -1975,6 +1975,8 @@ static struct cg_usb_device *free_cgusb(struct cg_usb_device *cgusb)
 	return NULL;
 }
 
+static void usb_streams_free(struct cg_usb_device *usbdev);
+
 static void _usb_uninit(struct cgpu_info *cgpu)
 {
 	int ifinfo;
@@ -1988,6 +1990,7 @@ static void _usb_uninit(struct cgpu_info *cgpu)
 			cgpu->drv->name, cgpu->device_id);
 
 	if (cgpu->usbdev->handle) {
+		usb_streams_free(cgpu->usbdev);
 		for (ifinfo = cgpu->usbdev->found->intinfo_count - 1; ifinfo >= 0; ifinfo--) {
 			libusb_release_interface(cgpu->usbdev->handle,
 						 THISIF(cgpu->usbdev->found, ifinfo));
@@ -2966,6 +2969,7 @@ struct usb_transfer {
 	struct libusb_transfer *transfer;
 	bool cancellable;
 	struct list_head list;
+	struct usb_stream *stream;
 };
 
 bool async_usb_transfers(void)
@@ -3010,6 +3014,7 @@ static void init_usb_transfer(struct usb_transfer *ut)
 		quit(1, "Failed to libusb_alloc_transfer");
 	ut->transfer->user_data = ut;
 	ut->cancellable = false;
+	ut->stream = NULL;
 }
 
 static void complete_usb_transfer(struct usb_transfer *ut)
@@ -3106,6 +3111,322 @@ static int usb_submit_transfer(struct usb_transfer *ut, struct libusb_transfer *
 	return err;
 }
 
+/* A usb_stream keeps USB_STREAM_URBS bulk IN transfers permanently in flight
+ * on one endpoint. Completed transfers are copied into the ring by the poll
+ * thread and immediately resubmitted while there is room for another, and
+ * otherwise parked until _usb_read consumes enough of the ring. head and tail
+ * only ever increase and are masked to index the ring. */
+struct usb_stream_urb {
+	struct usb_transfer ut;
+	bool parked;
+	unsigned char buf[USB_STREAM_URBSIZE];
+};
+
+struct usb_stream {
+	struct usb_stream *next;
+	struct cgpu_info *cgpu;
+	int intinfo;
+	int epinfo;
+	unsigned char ep;
+	bool ftdi;
+	int packet;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	uint32_t head;
+	uint32_t tail;
+	int inflight;
+	int err;
+	/* Only set with cgusb_fd_lock held so nothing is resubmitted after */
+	bool stopping;
+	struct usb_stream_urb urbs[USB_STREAM_URBS];
+	unsigned char ring[USB_STREAM_RING];
+};
+
+static pthread_mutex_t usb_streams_lock = PTHREAD_MUTEX_INITIALIZER;
+
+#define STREAM_USED(stream) ((stream)->head - (stream)->tail)
+/* Room for one more transfer on top of every one already in flight */
+#define STREAM_ROOM(stream) (USB_STREAM_RING - STREAM_USED(stream) >= \
+			     (uint32_t)((stream)->inflight + 1) * USB_STREAM_URBSIZE)
+#define STREAM_AT(stream, offset) ((stream)->ring[((stream)->tail + (offset)) & (USB_STREAM_RING - 1)])
+
+/* Must be called with stream->lock held */
+static void usb_stream_submit(struct usb_stream *stream, struct usb_stream_urb *urb)
+{
+	int err = LIBUSB_SUCCESS;
+
+	cg_wlock(&cgusb_fd_lock);
+	if (!stream->stopping) {
+		err = libusb_submit_transfer(urb->ut.transfer);
+		if (likely(!err)) {
+			list_add(&urb->ut.list, &ut_list);
+			stream->inflight++;
+			urb->parked = false;
+		}
+	}
+	cg_wunlock(&cgusb_fd_lock);
+
+	if (unlikely(err)) {
+		urb->parked = true;
+		if (!stream->err)
+			stream->err = err;
+	}
+}
+
+static void usb_stream_put(struct usb_stream *stream, unsigned char *data, int len)
+{
+	uint32_t pos = stream->head & (USB_STREAM_RING - 1);
+	int first = MIN(len, (int)(USB_STREAM_RING - pos));
+
+	cg_memcpy(stream->ring + pos, data, first);
+	if (len > first)
+		cg_memcpy(stream->ring, data + first, len - first);
+	stream->head += len;
+}
+
+static void LIBUSB_CALL usb_stream_callback(struct libusb_transfer *transfer)
+{
+	struct usb_stream_urb *urb = transfer->user_data;
+	struct usb_stream *stream = urb->ut.stream;
+	int err, i, n;
+
+	cg_wlock(&cgusb_fd_lock);
+	list_del(&urb->ut.list);
+	cg_wunlock(&cgusb_fd_lock);
+
+	mutex_lock(&stream->lock);
+	stream->inflight--;
+	urb->parked = true;
+	switch (transfer->status) {
+		case LIBUSB_TRANSFER_COMPLETED:
+			if (!stream->ftdi) {
+				usb_stream_put(stream, transfer->buffer, transfer->actual_length);
+				break;
+			}
+			// first 2 bytes of every packet are an FTDI status
+			for (i = 0; i < transfer->actual_length; i += n) {
+				n = MIN(stream->packet, transfer->actual_length - i);
+				if (n > 2)
+					usb_stream_put(stream, transfer->buffer + i + 2, n - 2);
+			}
+			break;
+		case LIBUSB_TRANSFER_CANCELLED:
+		case LIBUSB_TRANSFER_TIMED_OUT:
+			break;
+		default:
+			err = usb_transfer_toerr(transfer->status);
+			if (!stream->err)
+				stream->err = err;
+			break;
+	}
+	if (!stream->err && STREAM_ROOM(stream))
+		usb_stream_submit(stream, urb);
+	pthread_cond_broadcast(&stream->cond);
+	mutex_unlock(&stream->lock);
+}
+
+/* Called on shutdown so the poll thread can wait on the last callbacks */
+void stop_usb_streams(void)
+{
+	struct usb_transfer *ut;
+	int cancellations = 0;
+
+	cg_wlock(&cgusb_fd_lock);
+	list_for_each_entry(ut, &ut_list, list) {
+		if (ut->stream) {
+			ut->stream->stopping = true;
+			libusb_cancel_transfer(ut->transfer);
+			cancellations++;
+		}
+	}
+	cg_wunlock(&cgusb_fd_lock);
+
+	if (cancellations)
+		applog(LOG_DEBUG, "Cancelled %d USB stream transfers", cancellations);
+}
+
+static void usb_stream_free(struct usb_stream *stream)
+{
+	struct cgpu_info *cgpu = stream->cgpu;
+	struct timespec abstime, tdiff;
+	int i, inflight;
+
+	cg_wlock(&cgusb_fd_lock);
+	stream->stopping = true;
+	for (i = 0; i < USB_STREAM_URBS; i++) {
+		if (!stream->urbs[i].parked)
+			libusb_cancel_transfer(stream->urbs[i].ut.transfer);
+	}
+	cg_wunlock(&cgusb_fd_lock);
+
+	mutex_lock(&stream->lock);
+	cgcond_time(&abstime);
+	ms_to_timespec(&tdiff, 2000);
+	timeraddspec(&abstime, &tdiff);
+	while (stream->inflight) {
+		if (pthread_cond_timedwait(&stream->cond, &stream->lock, &abstime) == ETIMEDOUT)
+			break;
+	}
+	inflight = stream->inflight;
+	mutex_unlock(&stream->lock);
+
+	/* Leak it rather than free memory libusb may still write to */
+	if (unlikely(inflight)) {
+		applog(LOG_WARNING, "%s%i: USB stream stopped with %d transfers in flight",
+		       cgpu->drv->name, cgpu->device_id, inflight);
+		return;
+	}
+
+	for (i = 0; i < USB_STREAM_URBS; i++)
+		libusb_free_transfer(stream->urbs[i].ut.transfer);
+	mutex_destroy(&stream->lock);
+	pthread_cond_destroy(&stream->cond);
+	free(stream);
+}
+
+static void usb_streams_free(struct cg_usb_device *usbdev)
+{
+	struct usb_stream *stream;
+
+	mutex_lock(&usb_streams_lock);
+	while ((stream = usbdev->streams)) {
+		usbdev->streams = stream->next;
+		usb_stream_free(stream);
+	}
+	mutex_unlock(&usb_streams_lock);
+}
+
+/* Resubmit parked transfers there is now room for, with stream->lock held */
+static void usb_stream_refill(struct usb_stream *stream)
+{
+	int i;
+
+	for (i = 0; i < USB_STREAM_URBS && !stream->err; i++) {
+		if (stream->urbs[i].parked && STREAM_ROOM(stream))
+			usb_stream_submit(stream, &stream->urbs[i]);
+	}
+}
+
+/* Clear a stream error once it has been returned and resubmit everything */
+static void usb_stream_restart(struct usb_stream *stream)
+{
+	mutex_lock(&stream->lock);
+	stream->err = LIBUSB_SUCCESS;
+	usb_stream_refill(stream);
+	mutex_unlock(&stream->lock);
+}
+
+/* Find the stream on this endpoint, starting it on the first read */
+static struct usb_stream *usb_stream_get(struct cgpu_info *cgpu, struct cg_usb_device *usbdev,
+					 int intinfo, int epinfo)
+{
+	struct usb_epinfo *usb_epinfo = &(usbdev->found->intinfos[intinfo].epinfos[epinfo]);
+	struct usb_stream *stream;
+	int i;
+
+	mutex_lock(&usb_streams_lock);
+	for (stream = usbdev->streams; stream; stream = stream->next) {
+		if (stream->intinfo == intinfo && stream->epinfo == epinfo)
+			goto out_unlock;
+	}
+
+	stream = cgcalloc(1, sizeof(*stream));
+	stream->cgpu = cgpu;
+	stream->intinfo = intinfo;
+	stream->epinfo = epinfo;
+	stream->ep = usb_epinfo->ep;
+	stream->ftdi = (usbdev->usb_type == USB_TYPE_FTDI);
+	stream->packet = usb_epinfo->wMaxPacketSize ? usb_epinfo->wMaxPacketSize : usb_epinfo->size;
+	mutex_init(&stream->lock);
+	if (unlikely(pthread_cond_init(&stream->cond, NULL)))
+		quit(1, "Failed to pthread_cond_init in usb_stream_get");
+
+	for (i = 0; i < USB_STREAM_URBS; i++) {
+		struct usb_stream_urb *urb = &stream->urbs[i];
+
+		urb->ut.transfer = libusb_alloc_transfer(0);
+		if (unlikely(!urb->ut.transfer))
+			quit(1, "Failed to libusb_alloc_transfer");
+		urb->ut.stream = stream;
+		urb->parked = true;
+		INIT_LIST_HEAD(&urb->ut.list);
+		libusb_fill_bulk_transfer(urb->ut.transfer, usbdev->handle, usb_epinfo->ep,
+					  urb->buf, USB_STREAM_URBSIZE, usb_stream_callback,
+					  urb, 0);
+	}
+
+	mutex_lock(&stream->lock);
+	for (i = 0; i < USB_STREAM_URBS && !stream->err; i++)
+		usb_stream_submit(stream, &stream->urbs[i]);
+	mutex_unlock(&stream->lock);
+
+	applog(LOG_DEBUG, "%s%i: USB stream started on ep 0x%02x with %d transfers",
+	       cgpu->drv->name, cgpu->device_id, usb_epinfo->ep, stream->inflight);
+	stream->next = usbdev->streams;
+	usbdev->streams = stream;
+out_unlock:
+	mutex_unlock(&usb_streams_lock);
+
+	return stream;
+}
+
+/* Wait for a complete message in the ring then copy it out, mirroring the
+ * end/readonce semantics of the direct transfer path of _usb_read */
+static int usb_stream_read(struct usb_stream *stream, char *buf, size_t bufsiz, int *processed,
+			   int timeout, const char *end, int endlen, bool readonce)
+{
+	struct timespec abstime, tdiff;
+	uint32_t used, want, scan = 0, i, j;
+	int err = LIBUSB_SUCCESS;
+
+	cgcond_time(&abstime);
+	ms_to_timespec(&tdiff, timeout);
+	timeraddspec(&abstime, &tdiff);
+
+	mutex_lock(&stream->lock);
+	while (42) {
+		used = STREAM_USED(stream);
+		want = MIN(used, (uint32_t)bufsiz);
+		if (end) {
+			for (i = scan; i + endlen <= want; i++) {
+				for (j = 0; j < (uint32_t)endlen; j++) {
+					if (STREAM_AT(stream, i + j) != (unsigned char)end[j])
+						break;
+				}
+				if (j == (uint32_t)endlen)
+					break;
+			}
+			if (i + endlen <= want) {
+				want = i + endlen;
+				break;
+			}
+			scan = i;
+		}
+		if (want == bufsiz || (readonce && want))
+			break;
+		if (stream->err) {
+			/* Leave anything received for the read after recovery */
+			err = stream->err;
+			want = 0;
+			break;
+		}
+		if (stream->stopping ||
+		    pthread_cond_timedwait(&stream->cond, &stream->lock, &abstime) == ETIMEDOUT) {
+			err = LIBUSB_ERROR_TIMEOUT;
+			break;
+		}
+	}
+
+	for (i = 0; i < want; i++)
+		buf[i] = STREAM_AT(stream, i);
+	stream->tail += want;
+	*processed = want;
+	usb_stream_refill(stream);
+	mutex_unlock(&stream->lock);
+
+	return err;
+}
+
 static int
 usb_perform_transfer(struct cgpu_info *cgpu, struct cg_usb_device *usbdev, int intinfo,
 		  int epinfo, unsigned char *data, int length, int *transferred,
@@ -3255,7 +3576,6 @@ int _usb_read(struct cgpu_info *cgpu, int intinfo, int epinfo, char *buf, size_t
 	double done;
 	bool ftdi;
 
-	memset(usbbuf, 0, USB_READ_BUFSIZE);
 	memset(buf, 0, bufsiz);
 
 	if (end)
@@ -3287,10 +3607,40 @@ int _usb_read(struct cgpu_info *cgpu, int intinfo, int epinfo, char *buf, size_t
 	if (timeout == DEVTIMEOUT)
 		timeout = usbdev->found->timeout;
 
+	/* Bulk reads are served from the stream ring once any data buffered
+	 * by the direct transfer path has been consumed. */
+	if (opt_usb_stream && !usbdev->bufamt &&
+	    usbdev->found->intinfos[intinfo].epinfos[epinfo].att == LIBUSB_TRANSFER_TYPE_BULK) {
+		struct usb_stream *stream = usb_stream_get(cgpu, usbdev, intinfo, epinfo);
+		int err_retries = 0;
+
+		while (42) {
+			err = usb_stream_read(stream, buf, bufsiz, processed, timeout, end, endlen, readonce);
+			USBDEBUG("USB debug: @_usb_read(%s (nodev=%s)) stream err=%d%s got=%d", cgpu->drv->name, bool_str(cgpu->usbinfo.nodev), err, isnodev(err), *processed);
+			if ((err != LIBUSB_ERROR_PIPE && err != LIBUSB_ERROR_IO) ||
+			    ++err_retries >= USB_RETRY_MAX)
+				break;
+			if (err == LIBUSB_ERROR_PIPE) {
+				cgpu->usbinfo.last_pipe = time(NULL);
+				cgpu->usbinfo.pipe_count++;
+				applog(LOG_INFO, "%s%i: libusb pipe error, trying to clear",
+					cgpu->drv->name, cgpu->device_id);
+				if (libusb_clear_halt(usbdev->handle, stream->ep))
+					cgpu->usbinfo.clear_fail_count++;
+			}
+			usb_stream_restart(stream);
+		}
+		if (NODEV(err))
+			applog(LOG_WARNING, "%s %i %s usb stream read err:(%d) %s", cgpu->drv->name,
+			       cgpu->device_id, usb_cmdname(cmd), err, libusb_error_name(err));
+		goto out_noerrmsg;
+	}
+
 	tot = usbdev->bufamt;
 	bufleft = bufsiz - tot;
 	if (tot)
 		cg_memcpy(usbbuf, usbdev->buffer, tot);
+	usbbuf[tot] = '\0';
 	ptr = usbbuf + tot;
 	usbdev->bufamt = 0;
 
@@ -3728,8 +4078,17 @@ void usb_buffer_clear(struct cgpu_info *cgpu)
 
 	DEVWLOCK(cgpu, pstate);
 
-	if (cgpu->usbdev)
+	if (cgpu->usbdev) {
+		struct usb_stream *stream;
+
 		cgpu->usbdev->bufamt = 0;
+		for (stream = cgpu->usbdev->streams; stream; stream = stream->next) {
+			mutex_lock(&stream->lock);
+			stream->tail = stream->head;
+			usb_stream_refill(stream);
+			mutex_unlock(&stream->lock);
+		}
+	}
 
 	DEVWUNLOCK(cgpu, pstate);
 }
@@ -3741,8 +4100,16 @@ uint32_t usb_buffer_size(struct cgpu_info *cgpu)
 
 	DEVRLOCK(cgpu, pstate);
 
-	if (cgpu->usbdev)
+	if (cgpu->usbdev) {
+		struct usb_stream *stream;
+
 		ret = cgpu->usbdev->bufamt;
+		for (stream = cgpu->usbdev->streams; stream; stream = stream->next) {
+			mutex_lock(&stream->lock);
+			ret += STREAM_USED(stream);
+			mutex_unlock(&stream->lock);
+		}
+	}
 
 	DEVRUNLOCK(cgpu, pstate);
 
@@ -217,6 +217,17 @@ enum usb_types {
  */
 #define USB_READ_BUFSIZE (USB_MAX_READ + 4)
 
+/*
+ * With --usb-stream each bulk IN endpoint that is read keeps USB_STREAM_URBS
+ * transfers of USB_STREAM_URBSIZE in flight, feeding a USB_STREAM_RING byte
+ * ring (a power of 2) that _usb_read consumes from
+ */
+#define USB_STREAM_URBS 4
+#define USB_STREAM_URBSIZE 512
+#define USB_STREAM_RING 16384
+
+struct usb_stream;
+
 struct cg_usb_device {
 	struct usb_find_devices *found;
 	libusb_device_handle *handle;
@@ -233,6 +244,7 @@ struct cg_usb_device {
 	char buffer[USB_MAX_READ];
 	uint32_t bufsiz;
 	uint32_t bufamt;
+	struct usb_stream *streams;
 	bool usb11; // USB 1.1 flag for convenience
 	bool tt; // Enable the transaction translator
 };
@@ -489,6 +501,7 @@ struct cgpu_info;
 
 bool async_usb_transfers(void);
 void cancel_usb_transfers(void);
+void stop_usb_streams(void);
 void usb_all(int level);
 void usb_list(void);
 const char *usb_cmdname(enum usb_cmds cmd);
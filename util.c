@@ -44,6 +44,7 @@
 #include "elist.h"
 #include "compat.h"
 #include "util.h"
+#include "sha2.h"
 
 #define DEFAULT_SOCKWAIT 60
 #ifndef STRATUM_USER_AGENT
@@ -562,30 +563,38 @@ c_out:
 	return val;
 }
 
-json_t *json_rpc_call(CURL *curl, const char *url,
-		      const char *userpass, const char *rpc_req,
-		      bool probe, bool longpoll, int *rolltime,
-		      struct pool *pool, bool share)
+/* The state of one JSON-RPC call that has to outlive its setup, so the transfer
+ * itself can be run either by curl_easy_perform or by a curl multi handle */
+struct json_rpc_req {
+	CURL *curl;
+	struct pool *pool;
+	bool probing;
+	struct data_buffer all_data;
+	struct header_info hi;
+	struct curl_slist *headers;
+	struct upload_buffer upload_data;
+	char curl_err_str[CURL_ERROR_SIZE];
+};
+
+/* Set up curl for a JSON-RPC call to url without performing it. rpc_req must
+ * stay valid until json_rpc_result is called. */
+struct json_rpc_req *json_rpc_setup(CURL *curl, const char *url,
+				    const char *userpass, const char *rpc_req,
+				    bool probe, bool longpoll, struct pool *pool,
+				    bool share)
 {
 	long timeout = longpoll ? (60 * 60) : 60;
-	struct data_buffer all_data = {NULL, 0};
-	struct header_info hi = {NULL, 0, NULL, NULL, false, false, false};
 	char len_hdr[64], user_agent_hdr[128];
-	char curl_err_str[CURL_ERROR_SIZE];
-	struct curl_slist *headers = NULL;
-	struct upload_buffer upload_data;
-	json_t *val, *err_val, *res_val;
-	bool probing = false;
-	double byte_count;
-	json_error_t err;
-	int rc;
+	struct json_rpc_req *req;
 
-	memset(&err, 0, sizeof(err));
+	req = cgcalloc(sizeof(struct json_rpc_req), 1);
+	req->curl = curl;
+	req->pool = pool;
 
 	/* it is assumed that 'curl' is freshly [re]initialized at this pt */
 
 	if (probe)
-		probing = !pool->probed;
+		req->probing = !pool->probed;
 	curl_easy_setopt(curl, CURLOPT_TIMEOUT, timeout);
 
 	// CURLOPT_VERBOSE won't write to stderr if we use CURLOPT_DEBUGFUNCTION
@@ -603,13 +612,13 @@ json_t *json_rpc_call(CURL *curl, const char *url,
 	if (!opt_delaynet || share)
 		curl_easy_setopt(curl, CURLOPT_TCP_NODELAY, 1);
 	curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, all_data_cb);
-	curl_easy_setopt(curl, CURLOPT_WRITEDATA, &all_data);
+	curl_easy_setopt(curl, CURLOPT_WRITEDATA, &req->all_data);
 	curl_easy_setopt(curl, CURLOPT_READFUNCTION, upload_data_cb);
-	curl_easy_setopt(curl, CURLOPT_READDATA, &upload_data);
-	curl_easy_setopt(curl, CURLOPT_ERRORBUFFER, curl_err_str);
+	curl_easy_setopt(curl, CURLOPT_READDATA, &req->upload_data);
+	curl_easy_setopt(curl, CURLOPT_ERRORBUFFER, req->curl_err_str);
 	curl_easy_setopt(curl, CURLOPT_FOLLOWLOCATION, 1);
 	curl_easy_setopt(curl, CURLOPT_HEADERFUNCTION, resp_hdr_cb);
-	curl_easy_setopt(curl, CURLOPT_HEADERDATA, &hi);
+	curl_easy_setopt(curl, CURLOPT_HEADERDATA, &req->hi);
 	curl_easy_setopt(curl, CURLOPT_USE_SSL, CURLUSESSL_TRY);
 	if (pool->rpc_proxy) {
 		curl_easy_setopt(curl, CURLOPT_PROXY, pool->rpc_proxy);
@@ -629,29 +638,29 @@ json_t *json_rpc_call(CURL *curl, const char *url,
 	if (opt_protocol)
 		applog(LOG_DEBUG, "JSON protocol request:\n%s", rpc_req);
 
-	upload_data.buf = rpc_req;
-	upload_data.len = strlen(rpc_req);
+	req->upload_data.buf = rpc_req;
+	req->upload_data.len = strlen(rpc_req);
 	sprintf(len_hdr, "Content-Length: %lu",
-		(unsigned long) upload_data.len);
+		(unsigned long) req->upload_data.len);
 	sprintf(user_agent_hdr, "User-Agent: %s", PACKAGE_STRING);
 
-	headers = curl_slist_append(headers,
+	req->headers = curl_slist_append(req->headers,
 		"Content-type: application/json");
-	headers = curl_slist_append(headers,
+	req->headers = curl_slist_append(req->headers,
 		"X-Mining-Extensions: longpoll midstate rollntime submitold");
 
 	if (likely(global_hashrate)) {
 		char ghashrate[255];
 
 		sprintf(ghashrate, "X-Mining-Hashrate: %"PRIu64, global_hashrate);
-		headers = curl_slist_append(headers, ghashrate);
+		req->headers = curl_slist_append(req->headers, ghashrate);
 	}
 
-	headers = curl_slist_append(headers, len_hdr);
-	headers = curl_slist_append(headers, user_agent_hdr);
-	headers = curl_slist_append(headers, "Expect:"); /* disable Expect hdr*/
+	req->headers = curl_slist_append(req->headers, len_hdr);
+	req->headers = curl_slist_append(req->headers, user_agent_hdr);
+	req->headers = curl_slist_append(req->headers, "Expect:"); /* disable Expect hdr*/
 
-	curl_easy_setopt(curl, CURLOPT_HTTPHEADER, headers);
+	curl_easy_setopt(curl, CURLOPT_HTTPHEADER, req->headers);
 
 	if (opt_delaynet) {
 		/* Don't delay share submission, but still track the nettime */
@@ -676,13 +685,28 @@ json_t *json_rpc_call(CURL *curl, const char *url,
 		set_nettime();
 	}
 
-	rc = curl_easy_perform(curl);
+	return req;
+}
+
+/* Decode the reply to a call set up by json_rpc_setup once its transfer has
+ * finished with curl result rc, resetting the curl handle and freeing req */
+json_t *json_rpc_result(struct json_rpc_req *req, int rc, int *rolltime)
+{
+	struct header_info *hi = &req->hi;
+	struct pool *pool = req->pool;
+	CURL *curl = req->curl;
+	json_t *val, *err_val, *res_val;
+	double byte_count;
+	json_error_t err;
+
+	memset(&err, 0, sizeof(err));
+
 	if (rc) {
-		applog(LOG_INFO, "HTTP request failed: %s", curl_err_str);
+		applog(LOG_INFO, "HTTP request failed: %s", req->curl_err_str);
 		goto err_out;
 	}
 
-	if (!all_data.buf) {
+	if (!req->all_data.buf) {
 		applog(LOG_DEBUG, "Empty data received in json_rpc_call.");
 		goto err_out;
 	}
@@ -694,42 +718,42 @@ json_t *json_rpc_call(CURL *curl, const char *url,
 	if (curl_easy_getinfo(curl, CURLINFO_SIZE_DOWNLOAD, &byte_count) == CURLE_OK)
 		pool->cgminer_pool_stats.bytes_received += byte_count;
 
-	if (probing) {
+	if (req->probing) {
 		pool->probed = true;
 		/* If X-Long-Polling was found, activate long polling */
-		if (hi.lp_path) {
+		if (hi->lp_path) {
 			if (pool->hdr_path != NULL)
 				free(pool->hdr_path);
-			pool->hdr_path = hi.lp_path;
+			pool->hdr_path = hi->lp_path;
 		} else
 			pool->hdr_path = NULL;
-		if (hi.stratum_url) {
-			pool->stratum_url = hi.stratum_url;
-			hi.stratum_url = NULL;
+		if (hi->stratum_url) {
+			pool->stratum_url = hi->stratum_url;
+			hi->stratum_url = NULL;
 		}
 	} else {
-		if (hi.lp_path) {
-			free(hi.lp_path);
-			hi.lp_path = NULL;
+		if (hi->lp_path) {
+			free(hi->lp_path);
+			hi->lp_path = NULL;
 		}
-		if (hi.stratum_url) {
-			free(hi.stratum_url);
-			hi.stratum_url = NULL;
+		if (hi->stratum_url) {
+			free(hi->stratum_url);
+			hi->stratum_url = NULL;
 		}
 	}
 
-	*rolltime = hi.rolltime;
-	pool->cgminer_pool_stats.rolltime = hi.rolltime;
-	pool->cgminer_pool_stats.hadrolltime = hi.hadrolltime;
-	pool->cgminer_pool_stats.canroll = hi.canroll;
-	pool->cgminer_pool_stats.hadexpire = hi.hadexpire;
+	*rolltime = hi->rolltime;
+	pool->cgminer_pool_stats.rolltime = hi->rolltime;
+	pool->cgminer_pool_stats.hadrolltime = hi->hadrolltime;
+	pool->cgminer_pool_stats.canroll = hi->canroll;
+	pool->cgminer_pool_stats.hadexpire = hi->hadexpire;
 
-	val = JSON_LOADS(all_data.buf, &err);
+	val = JSON_LOADS(req->all_data.buf, &err);
 	if (!val) {
 		applog(LOG_INFO, "JSON decode failed(%d): %s", err.line, err.text);
 
 		if (opt_protocol)
-			applog(LOG_DEBUG, "JSON protocol response:\n%s", (char *)(all_data.buf));
+			applog(LOG_DEBUG, "JSON protocol response:\n%s", (char *)(req->all_data.buf));
 
 		goto err_out;
 	}
@@ -762,26 +786,41 @@ json_t *json_rpc_call(CURL *curl, const char *url,
 		goto err_out;
 	}
 
-	if (hi.reason) {
-		json_object_set_new(val, "reject-reason", json_string(hi.reason));
-		free(hi.reason);
-		hi.reason = NULL;
+	if (hi->reason) {
+		json_object_set_new(val, "reject-reason", json_string(hi->reason));
+		free(hi->reason);
+		hi->reason = NULL;
 	}
 	successful_connect = true;
-	databuf_free(&all_data);
-	curl_slist_free_all(headers);
+	databuf_free(&req->all_data);
+	curl_slist_free_all(req->headers);
 	curl_easy_reset(curl);
+	free(req);
 	return val;
 
 err_out:
-	databuf_free(&all_data);
-	curl_slist_free_all(headers);
+	databuf_free(&req->all_data);
+	curl_slist_free_all(req->headers);
 	curl_easy_reset(curl);
 	if (!successful_connect)
 		applog(LOG_DEBUG, "Failed to connect in json_rpc_call");
 	curl_easy_setopt(curl, CURLOPT_FRESH_CONNECT, 1);
+	free(req);
 	return NULL;
 }
+
+json_t *json_rpc_call(CURL *curl, const char *url,
+		      const char *userpass, const char *rpc_req,
+		      bool probe, bool longpoll, int *rolltime,
+		      struct pool *pool, bool share)
+{
+	struct json_rpc_req *req;
+	int rc;
+
+	req = json_rpc_setup(curl, url, userpass, rpc_req, probe, longpoll, pool, share);
+	rc = curl_easy_perform(curl);
+	return json_rpc_result(req, rc, rolltime);
+}
 #define PROXY_HTTP	CURLPROXY_HTTP
 #define PROXY_HTTP_1_0	CURLPROXY_HTTP_1_0
 #define PROXY_SOCKS4	CURLPROXY_SOCKS4
@@ -1225,6 +1264,35 @@ out:
 	return rval;
 }
 
+/* As tq_pop but gives up after ms milliseconds, not waiting at all if ms is 0 */
+void *tq_pop_ms(struct thread_q *tq, int ms)
+{
+	struct tq_ent *ent;
+	void *rval = NULL;
+
+	mutex_lock(&tq->mutex);
+	if (list_empty(&tq->q) && ms > 0) {
+		struct timespec abstime, tdiff;
+
+		cgcond_time(&abstime);
+		ms_to_timespec(&tdiff, ms);
+		timeraddspec(&abstime, &tdiff);
+		pthread_cond_timedwait(&tq->cond, &tq->mutex, &abstime);
+	}
+	if (list_empty(&tq->q))
+		goto out;
+
+	ent = list_entry(tq->q.next, struct tq_ent, q_node);
+	rval = ent->data;
+
+	list_del(&ent->q_node);
+	free(ent);
+out:
+	mutex_unlock(&tq->mutex);
+
+	return rval;
+}
+
 int thr_info_create(struct thr_info *thr, pthread_attr_t *attr, void *(*start) (void *), void *arg)
 {
 	cgsem_init(&thr->sem);
@@ -1869,6 +1937,112 @@ bool stratum_send(struct pool *pool, char *s, ssize_t len)
 	return (ret == SEND_OK);
 }
 
+/* Send a batch of commands, each already \n terminated, in as few calls as
+ * the socket allows, counting the commands written out in full in done. As
+ * with __stratum_send this should be done under stratum lock, which keeps
+ * other commands from landing mid batch. */
+static enum send_ret __stratum_send_batch(struct pool *pool, char **msgs, size_t *lens, int count,
+					  int *done)
+{
+	SOCKETTYPE sock = pool->sock;
+	size_t ofs = 0;
+	ssize_t ssent = 0;
+	int i = 0;
+
+	while (i < count) {
+		struct timeval timeout = {1, 0};
+		ssize_t sent;
+		fd_set wd;
+retry:
+		FD_ZERO(&wd);
+		FD_SET(sock, &wd);
+		if (select(sock + 1, NULL, &wd, NULL, &timeout) < 1) {
+			if (interrupted())
+				goto retry;
+			return SEND_SELECTFAIL;
+		}
+#ifndef WIN32
+		{
+			struct iovec iov[STRATUM_BATCH_MAX];
+			struct msghdr msg;
+			int j;
+
+			for (j = 0; i + j < count && j < STRATUM_BATCH_MAX; j++) {
+				iov[j].iov_base = msgs[i + j] + (j ? 0 : ofs);
+				iov[j].iov_len = lens[i + j] - (j ? 0 : ofs);
+			}
+			memset(&msg, 0, sizeof(msg));
+			msg.msg_iov = iov;
+			msg.msg_iovlen = j;
+#ifdef MSG_NOSIGNAL
+			sent = sendmsg(sock, &msg, MSG_NOSIGNAL);
+#else
+			sent = sendmsg(sock, &msg, 0);
+#endif
+		}
+#else
+		sent = send(sock, msgs[i] + ofs, lens[i] - ofs, 0);
+#endif
+		if (sent < 0) {
+			if (!sock_blocks())
+				return SEND_SENDFAIL;
+			sent = 0;
+		}
+		ssent += sent;
+		/* Step over everything written, possibly ending mid message */
+		while (i < count && (size_t)sent >= lens[i] - ofs) {
+			sent -= lens[i] - ofs;
+			ofs = 0;
+			*done = ++i;
+		}
+		ofs += sent;
+	}
+
+	pool->cgminer_pool_stats.times_sent += count;
+	pool->cgminer_pool_stats.bytes_sent += ssent;
+	pool->cgminer_pool_stats.net_bytes_sent += ssent;
+	return SEND_OK;
+}
+
+/* Returns how many of the commands were written out in full, which is less
+ * than count when the send failed part way through the batch */
+int stratum_send_batch(struct pool *pool, char **msgs, size_t *lens, int count)
+{
+	enum send_ret ret = SEND_INACTIVE;
+	int done = 0;
+
+	if (opt_protocol) {
+		int i;
+
+		for (i = 0; i < count; i++)
+			applog(LOG_DEBUG, "SEND: %.*s", (int)lens[i] - 1, msgs[i]);
+	}
+
+	mutex_lock(&pool->stratum_lock);
+	if (pool->stratum_active)
+		ret = __stratum_send_batch(pool, msgs, lens, count, &done);
+	mutex_unlock(&pool->stratum_lock);
+
+	/* This is to avoid doing applog under stratum_lock */
+	switch (ret) {
+		default:
+		case SEND_OK:
+			break;
+		case SEND_SELECTFAIL:
+			applog(LOG_DEBUG, "Write select failed on pool %d sock", pool->pool_no);
+			suspend_stratum(pool);
+			break;
+		case SEND_SENDFAIL:
+			applog(LOG_DEBUG, "Failed to send in stratum_send_batch");
+			suspend_stratum(pool);
+			break;
+		case SEND_INACTIVE:
+			applog(LOG_DEBUG, "Stratum send failed due to no pool stratum_active");
+			break;
+	}
+	return done;
+}
+
 static bool socket_full(struct pool *pool, int wait)
 {
 	SOCKETTYPE sock = pool->sock;
@@ -1889,7 +2063,7 @@ static bool socket_full(struct pool *pool, int wait)
 /* Check to see if Santa's been good to you */
 bool sock_full(struct pool *pool)
 {
-	if (strlen(pool->sockbuf))
+	if (pool->sockbuf_end > pool->sockbuf_start)
 		return true;
 
 	return (socket_full(pool, 0));
@@ -1897,8 +2071,8 @@ bool sock_full(struct pool *pool)
 
 static void clear_sockbuf(struct pool *pool)
 {
-	if (likely(pool->sockbuf))
-		strcpy(pool->sockbuf, "");
+	pool->sockbuf_start = pool->sockbuf_end = pool->sockbuf_scan = 0;
+	pool->sockbuf_gen++;
 }
 
 static void clear_sock(struct pool *pool)
@@ -1908,7 +2082,7 @@ static void clear_sock(struct pool *pool)
 	mutex_lock(&pool->stratum_lock);
 	do {
 		if (pool->sock)
-			n = recv(pool->sock, pool->sockbuf, RECVSIZE, 0);
+			n = recv(pool->sock, pool->sockbuf, pool->sockbuf_size, 0);
 		else
 			n = 0;
 	} while (n > 0);
@@ -1927,34 +2101,89 @@ void ckrecalloc(void **ptr, size_t old, size_t new, const char *file, const char
 		memset(*ptr + old, 0, new - old);
 }
 
-/* Make sure the pool sockbuf is large enough to cope with any coinbase size
- * by reallocing it to a large enough size rounded up to a multiple of RBUFSIZE
- * and zeroing the new memory */
-static void recalloc_sock(struct pool *pool, size_t len)
+/* Make sure there is at least half of RBUFSIZE free after the end of the
+ * received data in the pool sockbuf. Data is only moved when it runs out of
+ * room and then only the partial line left at the end, growing sockbuf in
+ * multiples of RBUFSIZE to cope with any coinbase size. */
+static void reserve_sockbuf(struct pool *pool)
 {
-	size_t old, new;
+	size_t pending = pool->sockbuf_end - pool->sockbuf_start;
 
-	old = strlen(pool->sockbuf);
-	new = old + len + 1;
-	if (new < pool->sockbuf_size)
+	if (!pending && pool->sockbuf_end) {
+		clear_sockbuf(pool);
 		return;
-	new = new + (RBUFSIZE - (new % RBUFSIZE));
+	}
+	if (pool->sockbuf_size - pool->sockbuf_end > RBUFSIZE / 2)
+		return;
+
+	pool->sockbuf_gen++;
+	if (pool->sockbuf_start) {
+		memmove(pool->sockbuf, pool->sockbuf + pool->sockbuf_start, pending);
+		pool->sockbuf_scan -= pool->sockbuf_start;
+		pool->sockbuf_start = 0;
+		pool->sockbuf_end = pending;
+		if (pool->sockbuf_size - pending > RBUFSIZE / 2)
+			return;
+	}
 	// Avoid potentially recursive locking
-	// applog(LOG_DEBUG, "Recallocing pool sockbuf to %d", new);
-	pool->sockbuf = cgrealloc(pool->sockbuf, new);
-	memset(pool->sockbuf + old, 0, new - old);
-	pool->sockbuf_size = new;
+	// applog(LOG_DEBUG, "Reallocing pool sockbuf to %d", new);
+	pool->sockbuf_size += RBUFSIZE;
+	pool->sockbuf = cgrealloc(pool->sockbuf, pool->sockbuf_size);
 }
 
-/* Peeks at a socket to find the first end of line and then reads just that
- * from the socket and returns that as a malloced char */
-char *recv_line(struct pool *pool)
+/* Find the \n ending the next line in the received data, skipping empty
+ * lines and only searching data that hasn't been searched already. */
+static char *sockbuf_line_end(struct pool *pool)
+{
+	char *nl;
+
+	while (pool->sockbuf_scan < pool->sockbuf_end) {
+		nl = memchr(pool->sockbuf + pool->sockbuf_scan, '\n',
+			    pool->sockbuf_end - pool->sockbuf_scan);
+		if (!nl) {
+			pool->sockbuf_scan = pool->sockbuf_end;
+			break;
+		}
+		if (nl == pool->sockbuf + pool->sockbuf_start) {
+			pool->sockbuf_start = pool->sockbuf_scan = pool->sockbuf_start + 1;
+			continue;
+		}
+		return nl;
+	}
+	return NULL;
+}
+
+/* NUL terminates the line at the front of the sockbuf ending at end, and
+ * moves past it. */
+static char *sockbuf_take_line(struct pool *pool, char *end)
 {
-	char *tok, *sret = NULL;
-	ssize_t len, buflen;
+	char *sret = pool->sockbuf + pool->sockbuf_start;
+	ssize_t len = end - sret;
+
+	*end = '\0';
+	pool->sockbuf_start = pool->sockbuf_scan = sret + len + 1 - pool->sockbuf;
+	if (pool->sockbuf_start > pool->sockbuf_end)
+		pool->sockbuf_start = pool->sockbuf_scan = pool->sockbuf_end;
+
+	pool->cgminer_pool_stats.times_received++;
+	pool->cgminer_pool_stats.bytes_received += len;
+	pool->cgminer_pool_stats.net_bytes_received += len;
+	if (opt_protocol)
+		applog(LOG_DEBUG, "RECVD: %s", sret);
+	return sret;
+}
+
+/* Returns the next \n terminated line from the pool's socket, waiting for
+ * one to arrive if none is buffered. The line is NUL terminated in place in
+ * the pool sockbuf rather than copied, so it is only valid until anything
+ * else receives on or clears this pool's socket, which bumps sockbuf_gen. */
+char *recv_line_view(struct pool *pool)
+{
+	char *nl, *sret = NULL;
 	int waited = 0;
 
-	if (!strstr(pool->sockbuf, "\n")) {
+	nl = sockbuf_line_end(pool);
+	if (!nl) {
 		struct timeval rstart, now;
 
 		cgtime(&rstart);
@@ -1964,12 +2193,12 @@ char *recv_line(struct pool *pool)
 		}
 
 		do {
-			char s[RBUFSIZE];
-			size_t slen;
 			ssize_t n;
 
-			memset(s, 0, RBUFSIZE);
-			n = recv(pool->sock, s, RECVSIZE, 0);
+			/* Always leave room for a terminating \0 */
+			reserve_sockbuf(pool);
+			n = recv(pool->sock, pool->sockbuf + pool->sockbuf_end,
+				 pool->sockbuf_size - pool->sockbuf_end - 1, 0);
 			if (!n) {
 				applog(LOG_DEBUG, "Socket closed waiting in recv_line");
 				suspend_stratum(pool);
@@ -1984,37 +2213,70 @@ char *recv_line(struct pool *pool)
 					break;
 				}
 			} else {
-				slen = strlen(s);
-				recalloc_sock(pool, slen);
-				strcat(pool->sockbuf, s);
+				pool->sockbuf_end += n;
+				nl = sockbuf_line_end(pool);
 			}
-		} while (waited < DEFAULT_SOCKWAIT && !strstr(pool->sockbuf, "\n"));
+		} while (waited < DEFAULT_SOCKWAIT && !nl);
 	}
 
-	buflen = strlen(pool->sockbuf);
-	tok = strtok(pool->sockbuf, "\n");
-	if (!tok) {
+	if (nl)
+		sret = sockbuf_take_line(pool, nl);
+	else if (pool->sockbuf_end > pool->sockbuf_start) {
+		/* Hand out whatever partial line we have if no \n came */
+		sret = sockbuf_take_line(pool, pool->sockbuf + pool->sockbuf_end);
+	} else
 		applog(LOG_DEBUG, "Failed to parse a \\n terminated string in recv_line");
-		goto out;
-	}
-	sret = strdup(tok);
-	len = strlen(sret);
-
-	/* Copy what's left in the buffer after the \n, including the
-	 * terminating \0 */
-	if (buflen > len + 1)
-		memmove(pool->sockbuf, pool->sockbuf + len + 1, buflen - len + 1);
-	else
-		strcpy(pool->sockbuf, "");
-
-	pool->cgminer_pool_stats.times_received++;
-	pool->cgminer_pool_stats.bytes_received += len;
-	pool->cgminer_pool_stats.net_bytes_received += len;
 out:
 	if (!sret)
 		clear_sock(pool);
-	else if (opt_protocol)
-		applog(LOG_DEBUG, "RECVD: %s", sret);
+	return sret;
+}
+
+/* Returns the next complete line already received into the pool sockbuf
+ * without touching the socket, or NULL if there isn't one. The same rules
+ * apply to the returned line as for recv_line_view. */
+char *sockbuf_line_view(struct pool *pool)
+{
+	char *nl = sockbuf_line_end(pool);
+
+	if (!nl)
+		return NULL;
+	return sockbuf_take_line(pool, nl);
+}
+
+/* Does a single non blocking recv on the pool's socket into its sockbuf.
+ * Returns the number of bytes received, 0 if there was nothing to read or
+ * -1 if the connection was closed or failed. */
+int recv_sockbuf(struct pool *pool)
+{
+	ssize_t n;
+
+	do {
+		reserve_sockbuf(pool);
+		n = recv(pool->sock, pool->sockbuf + pool->sockbuf_end,
+			 pool->sockbuf_size - pool->sockbuf_end - 1, MSG_DONTWAIT);
+	} while (n < 0 && interrupted());
+
+	if (n > 0) {
+		pool->sockbuf_end += n;
+		return n;
+	}
+	if (n < 0 && sock_blocks())
+		return 0;
+	if (!n)
+		applog(LOG_DEBUG, "Socket closed waiting in recv_sockbuf");
+	else
+		applog(LOG_DEBUG, "Failed to recv sock in recv_sockbuf");
+	return -1;
+}
+
+/* As recv_line_view but returns the line as a malloced char */
+char *recv_line(struct pool *pool)
+{
+	char *sret = recv_line_view(pool);
+
+	if (sret)
+		sret = strdup(sret);
 	return sret;
 }
 
@@ -2084,124 +2346,19 @@ static void decode_exit(struct pool __maybe_unused *pool, char __maybe_unused *b
 }
 #endif
 
-static int calculate_num_bits(int num)
-{
-	int ret=0;
-	while(num != 0)
-	{
-		ret++;
-		num /= 16;
-	}
-	return ret;
-}
-
-static void get_vmask(struct pool *pool, char *bbversion)
-{
-	char defaultStr[9]= "00000000";
-	int bversion, num_bits, i, j;
-	uint8_t buffer[4] = {};
-	uint32_t uiMagicNum;
-	char *tmpstr;
-	uint32_t *p1;
-
-	p1 = (uint32_t *)buffer;
-	bversion = strtol(bbversion, NULL, 16);
-
-	for (i = 0; i < 4; i++) {
-		uiMagicNum = bversion | pool->vmask_003[i];
-		//printf("[ccx]uiMagicNum:0x%x. \n", uiMagicNum);
-		*p1 = bswap_32(uiMagicNum);
-
-		//printf("[ccx]*p1:0x%x. \n", *p1);
-		switch(i) {
-			case 0:
-				pool->vmask_001[8] = *p1;
-				break;
-			case 1:
-				pool->vmask_001[4] = *p1;
-				break;
-			case 2:
-				pool->vmask_001[2] = *p1;
-				break;
-			case 3:
-				pool->vmask_001[0] = *p1;
-				break;
-			default:
-				break;
-		}
-	}
-
-	for (i = 0; i < 16; i++) {
-		if ((i!= 2) && (i!=4) && (i!=8))
-			pool->vmask_001[i] = pool->vmask_001[0];
-	}
-
-	for (i = 0; i < 16; i++)
-		memcpy(pool->vmask_002[i], defaultStr, 9);
-
-	for (i = 0; i < 3; i++) {
-		char cMask[12];
-
-		tmpstr = (char *)cgcalloc(9, 1);
-		num_bits = calculate_num_bits(pool->vmask_003[i]);
-		for (j = 0; j < (8-num_bits); j++)
-			tmpstr[j] = '0';
-
-		snprintf(cMask, 9, "%x", pool->vmask_003[i]);
-		memcpy(tmpstr + 8 - num_bits, cMask, num_bits);
-		tmpstr[8] = '\0';
-
-		//printf("[ccx]tmpstr:%s. \n", tmpstr);
-		switch(i) {
-			case 0:
-				memcpy(pool->vmask_002[8], tmpstr, 9);
-				break;
-			case 1:
-				memcpy(pool->vmask_002[4], tmpstr, 9);
-				break;
-			case 2:
-				memcpy(pool->vmask_002[2], tmpstr, 9);
-				break;
-			default:
-				break;
-		}
-		free(tmpstr);
-	}
-}
-
 static bool set_vmask(struct pool *pool, json_t *val)
 {
-	int mask, tmpMask = 0, cnt = 0, i, rem;
 	const char *version_mask;
+	uint32_t mask;
 
 	version_mask = json_string_value(val);
 	applog(LOG_INFO, "Pool %d version_mask:%s.", pool->pool_no, version_mask);
 
-	mask = strtol(version_mask, NULL, 16);
+	mask = strtoul(version_mask, NULL, 16);
 	if (!mask)
 		return false;
 
-	pool->vmask_003[0] = mask;
-
-	while (mask % 16 == 0) {
-		cnt++;
-		mask /= 16;
-	}
-
-	if ((rem = mask % 16))
-		tmpMask = rem;
-	else if ((rem = mask % 8))
-		tmpMask = rem;
-	else if ((rem = mask % 4))
-		tmpMask = rem;
-	else if ((rem = mask % 2))
-		tmpMask = rem;
-
-	for (i = 0; i < cnt; i++)
-		tmpMask *= 16;
-	pool->vmask_003[2] = tmpMask;
-	pool->vmask_003[1] = pool->vmask_003[0] - tmpMask;
-
+	pool->vmask_bits = mask;
 	return true;
 }
 
@@ -2241,7 +2398,7 @@ static bool configure_stratum_mining(struct pool *pool)
 		 "[[\""STRATUM_VERSION_ROLLING"\"], "
 		 "{\""STRATUM_VERSION_ROLLING".mask\": \"%x\""
 		 "}]}",
-	  swork_id++, 0xffffffff);
+	  __atomic_fetch_add(&swork_id, 1, __ATOMIC_RELAXED), 0xffffffff);
 
 	if (__stratum_send(pool, s, strlen(s)) != SEND_OK) {
 		applog(LOG_DEBUG, "Failed to send mining.configure");
@@ -2328,8 +2485,6 @@ static bool parse_notify(struct pool *pool, json_t *val)
 	ntime = __json_array_string(val, 7);
 	clean = json_is_true(json_array_get(val, 8));
 
-	get_vmask(pool, bbversion);
-
 	if (!valid_ascii(job_id) || !valid_hex(prev_hash) || !valid_hex(coinbase1) ||
 	    !valid_hex(coinbase2) || !valid_hex(bbversion) || !valid_hex(nbit) ||
 	    !valid_hex(ntime)) {
@@ -2341,6 +2496,9 @@ static bool parse_notify(struct pool *pool, json_t *val)
 	}
 
 	cg_wlock(&pool->data_lock);
+	/* Any work generated from another job is now stale */
+	if (!pool->swork.job_id || strcmp(pool->swork.job_id, job_id))
+		__atomic_add_fetch(&pool->job_gen, 1, __ATOMIC_RELEASE);
 	free(pool->swork.job_id);
 	pool->swork.job_id = job_id;
 	if (memcmp(pool->prev_hash, prev_hash, 64)) {
@@ -2361,6 +2519,7 @@ static bool parse_notify(struct pool *pool, json_t *val)
 	}
 	alloc_len = pool->coinbase_len = cb1_len + pool->n1_len + pool->n2size + cb2_len;
 	pool->nonce2_offset = cb1_len + pool->n1_len;
+	pool->cb_prefix_len = 0;
 
 	for (i = 0; i < pool->merkles; i++)
 		free(pool->swork.merkle_bin[i]);
@@ -2429,6 +2588,16 @@ static bool parse_notify(struct pool *pool, json_t *val)
 	if (pool->n1_len)
 		cg_memcpy(pool->coinbase + cb1_len, pool->nonce1bin, pool->n1_len);
 	cg_memcpy(pool->coinbase + cb1_len + pool->n1_len + pool->n2size, cb2, cb2_len);
+	/* Everything up to nonce2 is fixed for this job so hash its whole blocks
+	 * once here and let gen_stratum_work resume from that state */
+	pool->cb_prefix_len = pool->nonce2_offset & ~(SHA256_BLOCK_SIZE - 1);
+	if (pool->cb_prefix_len) {
+		sha256_ctx ctx;
+
+		sha256_init(&ctx);
+		sha256_update(&ctx, pool->coinbase, pool->cb_prefix_len);
+		cg_memcpy(pool->cb_midstate, ctx.h, sizeof(pool->cb_midstate));
+	}
 	if (opt_debug || opt_decode) {
 		char *cb = bin2hex(pool->coinbase, pool->coinbase_len);
 
@@ -2566,7 +2735,37 @@ static bool parse_reconnect(struct pool *pool, json_t *val)
 	free(tmp);
 	mutex_unlock(&pool->stratum_lock);
 
+#ifdef STRATUM_REACTOR
+	/* The reactor notices the socket has gone and reconnects from a thread
+	 * of its own rather than blocking every other pool while we do. */
+	return true;
+#else
 	return restart_stratum(pool);
+#endif
+}
+
+/* Under the stratum reactor parse_method runs on the one thread servicing
+ * every pool, so rather than block it on a slow socket, replies are handed to
+ * the pool's stratum send thread. */
+static bool stratum_reply(struct pool *pool, char *s)
+{
+#ifdef STRATUM_REACTOR
+	if (likely(pool->stratum_q)) {
+		size_t len = strlen(s);
+		char *reply = cgmalloc(len + 2);
+
+		/* Leave room for the \n stratum_send appends */
+		memcpy(reply, s, len + 1);
+		if (unlikely(!tq_push(pool->stratum_rq, reply))) {
+			free(reply);
+			return false;
+		}
+		/* An empty entry just wakes stratum_sthread */
+		tq_push(pool->stratum_q, NULL);
+		return true;
+	}
+#endif
+	return stratum_send(pool, s, strlen(s));
 }
 
 static bool send_version(struct pool *pool, json_t *val)
@@ -2580,7 +2779,7 @@ static bool send_version(struct pool *pool, json_t *val)
 	id = json_integer_value(json_object_get(val, "id"));
 
 	sprintf(s, "{\"id\": %d, \"result\": \""PACKAGE"/"VERSION""STRATUM_USER_AGENT"\", \"error\": null}", id);
-	if (!stratum_send(pool, s, strlen(s)))
+	if (!stratum_reply(pool, s))
 		return false;
 
 	return true;
@@ -2597,7 +2796,7 @@ static bool send_pong(struct pool *pool, json_t *val)
 	id = json_integer_value(json_object_get(val, "id"));
 
 	sprintf(s, "{\"id\": %d, \"result\": \"pong\", \"error\": null}", id);
-	if (!stratum_send(pool, s, strlen(s)))
+	if (!stratum_reply(pool, s))
 		return false;
 
 	return true;
@@ -2730,7 +2929,7 @@ bool auth_stratum(struct pool *pool)
 	bool ret = false;
 
 	sprintf(s, "{\"id\": %d, \"method\": \"mining.authorize\", \"params\": [\"%s\", \"%s\"]}",
-		swork_id++, pool->rpc_user, pool->rpc_pass);
+		__atomic_fetch_add(&swork_id, 1, __ATOMIC_RELAXED), pool->rpc_user, pool->rpc_pass);
 
 	if (!stratum_send(pool, s, strlen(s)))
 		return ret;
@@ -2773,7 +2972,7 @@ bool auth_stratum(struct pool *pool)
 
 	if (opt_suggest_diff) {
 		sprintf(s, "{\"id\": %d, \"method\": \"mining.suggest_difficulty\", \"params\": [%d]}",
-			swork_id++, opt_suggest_diff);
+			__atomic_fetch_add(&swork_id, 1, __ATOMIC_RELAXED), opt_suggest_diff);
 		stratum_send(pool, s, strlen(s));
 	}
 out:
@@ -3151,7 +3350,10 @@ retry:
 		pool->sockbuf_size = RBUFSIZE;
 	}
 
+	mutex_lock(&pool->stratum_lock);
 	pool->sock = sockd;
+	pool->sock_gen++;
+	mutex_unlock(&pool->stratum_lock);
 	keep_sockalive(sockd);
 	return true;
 }
@@ -3219,12 +3421,12 @@ resend:
 		goto out;
 
 	if (recvd) {
-		sprintf(s, "{\"id\": %d, \"method\": \"mining.subscribe\", \"params\": []}", swork_id++);
+		sprintf(s, "{\"id\": %d, \"method\": \"mining.subscribe\", \"params\": []}", __atomic_fetch_add(&swork_id, 1, __ATOMIC_RELAXED));
 	} else {
 		if (pool->sessionid)
-			sprintf(s, "{\"id\": %d, \"method\": \"mining.subscribe\", \"params\": [\""PACKAGE"/"VERSION""STRATUM_USER_AGENT"\", \"%s\"]}", swork_id++, pool->sessionid);
+			sprintf(s, "{\"id\": %d, \"method\": \"mining.subscribe\", \"params\": [\""PACKAGE"/"VERSION""STRATUM_USER_AGENT"\", \"%s\"]}", __atomic_fetch_add(&swork_id, 1, __ATOMIC_RELAXED), pool->sessionid);
 		else
-			sprintf(s, "{\"id\": %d, \"method\": \"mining.subscribe\", \"params\": [\""PACKAGE"/"VERSION""STRATUM_USER_AGENT"\"]}", swork_id++);
+			sprintf(s, "{\"id\": %d, \"method\": \"mining.subscribe\", \"params\": [\""PACKAGE"/"VERSION""STRATUM_USER_AGENT"\"]}", __atomic_fetch_add(&swork_id, 1, __ATOMIC_RELAXED));
 	}
 
 	if (__stratum_send(pool, s, strlen(s)) != SEND_OK) {
@@ -3437,6 +3639,45 @@ void *realloc_strcat(char *ptr, char *s)
 	return ret;
 }
 
+/* Reference counted immutable strings. The count lives in front of the
+ * characters so the result can be used as any other char *, but it must only
+ * be released with cgstr_put. */
+struct cgstr {
+	int refs;
+	char str[];
+};
+
+char *cgstr_new(const char *s)
+{
+	size_t len = strlen(s) + 1;
+	struct cgstr *cs = cgmalloc(sizeof(struct cgstr) + len);
+
+	cs->refs = 1;
+	memcpy(cs->str, s, len);
+	return cs->str;
+}
+
+char *cgstr_get(char *s)
+{
+	if (s) {
+		struct cgstr *cs = (struct cgstr *)(s - offsetof(struct cgstr, str));
+
+		__atomic_add_fetch(&cs->refs, 1, __ATOMIC_RELAXED);
+	}
+	return s;
+}
+
+void cgstr_put(char *s)
+{
+	struct cgstr *cs;
+
+	if (!s)
+		return;
+	cs = (struct cgstr *)(s - offsetof(struct cgstr, str));
+	if (!__atomic_sub_fetch(&cs->refs, 1, __ATOMIC_ACQ_REL))
+		free(cs);
+}
+
 /* Make a text readable version of a string using 0xNN for < ' ' or > '~'
  * Including 0x00 at the end
  * You must free the result yourself */
@@ -3650,6 +3891,73 @@ void cgsem_destroy(cgsem_t *cgsem)
 }
 #endif
 
+/* Each cell carries a sequence number telling producers and consumers whose
+ * turn it is, so a slot is only claimed with one compare and swap on the
+ * head or tail position. size must be a power of 2. */
+void _cgring_init(struct cgring *ring, int size, const char *file, const char *func, const int line)
+{
+	uint32_t i;
+
+	if (unlikely(size < 2 || (size & (size - 1))))
+		quitfrom(1, file, func, line, "Invalid cgring size %d", size);
+	ring->cells = _cgcalloc(size, sizeof(struct cgring_cell), file, func, line);
+	ring->mask = size - 1;
+	for (i = 0; i < (uint32_t)size; i++)
+		ring->cells[i].seq = i;
+	ring->head = ring->tail = 0;
+}
+
+/* Returns false if the ring is full */
+bool cgring_push(struct cgring *ring, void *data)
+{
+	uint32_t pos = __atomic_load_n(&ring->head, __ATOMIC_RELAXED);
+	struct cgring_cell *cell;
+
+	while (42) {
+		int32_t dif;
+
+		cell = &ring->cells[pos & ring->mask];
+		dif = (int32_t)(__atomic_load_n(&cell->seq, __ATOMIC_ACQUIRE) - pos);
+		if (!dif) {
+			if (__atomic_compare_exchange_n(&ring->head, &pos, pos + 1, true,
+							__ATOMIC_RELAXED, __ATOMIC_RELAXED))
+				break;
+		} else if (dif < 0)
+			return false;
+		else
+			pos = __atomic_load_n(&ring->head, __ATOMIC_RELAXED);
+	}
+	cell->data = data;
+	__atomic_store_n(&cell->seq, pos + 1, __ATOMIC_RELEASE);
+	return true;
+}
+
+/* Returns NULL if the ring is empty */
+void *cgring_pop(struct cgring *ring)
+{
+	uint32_t pos = __atomic_load_n(&ring->tail, __ATOMIC_RELAXED);
+	struct cgring_cell *cell;
+	void *data;
+
+	while (42) {
+		int32_t dif;
+
+		cell = &ring->cells[pos & ring->mask];
+		dif = (int32_t)(__atomic_load_n(&cell->seq, __ATOMIC_ACQUIRE) - (pos + 1));
+		if (!dif) {
+			if (__atomic_compare_exchange_n(&ring->tail, &pos, pos + 1, true,
+							__ATOMIC_RELAXED, __ATOMIC_RELAXED))
+				break;
+		} else if (dif < 0)
+			return NULL;
+		else
+			pos = __atomic_load_n(&ring->tail, __ATOMIC_RELAXED);
+	}
+	data = cell->data;
+	__atomic_store_n(&cell->seq, pos + ring->mask + 1, __ATOMIC_RELEASE);
+	return data;
+}
+
 /* Provide a completion_timeout helper function for unreliable functions that
  * may die due to driver issues etc that time out if the function fails and
  * can then reliably return. */
@@ -97,6 +97,20 @@ typedef struct cgsem cgsem_t;
 #else
 typedef sem_t cgsem_t;
 #endif
+/* Bounded lock free multi producer multi consumer ring of pointers. The
+ * producer and consumer positions live on separate cache lines. */
+struct cgring_cell {
+	uint32_t seq;
+	void *data;
+};
+
+struct cgring {
+	struct cgring_cell *cells;
+	uint32_t mask;
+	uint32_t head __attribute__((aligned(64)));
+	uint32_t tail __attribute__((aligned(64)));
+};
+
 #ifdef WIN32
 typedef LARGE_INTEGER cgtimer_t;
 #else
@@ -153,9 +167,15 @@ double us_tdiff(struct timeval *end, struct timeval *start);
 int ms_tdiff(struct timeval *end, struct timeval *start);
 double tdiff(struct timeval *end, struct timeval *start);
 bool stratum_send(struct pool *pool, char *s, ssize_t len);
+/* Most commands stratum_send_batch will hand the socket in one call */
+#define STRATUM_BATCH_MAX 64
+int stratum_send_batch(struct pool *pool, char **msgs, size_t *lens, int count);
 bool sock_full(struct pool *pool);
 void ckrecalloc(void **ptr, size_t old, size_t new, const char *file, const char *func, const int line);
 #define recalloc(ptr, old, new) ckrecalloc((void *)&(ptr), old, new, __FILE__, __func__, __LINE__)
+char *recv_line_view(struct pool *pool);
+char *sockbuf_line_view(struct pool *pool);
+int recv_sockbuf(struct pool *pool);
 char *recv_line(struct pool *pool);
 bool parse_method(struct pool *pool, char *s);
 bool extract_sockaddr(char *url, char **sockaddr_url, char **sockaddr_port);
@@ -166,6 +186,9 @@ void suspend_stratum(struct pool *pool);
 void dev_error(struct cgpu_info *dev, enum dev_reason reason);
 void *realloc_strcat(char *ptr, char *s);
 void *str_text(char *ptr);
+char *cgstr_new(const char *s);
+char *cgstr_get(char *s);
+void cgstr_put(char *s);
 void RenameThread(const char* name);
 void _cgsem_init(cgsem_t *cgsem, const char *file, const char *func, const int line);
 void _cgsem_post(cgsem_t *cgsem, const char *file, const char *func, const int line);
@@ -173,6 +196,9 @@ void _cgsem_wait(cgsem_t *cgsem, const char *file, const char *func, const int l
 int _cgsem_mswait(cgsem_t *cgsem, int ms, const char *file, const char *func, const int line);
 void cgsem_reset(cgsem_t *cgsem);
 void cgsem_destroy(cgsem_t *cgsem);
+void _cgring_init(struct cgring *ring, int size, const char *file, const char *func, const int line);
+bool cgring_push(struct cgring *ring, void *data);
+void *cgring_pop(struct cgring *ring);
 bool cg_completion_timeout(void *fn, void *fnarg, int timeout);
 void _cg_memcpy(void *dest, const void *src, unsigned int n, const char *file, const char *func, const int line);
 
@@ -180,6 +206,7 @@ void _cg_memcpy(void *dest, const void *src, unsigned int n, const char *file, c
 #define cgsem_post(_sem) _cgsem_post(_sem, __FILE__, __func__, __LINE__)
 #define cgsem_wait(_sem) _cgsem_wait(_sem, __FILE__, __func__, __LINE__)
 #define cgsem_mswait(_sem, _timeout) _cgsem_mswait(_sem, _timeout, __FILE__, __func__, __LINE__)
+#define cgring_init(_ring, _size) _cgring_init(_ring, _size, __FILE__, __func__, __LINE__)
 #define cg_memcpy(dest, src, n) _cg_memcpy(dest, src, n, __FILE__, __func__, __LINE__)
 
 #endif /* __UTIL_H__ */